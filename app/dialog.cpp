@@ -5,41 +5,8 @@
 #include <QStandardItemModel>
 #include <QFileDialog>
 #include <QMessageBox>
-
-class commandWrapper {
-	public:
-		commandWrapper( SiProto *si, bool settoslave, QProgressBar *bar, int plannedcommandcount );
-		~commandWrapper();
-
-	private:
-		bool inslavemode;
-		SiProto *si;
-		QProgressBar *progressbar;
-};
-commandWrapper::commandWrapper( SiProto *sip, bool settoslave, QProgressBar *bar, int plannedcommandcount ) :
-		inslavemode( settoslave ),
-		si( sip ),
-		progressbar( bar )
-{
-	plannedcommandcount *= 2;
-	if ( settoslave )
-		plannedcommandcount += 4;
-	progressbar->setMaximum(plannedcommandcount);
-	progressbar->setValue(0);
-	progressbar->setStyleSheet("");
-
-	if ( settoslave )
-		si->SetMSMode(SiProto::SlaveCommunication);
-}
-
-commandWrapper::~commandWrapper()
-{
-	if ( inslavemode )
-		si->SetMSMode(SiProto::DirectCommunication);
-	if ( progressbar->value() != progressbar->maximum() ) {
-		progressbar->setStyleSheet("QProgressBar { border: 2px solid grey; border-radius: 5px; } QProgressBar::chunk { background-color: rgb(255, 0, 0);}" );
-	}
-}
+#include <QDesktopServices>
+#include <QDir>
 
 Dialog::Dialog(QWidget *parent) :
     QDialog(parent),
@@ -69,9 +36,30 @@ Dialog::Dialog(QWidget *parent) :
 	backupmodel = new QStandardItemModel(this);
 	ui->stationBackupView->setModel( backupmodel );
 
+	// Cards read before a crash or restart come back from the journal
+	QString jdir = QDesktopServices::storageLocation( QDesktopServices::DataLocation );
+	QDir().mkpath( jdir );
+	QString jfile = QDir( jdir ).filePath( "readouts.journal" );
+	SiJournalReader jr;
+	if ( QFile::exists( jfile ) && jr.open( jfile ) ) {
+		SiJournalReader::Record rec;
+		while( jr.readRecord( rec ) ) {
+			if ( rec.type == SiJournal::Card )
+				siCardRead( rec.card() );
+		}
+	}
+	if ( journal.open( jfile ) ) {
+		journal.attach( &si );
+		if ( !cardindex.open( QDir( jdir ).filePath( "readouts.index" ), jfile ) )
+			qWarning( "Can not open card index: %s", qPrintable( cardindex.lasterror ) );
+		// After the journal got the card
+		connect( &si, SIGNAL(cardRead(const SiCard &)), SLOT(siCardJournaled(SiCard)) );
+	} else
+		qWarning( "Can not open journal %s: %s", qPrintable( jfile ), qPrintable( journal.lasterror ) );
+
 	connect( &si, SIGNAL(statusMessage( const QString & ) ), SLOT(siStatusMsg(QString)) );
 	connect( &si, SIGNAL(cardRead(const SiCard &)), SLOT(siCardRead(SiCard)) );
-	connect( &si, SIGNAL(backupCard(const SiCard*)), SLOT(gotBackupSiCard(const SiCard*)) );
+	connect( &si, SIGNAL(backupCard(const SiCard &)), SLOT(gotBackupSiCard(SiCard)) );
 	connect( &si, SIGNAL(backupPunch(PunchBackupData)), SLOT(gotBackupPunch(PunchBackupData)));
 	connect( &si, SIGNAL(gotCommand(unsigned char,QByteArray,int)), SLOT(updateProgressBar()) );
 	connect( &si, SIGNAL(sentCommand(unsigned char,QByteArray)), SLOT(updateProgressBar()) );
@@ -79,6 +67,9 @@ Dialog::Dialog(QWidget *parent) :
 
 	connect( &si, SIGNAL(gotMSMode(SiProto::MSMode,int)), SLOT(gotMSMode(SiProto::MSMode)));
 	connect( &si, SIGNAL(gotTime(QDateTime,QDateTime,int)), SLOT(gotTime(QDateTime,QDateTime)) );
+	// Every time read also goes into the drift model of the station
+	clockmodel.load();
+	clockmodel.attach( &si );
 	connect( &si, SIGNAL(gotSetTime(QDateTime,int)), SLOT(gotSetTime(QDateTime)) );
 	connect( &si, SIGNAL(gotNAK()), SLOT(stopTask()) );
 	connect( &si, SIGNAL(gotSystemValue(unsigned char,QByteArray,int)), SLOT(gotSystemValu(unsigned char,QByteArray)) );
@@ -91,6 +82,7 @@ Dialog::Dialog(QWidget *parent) :
 	connect( ui->buttonBox, SIGNAL(clicked(QAbstractButton*)), SLOT(buttonClicked(QAbstractButton*)) );
 	if ( !si.searchAndOpen() )
 		qWarning( "Failed to open" );
+	si.setHotPlugEnabled( true );
 
 }
 
@@ -259,7 +251,9 @@ void Dialog::gotTime( const QDateTime &dt, const QDateTime &ct )
 		  stopTask();
 		  return;
 		} else if ( currenttask == taskSetTime ) {
-			if ( qAbs(ui->maxAverageDiff->value()) > qAbs(ui->averageDiff->text().toInt()) ) {
+			// The first round only measures the round trip
+			bool wasset = settimecount < ui->writeTrys->value();
+			if ( wasset && qAbs(ui->maxAverageDiff->value()) > qAbs(si.timeSync().offset()) ) {
 				ui->progressBar->setValue(ui->progressBar->maximum());
 				stopTask();
 				return;
@@ -268,11 +262,12 @@ void Dialog::gotTime( const QDateTime &dt, const QDateTime &ct )
 				stopTask();
 				return;
 			}
-			ui->progressBar->setMaximum(ui->progressBar->maximum()+(ui->readNumber->value()+1)*2+1);
-			QDateTime sdt = QDateTime::currentDateTime();
-			settimefix -= ui->averageDiff->text().toInt();
-			sdt = sdt.addMSecs(settimefix);
-			if ( !si.SetTime(sdt) )
+			if ( wasset ) {
+				// What is left is the station's own delay in taking the time
+				si.timeSync().learnCorrection();
+				ui->progressBar->setMaximum(ui->progressBar->maximum()+(ui->readNumber->value()+1)*2+1);
+			}
+			if ( !si.SyncTime() )
 				stopTask();
 		}
 	}
@@ -288,7 +283,11 @@ void Dialog::gotMSMode( SiProto::MSMode )
 			stopTask();
 	} else if ( currenttask == taskSetTime ) {
 		settimecount = ui->writeTrys->value();
-		if ( !si.SetTime( QDateTime::currentDateTime() ) )
+		gettimecount = ui->readNumber->value();
+		timediffcount = 0;
+		timediffsum = 0;
+		si.timeSync().reset();
+		if ( !si.GetTime() )
 			stopTask();
 	} else if ( currenttask == taskReadConf ) {
 		if ( !si.GetSystemValue(0x00,0x80) )
@@ -417,8 +416,7 @@ void Dialog::doGetTime( int count )
 void Dialog::on_setTimeButton_clicked()
 {
 	int c = ui->readNumber->value();
-	settimefix = 0;
-	startTask( taskSetTime, c+1 );
+	startTask( taskSetTime, 2*c+1 );
 }
 
 void Dialog::on_readStationConf_clicked()
@@ -429,35 +427,6 @@ void Dialog::on_readStationConf_clicked()
 	ui->operatingMode->setCurrentIndex(0);
 
 	startTask( taskReadConf, 1);
-	return;
-
-	commandWrapper cw( &si, ui->MSMode->currentIndex(), ui->progressBar, 1 );
-	Q_UNUSED( cw );
-
-	QByteArray ba;
-	if ( !si.GetSystemValue(0x00,0x80,&ba) )
-		return;
-	ui->stationCode->setValue((unsigned char )ba.at(SiProto::StationCode));
-	unsigned char protomode = (unsigned char)ba.at(SiProto::ProtocolConf);
-	if ( protomode & SiProto::FlagExtendedProtocol )
-		ui->extendedProtocol->setChecked(true);
-	if ( protomode & SiProto::FlagAutoSendOut )
-		ui->autoSend->setChecked(true);
-	unsigned char omode = ba.at(SiProto::StationMode);
-	for( int i=0;i<ui->operatingMode->count();i++ ) {
-		if ( omode != ui->operatingMode->itemData(i).toInt() )
-			continue;
-		ui->operatingMode->setCurrentIndex(i);
-		break;
-	}
-	unsigned int cblocks = (unsigned char)ba.at(SiProto::CardBlocks);
-	fillCardBlocksCombo(cblocks);
-	for( int i=0;i<ui->CardBlocks->count();i++ ) {
-		if ( ui->CardBlocks->itemData(i) == cblocks ) {
-			ui->CardBlocks->setCurrentIndex(i);
-			break;
-		}
-	}
 }
 
 void Dialog::on_writeStationConf_clicked()
@@ -467,32 +436,6 @@ void Dialog::on_writeStationConf_clicked()
 			return;
 	}
 	startTask( taskWriteConf, 3);
-	return;
-
-	commandWrapper cw( &si, ui->MSMode->currentIndex(), ui->progressBar, 3 );
-	Q_UNUSED( cw );
-
-	QByteArray ba;
-	int maddr = 0x70;
-	if ( !si.GetSystemValue(maddr,0x10,&ba) )
-		return;
-	ba[SiProto::StationCode-maddr] = ui->stationCode->value();
-	unsigned char protomode = 0;
-	if ( ui->extendedProtocol->isChecked() )
-		protomode |= (SiProto::FlagExtendedProtocol | SiProto::FlagHandshake);
-	if ( ui->autoSend->isChecked() )
-		protomode |= SiProto::FlagAutoSendOut;
-	int stmode = ui->operatingMode->itemData(ui->operatingMode->currentIndex()).toInt();
-	if ( stmode == SiProto::StationReadSICards )
-		protomode |= SiProto::FlagHandshake;
-	ba[SiProto::ProtocolConf-maddr] = protomode;
-	ba[SiProto::StationMode-maddr] = stmode;
-	if ( !si.SetSystemValue(maddr, ba ) )
-		return;
-	ba.clear();
-	ba.append(ui->CardBlocks->itemData(ui->CardBlocks->currentIndex()).toInt());
-	if ( !si.SetSystemValue(SiProto::CardBlocks, ba) )
-		return;
 }
 
 void Dialog::siStatusMsg(const QString &msg)
@@ -503,61 +446,98 @@ void Dialog::siStatusMsg(const QString &msg)
 void Dialog::on_clearSICards_clicked()
 {
    sicardmodel->clear();
+   if ( journal.isOpen() ) {
+	   journal.startNew();
+	   cardindex.update();
+   }
 }
 
 void Dialog::on_clearBackup_clicked()
 {
    backupmodel->clear();
+   backupcards.clear();
+   backuppunches.clear();
 }
 
 void Dialog::siCardRead(const SiCard &card)
 {
 	QList<QStandardItem*> rd;
 	rd.append(new QStandardItem(QString("%0").arg(card.getCardNumber())) );
-	QList<PunchingRecord> plist = card.getPunches();
+	const QList<PunchingRecord> &plist = card.getPunches();
 	for( int i=0;i<plist.count();i++ ) {
 		rd.append(new QStandardItem(QString("%1: %2").arg(plist.at(i).cn).arg(plist.at(i).time.toString())));
 	}
 	sicardmodel->appendRow(rd);
 }
 
+void Dialog::siCardJournaled(const SiCard &card)
+{
+	QList<SiCardIndex::Entry> seen = cardindex.find( card.getCardNumber() );
+	int reads = 0;
+	for( int i=0;i<seen.count();i++ ) {
+		if ( seen.at(i).type == SiJournal::Card )
+			reads++;
+	}
+	if ( reads )
+		bar->showMessage( QString( "Card %1 has been read %2 times before" ).arg( card.getCardNumber() ).arg( reads ), 5000 );
+	cardindex.update();
+}
+
 void Dialog::on_saveSICards_clicked()
 {
-   saveModelAsCSV(ui->siCards->model());
+	QString fname = exportFileName();
+	if ( fname.isEmpty() )
+		return;
+	SiExport ex( SiExport::formatForFile( fname ) );
+	if ( !ex.open( fname ) ) {
+		qWarning( "Could not open %s: %s", qPrintable( fname ), qPrintable( ex.lasterror ) );
+		return;
+	}
+	// The cards shown are the ones journaled since the last clear
+	SiJournalReader r;
+	SiJournalReader::Record rec;
+	if ( r.open( journal.fileName() ) ) {
+		while( r.readRecord( rec ) ) {
+			if ( rec.type == SiJournal::Card )
+				ex.writeCard( rec.card() );
+		}
+	}
+	if ( !ex.close() )
+		qWarning( "Could not write %s: %s", qPrintable( fname ), qPrintable( ex.lasterror ) );
 }
 
 void Dialog::on_saveStationBackup_clicked()
 {
-   saveModelAsCSV(backupmodel);
+	QString fname = exportFileName();
+	if ( fname.isEmpty() )
+		return;
+	SiExport ex( SiExport::formatForFile( fname ) );
+	if ( !ex.open( fname ) ) {
+		qWarning( "Could not open %s: %s", qPrintable( fname ), qPrintable( ex.lasterror ) );
+		return;
+	}
+	for( int i=0;i<backupcards.count();i++ )
+		ex.writeCard( backupcards.at(i) );
+	for( int i=0;i<backuppunches.count();i++ )
+		ex.writeBackupPunch( backuppunches.at(i) );
+	if ( !ex.close() )
+		qWarning( "Could not write %s: %s", qPrintable( fname ), qPrintable( ex.lasterror ) );
 }
 
-void Dialog::saveModelAsCSV(QAbstractItemModel *model)
+QString Dialog::exportFileName()
 {
 	QFileDialog fdia;
 	QStringList filters;
 	filters.append("CSV files (*.csv)");
+	filters.append("IOF XML 3.0 (*.xml)");
 	filters.append("All files (*)");
 	fdia.setNameFilters(filters);
 	fdia.setFileMode(QFileDialog::AnyFile);
 	fdia.setAcceptMode(QFileDialog::AcceptSave);
 	fdia.setDefaultSuffix(".csv");
 	if( !fdia.exec() || fdia.selectedFiles().count() == 0 )
-		return;
-	QString fname = fdia.selectedFiles().at(0);
-	QFile f( fname );
-	if ( !f.open(QFile::WriteOnly) ) {
-		qWarning( "Could not open file for writing" );
-		return;
-	}
-	QStringList il;
-	for( int i=0;i<model->rowCount();i++ ) {
-		il.clear();
-		for( int j=0;j<model->columnCount();j++ ) {
-			il.append(model->index(i,j).data().toString());
-		}
-		f.write((il.join(";")+"\n").toUtf8());
-	}
-	f.close();
+		return QString();
+	return fdia.selectedFiles().at(0);
 }
 
 void Dialog::on_readBackup_clicked()
@@ -583,6 +563,7 @@ void Dialog::readBackupBlock(int num, int total)
 
 void Dialog::gotBackupPunch(const PunchBackupData &pd)
 {
+	backuppunches.append(pd);
 	QList<QStandardItem*> rd;
 	rd.append(new QStandardItem(QString("%0").arg(pd.cn)));
 	rd.append(new QStandardItem(QString("%0").arg(pd.cardnum)));
@@ -596,12 +577,13 @@ void Dialog::gotBackupPunch(const PunchBackupData &pd)
 	ui->stationBackupView->scrollTo(backupmodel->index(backupmodel->rowCount()-1,0));
 }
 
-void Dialog::gotBackupSiCard(const SiCard *card)
+void Dialog::gotBackupSiCard(const SiCard &card)
 {
+	backupcards.append(card);
 	QList<QStandardItem*> rd;
 	rd.clear();
-	rd.append(new QStandardItem(QString("%0").arg(card->getCardNumber())) );
-	QList<PunchingRecord> plist = card->getPunches();
+	rd.append(new QStandardItem(QString("%0").arg(card.getCardNumber())) );
+	const QList<PunchingRecord> &plist = card.getPunches();
 	for( int i=0;i<plist.count();i++ ) {
 		rd.append(new QStandardItem(QString("%0-%1").arg(plist.at(i).cn).arg(plist.at(i).time.toString())));
 	}
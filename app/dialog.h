@@ -3,10 +3,13 @@
 
 #include <QDialog>
 #include "siproto.h"
+#include "sijournal.h"
+#include "sicardindex.h"
+#include "siexport.h"
+#include "siclock.h"
 
 class QStatusBar;
 class QStandardItemModel;
-class QAbstractItemModel;
 class QAbstractButton;
 
 namespace Ui {
@@ -33,11 +36,16 @@ private:
 	};
 	Ui::Dialog *ui;
 	SiProto si;
+	SiJournal journal;
+	SiCardIndex cardindex;
+	SiClockModel clockmodel;
 	bool inslavemode;
 	QStatusBar *bar;
 	QStandardItemModel *sicardmodel, *backupmodel;
+	QList<SiCard> backupcards;
+	QList<PunchBackupData> backuppunches;
 
-	void saveModelAsCSV( QAbstractItemModel * );
+	QString exportFileName();
 	void fillCardBlocksCombo( unsigned int val = 0xFF );
 	void doGetTime( int count );
 	void gotReadConf( unsigned char addr, const QByteArray &ba );
@@ -52,7 +60,6 @@ private:
 	int timediffcount;
 	int timediffsum;
 	int timemindiff, timemaxdiff;
-	int settimefix;
 	QByteArray latestconf;
 
 	QAbstractButton *cancelButton;
@@ -74,7 +81,8 @@ private slots:
  void on_getTimeButton_clicked();
  void siStatusMsg( const QString & );
  void siCardRead( const SiCard & );
- void gotBackupSiCard( const SiCard *);
+ void siCardJournaled( const SiCard & );
+ void gotBackupSiCard( const SiCard & );
  void gotBackupPunch( const PunchBackupData &);
  void readBackupBlock( int num, int total );
  void updateProgressBar();
@@ -6,6 +6,7 @@ INCLUDEPATH += .
 
 CONFIG += staticlib
 
-HEADERS += qserial.h siproto.h \
-    siproto_p.h
-SOURCES += qserial.cpp siproto.cpp crc529.c
+HEADERS += qserial.h qserialtrace.h qserialreplay.h siproto.h silatency.h siprobe.h sidevicemonitor.h stationpool.h sipunch.h sibus.h sijournal.h sicardindex.h siexport.h siarchive.h sipunchmerge.h sicourse.h siresults.h siclock.h sitimesync.h \
+    siproto_p.h stationpool_p.h \
+    silayout.h
+SOURCES += qserial.cpp qserialspeed.cpp qserialtrace.cpp qserialreplay.cpp siproto.cpp silatency.cpp siprobe.cpp sidevicemonitor.cpp stationpool.cpp sipunch.cpp sibus.cpp sijournal.cpp sicardindex.cpp siexport.cpp siarchive.cpp sipunchmerge.cpp sicourse.cpp siresults.cpp siclock.cpp sitimesync.cpp crc529.c
@@ -1,8 +1,11 @@
 
 #include "qserial.h"
+#include "qserialtrace.h"
+#include "silatency.h"
 
 #ifndef USING_PCH
-#include <QFile>
+#include <QDir>
+#include <QFileInfo>
 #include <QSocketNotifier>
 #endif
 
@@ -10,30 +13,50 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <errno.h>
 #else
 #include <windows.h>
 #endif
 #ifdef __APPLE__
 #include <sys/ioctl.h>
 #endif
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/serial.h>
+#include <errno.h>
+#include <string.h>
 
-#define DEBUG_SERIAL	1
+// In qserialspeed.cpp
+bool qserialSetCustomSpeed( int fd, int speed );
+#endif
 
 QSerial::QSerial( QObject *parent ) :
 	QIODevice( parent )
+	,rxstart(-1)
+	,rxlast(-1)
+	,txdone(-1)
 #if ( defined( __linux__ ) | defined( __APPLE__ ) )
 	,io_port( -1 )
+#ifdef __linux__
+	,oldserialflags( -1 )
+#endif
 #else
 	,fh( INVALID_HANDLE_VALUE )
 #endif
 	,readSocketNotifier(NULL)
+	,tracer(NULL)
+	,baud(0)
+	,isatend(false)
+	,lost(false)
 {
 }
 
 QSerial::~QSerial( void )
 {
+	delete tracer;
 #ifdef __linux__
 	if ( io_port != -1 ) {
+		restoreLowLatency();
 		tcsetattr( io_port, TCSANOW, &oldtio );
 	}
 #endif
@@ -53,18 +76,20 @@ bool QSerial::isOpen() const
 #endif
 }
 
-bool QSerial::open( const QString &dev, int speed )
+bool QSerial::open( const QString &dev, int speed, bool lowlatency )
 {
 	isatend = false;
+	lost = false;
+	devname = dev;
+	baud = speed;
 #if ( defined( __linux__ ) | defined( __APPLE__ ) )
-#ifdef DEBUG_SERIAL
-	logFile = new QFile( "/tmp/qserial.log", this );
-	logFile->open( QIODevice::Append );
-	QByteArray ba = "Open file:";
-	ba += dev;
-	ba += "\n";
-	logFile->write( ba );
-#endif
+	QByteArray tracedir = qgetenv( "QSERIAL_TRACE" );
+	if ( !tracer && !tracedir.isEmpty() )
+		setTraceFile( QDir( tracedir ).filePath( "qserial-"+QFileInfo( dev ).fileName()+".trace" ) );
+	if ( tracer ) {
+		QByteArray name = dev.toUtf8();
+		tracer->record( QSerialTrace::Open, name.constData(), name.length() );
+	}
 	io_port = ::open( dev.toUtf8(), O_RDWR|O_NOCTTY|O_NONBLOCK );
 	if ( io_port == -1 ) {
 		perror( "Failed to open serial" );
@@ -81,6 +106,7 @@ bool QSerial::open( const QString &dev, int speed )
 
 	bzero( &newtio, sizeof( newtio ) );
 	int s;
+	bool customspeed = false;
 	switch( speed ) {
 		case 4800:
 			s = B4800; break;
@@ -94,7 +120,12 @@ bool QSerial::open( const QString &dev, int speed )
 			s = B57600; break;
 		case 115200:
 			s = B115200; break;
+#ifdef B230400
+		case 230400:
+			s = B230400; break;
+#endif
 		default:
+			customspeed = true;
 			s = B9600; break;
 	}
 	cfsetispeed( &newtio, s );
@@ -102,12 +133,28 @@ bool QSerial::open( const QString &dev, int speed )
 	newtio.c_cflag |= CS8 | CLOCAL | CREAD;
 	newtio.c_iflag = IGNBRK | IGNPAR;
 
-	newtio.c_cc[VTIME] = 10;
-        newtio.c_cc[VMIN] = 1;
+	if ( lowlatency ) {
+		// Data is read when the socket notifier fires, so a read must
+		// return what is there instead of waiting for more.
+		newtio.c_cc[VTIME] = 0;
+		newtio.c_cc[VMIN] = 0;
+	} else {
+		newtio.c_cc[VTIME] = 10;
+		newtio.c_cc[VMIN] = 1;
+	}
 
 	tcflush( io_port, TCIFLUSH );
 
 	tcsetattr( io_port, TCSANOW, &newtio );
+#ifdef __linux__
+	if ( customspeed && speed > 0 && !setCustomSpeed( speed ) )
+		qWarning( "Failed to set speed %d, using 9600", speed );
+	if ( lowlatency )
+		setLowLatency();
+#else
+	if ( customspeed )
+		qWarning( "Unsupported speed %d, using 9600", speed );
+#endif
 
 	QIODevice::open( ReadWrite );
 	setupSocketNotifiers();
@@ -193,12 +240,75 @@ void QSerial::close( void )
 		readSocketNotifier->deleteLater();
 		readSocketNotifier = NULL;
 	}
-	::close( io_port );
-	io_port = 1;
+#ifdef __linux__
+	restoreLowLatency();
+#endif
+	if ( io_port != -1 )
+		::close( io_port );
+	io_port = -1;
 #endif
 	QIODevice::close();
 }
 
+#ifdef __linux__
+// USB serial converters (the CP210x in the stations included) hold back
+// received bytes for up to 16 ms unless the port is in low latency mode.
+bool QSerial::setLowLatency( void )
+{
+	struct serial_struct ss;
+	if ( ioctl( io_port, TIOCGSERIAL, &ss ) == -1 ) {
+		// Not a serial driver with the setting, e.g. a pty or some ACM
+		// devices, which do not buffer anyway
+		if ( errno != ENOTTY && errno != EINVAL )
+			qWarning( "Low latency mode not available: %s", strerror( errno ) );
+		return false;
+	}
+	int flags = ss.flags;
+	ss.flags |= ASYNC_LOW_LATENCY;
+	if ( ioctl( io_port, TIOCSSERIAL, &ss ) == -1 ) {
+		qWarning( "Failed to set low latency mode: %s", strerror( errno ) );
+		return false;
+	}
+	oldserialflags = flags;
+	return true;
+}
+
+// The setting outlives the file descriptor, other users of the port get
+// it back as it was
+void QSerial::restoreLowLatency( void )
+{
+	if ( io_port == -1 || oldserialflags == -1 )
+		return;
+	struct serial_struct ss;
+	if ( ioctl( io_port, TIOCGSERIAL, &ss ) != -1 ) {
+		ss.flags = oldserialflags;
+		if ( ioctl( io_port, TIOCSSERIAL, &ss ) == -1 )
+			qWarning( "Failed to restore serial flags: %s", strerror( errno ) );
+	}
+	oldserialflags = -1;
+}
+
+bool QSerial::setCustomSpeed( int speed )
+{
+	return qserialSetCustomSpeed( io_port, speed );
+}
+#endif
+
+bool QSerial::setTraceFile( const QString &file )
+{
+	delete tracer;
+	tracer = NULL;
+	if ( file.isEmpty() )
+		return true;
+	tracer = new QSerialTrace( file );
+	if ( !tracer->isRunning() ) {
+		delete tracer;
+		tracer = NULL;
+		return false;
+	}
+	return true;
+}
+
 void QSerial::setupSocketNotifiers( void )
 {
 #ifdef WIN32
@@ -214,6 +324,13 @@ void QSerial::setupSocketNotifiers( void )
 void QSerial::canReadNotification( int )
 {
 	readIntoBuffer();
+	if ( lost ) {
+		// The notifier would fire again and again on a vanished device
+		if ( readSocketNotifier )
+			readSocketNotifier->setEnabled( false );
+		emit disconnected();
+		return;
+	}
 	emit readyRead();
 }
 
@@ -224,19 +341,22 @@ void QSerial::readIntoBuffer( void )
 #if ( defined( __linux__ ) | defined( __APPLE__ ) )
 		char buf[BUFSIZ];
 	ssize_t len = 0;
-	if ( waitForReadyRead(0))
+	bool readable = waitForReadyRead(0);
+	if ( readable )
 		len = ::read( io_port, buf, BUFSIZ );
-#ifdef DEBUG_SERIAL
-	QByteArray ba = "<-("+QByteArray::number( (int)len )+") ";
-	for( int j=0;j<len;j++ )
-		ba += "0x"+QByteArray::number( (unsigned char )buf[j], 16 )+" ";
-	ba += "\n";
-	logFile->write( ba );
-#endif
 	if ( len < 1 ) {
 		isatend = true;
+		// Readable without data only happens when the device is gone,
+		// e.g. an unplugged USB adapter (EIO) or a closed pty
+		if ( readable && ( len == 0 || ( errno != EAGAIN && errno != EINTR ) ) )
+			lost = true;
 		return;
 	}
+	if ( tracer )
+		tracer->record( QSerialTrace::Read, buf, len );
+	rxlast = siMonotonicNsecs();
+	if ( buffer.isEmpty() )
+		rxstart = rxlast;
 	for( int i=0;i<len;i++ )
 		buffer.enqueue( buf[i] );
 	while( buffer.count() > MAXQUEUESIZE )
@@ -265,25 +385,22 @@ qint64 QSerial::readData(char *data, qint64 maxlen)
 		return -1;
 	} else
 		retVal = ((int)Win_BytesRead);
+	if ( tracer && retVal > 0 )
+		tracer->record( QSerialTrace::Read, data, retVal );
 	return retVal;
 #else
 	char buf[BUFSIZ];
 	ssize_t len = 0;
 	if ( waitForReadyRead(0) )
 		len = ::read( io_port, buf, BUFSIZ );
-#ifdef DEBUG_SERIAL
-	QByteArray ba = "<-("+QByteArray::number( (uint)len )+") ";
-	for( int j=0;j<len;j++ )
-		ba += "0x"+QByteArray::number( (unsigned char )buf[j], 16 )+" ";
-	ba += "\n";
-	logFile->write( ba );
-	logFile->flush();
-#endif
 	if ( len < 1 ) {
 		//qDebug( "len: %i", len );
 		//isatend = true;
 		return len;
 	}
+	if ( tracer )
+		tracer->record( QSerialTrace::Read, buf, len );
+	rxstart = rxlast = siMonotonicNsecs();
 	if ( maxlen ) 
 		memcpy( data, buf, ( len >= maxlen ? maxlen : len ) );
 	for( int i=maxlen;i<len;i++ )
@@ -304,23 +421,36 @@ qint64 QSerial::writeData(const char *data, qint64 len)
 		retVal=-1;
 	} else {
 		retVal=((int)Win_BytesWritten);
+		txdone = siMonotonicNsecs();
+		if ( tracer )
+			tracer->record( QSerialTrace::Write, data, retVal );
 	}
 
 	return retVal;
 #else
 	qint64 wlen = ::write( io_port, data, len );
-#ifdef DEBUG_SERIAL
-	QByteArray ba = "<-("+QByteArray::number( len )+") ";
-	for( int j=0;j<len;j++ )
-		ba += "0x"+QByteArray::number( (unsigned char )data[j], 16 )+" ";
-	ba += "\n";
-	logFile->write( ba );
-	logFile->flush();
-#endif
+	txdone = siMonotonicNsecs();
+	if ( tracer && wlen > 0 )
+		tracer->record( QSerialTrace::Write, data, wlen );
 	return wlen;
 #endif
 }
 
+// write() returns once the data is in the driver, the time it is on the
+// wire is what a station sees
+bool QSerial::drain()
+{
+#ifdef WIN32
+	if ( fh == INVALID_HANDLE_VALUE || !FlushFileBuffers( fh ) )
+		return false;
+#else
+	if ( io_port == -1 || tcdrain( io_port ) != 0 )
+		return false;
+#endif
+	txdone = siMonotonicNsecs();
+	return true;
+}
+
 #ifdef WIN32
 qint64 QSerial::bytesAvailable() {
 	if (isOpen()) {
@@ -17,7 +17,7 @@
 #endif
 
 class QSocketNotifier;
-class QFile;
+class QSerialTrace;
 
 class QSerial : public QIODevice
 {
@@ -27,12 +27,16 @@ class QSerial : public QIODevice
 		QSerial( QObject *parent = 0 );
 		~QSerial( void );
 
-		bool open( const QString &dev, int speed );
-		void close( void );
+		// lowlatency asks the driver to pass on every byte at once and
+		// configures reads that never block, suited to readyRead()
+		virtual bool open( const QString &dev, int speed, bool lowlatency = false );
+		virtual void close( void );
 
-		bool isOpen() const;
+		virtual bool isOpen() const;
+		// Device name of the last open()
+		QString deviceName() const { return devname; }
 		
-		qint64 bytesAvailable();
+		virtual qint64 bytesAvailable();
 #if ( defined( __linux__ ) | defined( __APPLE__ ) )
 		bool canReadLine() const;
 #endif
@@ -43,21 +47,58 @@ class QSerial : public QIODevice
 
 		bool atEnd( void ) const;
 
-		bool waitForReadyRead( int msecs );
+		virtual bool waitForReadyRead( int msecs );
+
+		// siMonotonicNsecs() when the oldest unread byte arrived
+		qint64 lastReadStart() const { return rxstart; }
+		// siMonotonicNsecs() of the last read() that returned data
+		qint64 lastRead() const { return rxlast; }
+		// siMonotonicNsecs() when the last write() returned, or when drain()
+		// saw it leave the port
+		qint64 lastWriteDone() const { return txdone; }
+		// Waits until everything written has been sent
+		bool drain();
+		// Speed of the last open()
+		int baudRate() const { return baud; }
+
+		// Traces all data to file in the QSerialTrace format, an empty
+		// name stops tracing. When QSERIAL_TRACE names a directory every
+		// opened port is traced to qserial-<device>.trace in it.
+		bool setTraceFile( const QString &file );
+		QSerialTrace *trace() const { return tracer; }
+
+	signals:
+		// The device went away while open, e.g. a USB adapter was
+		// unplugged. The port stays open until close().
+		void disconnected();
 
 	protected:
 		qint64 readData(char *data, qint64 maxlen);
 		qint64 writeData(const char *data, qint64 len);
 
+		qint64 rxstart;
+		qint64 rxlast;
+		qint64 txdone;
+		QString devname;
+
 	private slots:
 		void canReadNotification( int );
 
 	private:
 		Q_DISABLE_COPY(QSerial)
 		void setupSocketNotifiers( void );
+#ifdef __linux__
+		bool setLowLatency( void );
+		void restoreLowLatency( void );
+		bool setCustomSpeed( int speed );
+#endif
 #if ( defined( __linux__ ) | defined( __APPLE__ ) )
 		struct termios newtio, oldtio;
 		int io_port;
+#ifdef __linux__
+		// serial_struct flags before setLowLatency(), -1 if not changed
+		int oldserialflags;
+#endif
 #else
 		HANDLE fh;
 
@@ -79,7 +120,9 @@ class QSerial : public QIODevice
 
 		QSocketNotifier *readSocketNotifier;
 
-		QFile *logFile;
+		QSerialTrace *tracer;
+		int baud;
 		bool isatend;
+		bool lost;
 };
 #endif
@@ -0,0 +1,182 @@
+#include "qserialreplay.h"
+#include "silatency.h"
+
+#include <QTimer>
+
+#include <unistd.h>
+
+QSerialReplay::QSerialReplay( QObject *parent ) :
+	QSerial( parent ),
+	opened( false ), finished( true ), speed( 1.0 ), havenext( false ),
+	recordedwrites( 0 ), writes( 0 ), played( 0 ), anchor( 0 ), anchornsecs( 0 ),
+	lastwrite( 0 ), lastrecordedwrite( 0 )
+{
+	timer = new QTimer( this );
+	timer->setSingleShot( true );
+	connect( timer, SIGNAL( timeout() ), this, SLOT( playDue() ) );
+}
+
+QSerialReplay::~QSerialReplay( void )
+{
+}
+
+// The trace is read from its start on every open, the station protocol
+// reopens a port while probing.
+bool QSerialReplay::open( const QString &file, int, bool )
+{
+	close();
+	if ( !reader.open( file ) ) {
+		lasterror = reader.lasterror;
+		return false;
+	}
+	devname = file;
+	opened = true;
+	finished = false;
+	havenext = false;
+	recordedwrites = 0;
+	writes = 0;
+	played = 0;
+	anchor = siMonotonicNsecs();
+	anchornsecs = -1;
+	QIODevice::open( ReadWrite );
+	schedule();
+	return true;
+}
+
+void QSerialReplay::close( void )
+{
+	timer->stop();
+	reader.close();
+	pending.clear();
+	opened = false;
+	finished = true;
+	QIODevice::close();
+}
+
+bool QSerialReplay::isOpen() const
+{
+	return opened;
+}
+
+qint64 QSerialReplay::bytesAvailable()
+{
+	return pending.length()+QIODevice::bytesAvailable();
+}
+
+bool QSerialReplay::atEnd( void ) const
+{
+	return finished && pending.isEmpty();
+}
+
+// Reads ahead to the next received chunk. Writes on the way are only
+// counted, open records are skipped.
+bool QSerialReplay::fetchNext()
+{
+	while( !havenext ) {
+		if ( finished || !reader.readRecord( next ) ) {
+			finished = true;
+			return false;
+		}
+		if ( anchornsecs < 0 )
+			anchornsecs = next.nsecs;
+		if ( next.type == QSerialTrace::Write ) {
+			recordedwrites++;
+			lastrecordedwrite = next.nsecs;
+			// Already written here, the reply is timed from the request
+			if ( writes >= recordedwrites ) {
+				anchor = lastwrite;
+				anchornsecs = next.nsecs;
+			}
+		} else if ( next.type == QSerialTrace::Read ) {
+			havenext = true;
+		}
+	}
+	return true;
+}
+
+// Local time the next chunk is due, -1 while it waits for a write.
+qint64 QSerialReplay::nextDue()
+{
+	if ( !fetchNext() || writes < recordedwrites )
+		return -1;
+	if ( speed <= 0 )
+		return anchor;
+	return anchor+(qint64)( ( next.nsecs-anchornsecs )/speed );
+}
+
+void QSerialReplay::deliverNext()
+{
+	rxstart = rxlast = siMonotonicNsecs();
+	pending.append( next.data );
+	anchor = rxstart;
+	anchornsecs = next.nsecs;
+	havenext = false;
+	played++;
+}
+
+void QSerialReplay::schedule()
+{
+	qint64 due = nextDue();
+	if ( due < 0 )
+		return;
+	qint64 wait = due-siMonotonicNsecs();
+	timer->start( wait > 0 ? (int)( wait/1000000 ) : 0 );
+}
+
+void QSerialReplay::playDue()
+{
+	bool got = false;
+	qint64 due;
+	while( ( due = nextDue() ) >= 0 && due <= siMonotonicNsecs() ) {
+		deliverNext();
+		got = true;
+	}
+	schedule();
+	if ( got )
+		emit readyRead();
+}
+
+// Times out like a port would: a chunk due later than msecs, one held
+// back for a write that can not happen while the caller blocks here and
+// the end of the trace all take the whole msecs. Only msecs -1 with
+// nothing to come returns at once instead of hanging.
+bool QSerialReplay::waitForReadyRead( int msecs )
+{
+	if ( !pending.isEmpty() )
+		return true;
+	qint64 due = nextDue();
+	qint64 wait = due-siMonotonicNsecs();
+	if ( due < 0 || ( msecs >= 0 && wait > (qint64)msecs*1000000 ) ) {
+		if ( msecs > 0 )
+			usleep( (useconds_t)msecs*1000 );
+		return false;
+	}
+	if ( wait > 0 )
+		usleep( wait/1000 );
+	deliverNext();
+	schedule();
+	return true;
+}
+
+qint64 QSerialReplay::readData(char *data, qint64 maxlen)
+{
+	int len = qMin( (qint64)pending.length(), maxlen );
+	memcpy( data, pending.constData(), len );
+	pending.remove( 0, len );
+	return len;
+}
+
+// Writes are dropped, they only release the replies recorded after them.
+qint64 QSerialReplay::writeData(const char *, qint64 len)
+{
+	if ( !opened )
+		return -1;
+	writes++;
+	lastwrite = txdone = siMonotonicNsecs();
+	if ( writes == recordedwrites ) {
+		anchor = lastwrite;
+		anchornsecs = lastrecordedwrite;
+	}
+	schedule();
+	return len;
+}
@@ -0,0 +1,74 @@
+#ifndef _QSERIALREPLAY_H_
+#define _QSERIALREPLAY_H_
+
+#include "qserial.h"
+#include "qserialtrace.h"
+
+#include <QElapsedTimer>
+
+class QTimer;
+
+// Plays back a serial trace (see qserialtrace.h) as if it came from a port.
+// open() takes the trace file instead of a device.
+//
+// Received chunks are played in recorded order. A chunk that was recorded
+// after the n-th write is held back until the n-th write happened here, so
+// the protocol sees the same request/reply sequence as during capture. The
+// recorded gaps between chunks are kept, scaled by setSpeed().
+class QSerialReplay : public QSerial
+{
+	Q_OBJECT
+
+	public:
+		QSerialReplay( QObject *parent = 0 );
+		~QSerialReplay( void );
+
+		bool open( const QString &file, int speed, bool lowlatency = false );
+		void close( void );
+		bool isOpen() const;
+
+		qint64 bytesAvailable();
+		bool atEnd( void ) const;
+		bool waitForReadyRead( int msecs );
+
+		// 1 plays at recorded speed, 2 twice as fast, 0 as fast as possible
+		void setSpeed( double s ) { speed = s; }
+		double getSpeed() const { return speed; }
+
+		int chunksPlayed() const { return played; }
+
+	protected:
+		qint64 readData(char *data, qint64 maxlen);
+		qint64 writeData(const char *data, qint64 len);
+
+	private slots:
+		void playDue();
+
+	private:
+		bool fetchNext();
+		qint64 nextDue();
+		void deliverNext();
+		void schedule();
+
+		QSerialTraceReader reader;
+		bool opened;
+		bool finished;
+		double speed;
+
+		QSerialTraceReader::Record next;
+		bool havenext;
+		int recordedwrites;
+		int writes;
+		int played;
+		// Local time and recorded time of the last chunk played or write
+		// seen, the next chunk is timed from there
+		qint64 anchor;
+		qint64 anchornsecs;
+		qint64 lastwrite;
+		qint64 lastrecordedwrite;
+
+		QByteArray pending;
+		QTimer *timer;
+};
+
+#endif
@@ -0,0 +1,19 @@
+// Kept apart from qserial.cpp: termios2 comes from asm/termbits.h, which
+// can not be included together with termios.h.
+#ifdef __linux__
+#include <asm/termbits.h>
+#include <sys/ioctl.h>
+
+// Sets a speed without a Bxxx constant with BOTHER
+bool qserialSetCustomSpeed( int fd, int speed )
+{
+	struct termios2 tio;
+	if ( ioctl( fd, TCGETS2, &tio ) == -1 )
+		return false;
+	tio.c_cflag &= ~CBAUD;
+	tio.c_cflag |= BOTHER;
+	tio.c_ispeed = speed;
+	tio.c_ospeed = speed;
+	return ioctl( fd, TCSETS2, &tio ) != -1;
+}
+#endif
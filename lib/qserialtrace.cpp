@@ -0,0 +1,204 @@
+#include "qserialtrace.h"
+#include "silatency.h"
+
+#include <QDateTime>
+#include <QFileInfo>
+#include <QtEndian>
+
+#include <string.h>
+
+QSerialTrace::QSerialTrace( const QString &f, qint64 ms, int k ) :
+	head( 0 ), tail( 0 ), droppedcount( 0 ), stopping( 0 ),
+	filename( f ), maxsize( ms ), keep( k ), filesize( 0 )
+{
+	if ( openFile() )
+		start( QThread::LowPriority );
+}
+
+QSerialTrace::~QSerialTrace()
+{
+	stopping.fetchAndStoreRelease( 1 );
+	wait();
+}
+
+QByteArray QSerialTrace::fileHeader()
+{
+	uchar h[HeaderSize];
+	memcpy( h, "QSERTRC1", 8 );
+	qToLittleEndian<qint64>( QDateTime::currentDateTime().toMSecsSinceEpoch(), h+8 );
+	qToLittleEndian<qint64>( siMonotonicNsecs(), h+16 );
+	return QByteArray( (const char *)h, HeaderSize );
+}
+
+void QSerialTrace::put( quint32 pos, const char *data, int len )
+{
+	int at = pos & RingMask;
+	int first = qMin( len, RingSize-at );
+	memcpy( ring+at, data, first );
+	memcpy( ring, data+first, len-first );
+}
+
+void QSerialTrace::get( quint32 pos, char *data, int len ) const
+{
+	int at = pos & RingMask;
+	int first = qMin( len, RingSize-at );
+	memcpy( data, ring+at, first );
+	memcpy( data+first, ring, len-first );
+}
+
+void QSerialTrace::record( RecordType type, const char *data, int len )
+{
+	if ( !isRunning() || len < 0 )
+		return;
+	if ( len > MaxRecordData )
+		len = MaxRecordData;
+	quint32 h = (quint32)head.fetchAndAddAcquire( 0 );
+	quint32 t = (quint32)tail.fetchAndAddAcquire( 0 );
+	quint32 need = RecordHeaderSize+len;
+	if ( RingSize-(h-t) < need ) {
+		droppedcount.ref();
+		return;
+	}
+	uchar rh[RecordHeaderSize];
+	qToLittleEndian<qint64>( siMonotonicNsecs(), rh );
+	rh[8] = type;
+	rh[9] = 0;
+	qToLittleEndian<quint16>( len, rh+10 );
+	put( h, (const char *)rh, RecordHeaderSize );
+	put( h+RecordHeaderSize, data, len );
+	head.fetchAndStoreRelease( (int)(h+need) );
+}
+
+int QSerialTrace::dropped() const
+{
+	return const_cast<QAtomicInt &>( droppedcount ).fetchAndAddAcquire( 0 );
+}
+
+void QSerialTrace::run()
+{
+	while( !stopping.fetchAndAddAcquire( 0 ) ) {
+		drain();
+		msleep( DrainInterval );
+	}
+	drain();
+	file.close();
+}
+
+// Copies whole records to the file, so a rotation never splits one.
+void QSerialTrace::drain()
+{
+	quint32 h = (quint32)head.fetchAndAddAcquire( 0 );
+	quint32 t = (quint32)tail.fetchAndAddAcquire( 0 );
+	if ( h == t )
+		return;
+	QByteArray out;
+	out.reserve( h-t );
+	while( t != h ) {
+		uchar rh[RecordHeaderSize];
+		get( t, (char *)rh, RecordHeaderSize );
+		int len = qFromLittleEndian<quint16>( rh+10 );
+		int size = RecordHeaderSize+len;
+		if ( filesize+out.length()+size > maxsize && filesize+out.length() > HeaderSize ) {
+			writeOut( out );
+			rotate();
+		}
+		int at = out.length();
+		out.resize( at+size );
+		get( t, out.data()+at, size );
+		t += size;
+		// Free the space as soon as possible for a busy port
+		if ( out.length() > RingSize/4 ) {
+			writeOut( out );
+			tail.fetchAndStoreRelease( (int)t );
+		}
+	}
+	writeOut( out );
+	file.flush();
+	tail.fetchAndStoreRelease( (int)t );
+}
+
+void QSerialTrace::writeOut( QByteArray &out )
+{
+	if ( out.isEmpty() )
+		return;
+	file.write( out );
+	filesize += out.length();
+	out.clear();
+}
+
+bool QSerialTrace::openFile()
+{
+	file.setFileName( filename );
+	if ( !file.open( QIODevice::WriteOnly|QIODevice::Truncate ) ) {
+		qWarning( "Failed to open serial trace %s", qPrintable( filename ) );
+		return false;
+	}
+	filesize = file.write( fileHeader() );
+	return true;
+}
+
+// file -> file.1 -> ... -> file.<keep>, the oldest one is removed
+void QSerialTrace::rotate()
+{
+	file.close();
+	QFile::remove( QString( "%1.%2" ).arg( filename ).arg( keep ) );
+	for( int i=keep-1;i>0;i-- )
+		QFile::rename( QString( "%1.%2" ).arg( filename ).arg( i ),
+				QString( "%1.%2" ).arg( filename ).arg( i+1 ) );
+	if ( keep > 0 )
+		QFile::rename( filename, filename+".1" );
+	openFile();
+}
+
+QSerialTraceReader::QSerialTraceReader() :
+	wallbase( 0 ), monobase( 0 )
+{
+}
+
+bool QSerialTraceReader::open( const QString &f )
+{
+	close();
+	file.setFileName( f );
+	if ( !file.open( QIODevice::ReadOnly ) ) {
+		lasterror = file.errorString();
+		return false;
+	}
+	QByteArray h = file.read( QSerialTrace::HeaderSize );
+	if ( h.length() != QSerialTrace::HeaderSize || !h.startsWith( "QSERTRC1" ) ) {
+		lasterror = "Not a serial trace file";
+		file.close();
+		return false;
+	}
+	const uchar *d = (const uchar *)h.constData();
+	wallbase = qFromLittleEndian<qint64>( d+8 );
+	monobase = qFromLittleEndian<qint64>( d+16 );
+	return true;
+}
+
+void QSerialTraceReader::close()
+{
+	if ( file.isOpen() )
+		file.close();
+}
+
+bool QSerialTraceReader::readRecord( Record &r )
+{
+	QByteArray h = file.read( QSerialTrace::RecordHeaderSize );
+	if ( h.length() != QSerialTrace::RecordHeaderSize )
+		return false;
+	const uchar *d = (const uchar *)h.constData();
+	r.nsecs = qFromLittleEndian<qint64>( d );
+	r.type = (QSerialTrace::RecordType)d[8];
+	int len = qFromLittleEndian<quint16>( d+10 );
+	r.data = file.read( len );
+	if ( r.data.length() != len ) {
+		lasterror = "Truncated record";
+		return false;
+	}
+	return true;
+}
+
+qint64 QSerialTraceReader::wallMsecs( qint64 nsecs ) const
+{
+	return wallbase+(nsecs-monobase)/1000000;
+}
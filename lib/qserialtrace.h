@@ -0,0 +1,104 @@
+#ifndef _QSERIALTRACE_H_
+#define _QSERIALTRACE_H_
+
+#include <QThread>
+#include <QAtomicInt>
+#include <QByteArray>
+#include <QString>
+#include <QFile>
+
+// Binary trace of everything passing a serial port.
+//
+// The port thread copies each chunk with its timestamp into a lock free
+// single producer / single consumer ring, a background thread writes the
+// ring to disk and rotates the file when it grows too large. When the ring
+// is full chunks are dropped and counted instead of blocking the reader.
+//
+// File format, all numbers little endian:
+//   header: "QSERTRC1", qint64 wall clock msecs since epoch and qint64
+//           siMonotonicNsecs() taken at the same moment
+//   record: qint64 siMonotonicNsecs(), quint8 type, quint8 reserved,
+//           quint16 length, length bytes
+
+class QSerialTrace : public QThread
+{
+	public:
+		enum RecordType {
+			Read = 0,
+			Write = 1,
+			Open = 2	// data is the device name
+		};
+		enum {
+			HeaderSize = 24,
+			RecordHeaderSize = 12,
+			MaxRecordData = 0xFFFF
+		};
+
+		QSerialTrace( const QString &file, qint64 maxsize = 16*1024*1024, int keep = 3 );
+		~QSerialTrace();
+
+		// Only to be called from one thread, the one using the port.
+		void record( RecordType type, const char *data, int len );
+
+		int dropped() const;
+		QString fileName() const { return filename; }
+		static QByteArray fileHeader();
+
+	protected:
+		void run();
+
+	private:
+		enum {
+			RingSize = 1<<18,
+			RingMask = RingSize-1,
+			DrainInterval = 50 // ms
+		};
+		void put( quint32 pos, const char *data, int len );
+		void get( quint32 pos, char *data, int len ) const;
+		void drain();
+		void writeOut( QByteArray &out );
+		bool openFile();
+		void rotate();
+
+		char ring[RingSize];
+		// Byte positions, only ever growing and wrapping at 2^32. head is
+		// written by the producer, tail by the writer thread.
+		QAtomicInt head;
+		QAtomicInt tail;
+		QAtomicInt droppedcount;
+		QAtomicInt stopping;
+
+		QString filename;
+		qint64 maxsize;
+		int keep;
+		QFile file;
+		qint64 filesize;
+};
+
+// Reads trace files written by QSerialTrace.
+class QSerialTraceReader
+{
+	public:
+		struct Record {
+			qint64 nsecs;
+			QSerialTrace::RecordType type;
+			QByteArray data;
+		};
+
+		QSerialTraceReader();
+
+		bool open( const QString &file );
+		void close();
+		bool readRecord( Record &r );
+
+		// Wall clock time of the monotonic timestamp nsecs
+		qint64 wallMsecs( qint64 nsecs ) const;
+		QString lasterror;
+
+	private:
+		QFile file;
+		qint64 wallbase;
+		qint64 monobase;
+};
+
+#endif
@@ -0,0 +1,381 @@
+#include "siarchive.h"
+
+#include <QtEndian>
+
+#include <string.h>
+
+namespace {
+
+void putVarint( QByteArray &ba, quint64 v )
+{
+	while( v >= 0x80 ) {
+		ba.append( (char)( ( v & 0x7F ) | 0x80 ) );
+		v >>= 7;
+	}
+	ba.append( (char)v );
+}
+
+quint64 zigzag( qint64 v )
+{
+	return ( (quint64)v << 1 ) ^ (quint64)( v >> 63 );
+}
+
+qint64 unzigzag( quint64 v )
+{
+	return (qint64)( v >> 1 ) ^ -(qint64)( v & 1 );
+}
+
+// false when the varint runs past end
+bool getVarint( const uchar *&p, const uchar *end, quint64 *v )
+{
+	*v = 0;
+	for( int shift=0;p<end && shift<64;shift+=7 ) {
+		uchar b = *p++;
+		*v |= (quint64)( b & 0x7F ) << shift;
+		if ( !( b & 0x80 ) )
+			return true;
+	}
+	return false;
+}
+
+}
+
+qint64 SiArchive::timeOf( const QDate &d, const QTime &t )
+{
+	if ( !t.isValid() )
+		return -1;
+	if ( !d.isValid() )
+		return QTime( 0, 0 ).msecsTo( t );
+	return QDateTime( d, t ).toMSecsSinceEpoch();
+}
+
+SiArchiveWriter::SiArchiveWriter() :
+	failed( false )
+{
+	for( int i=0;i<=SiArchive::MaxControl;i++ )
+		dict[i] = -1;
+	cards.reserve( SiArchive::BlockRows );
+	codes.reserve( SiArchive::BlockRows );
+	times.reserve( SiArchive::BlockRows );
+}
+
+SiArchiveWriter::~SiArchiveWriter()
+{
+	close();
+}
+
+bool SiArchiveWriter::open( const QString &f )
+{
+	close();
+	file.setFileName( f );
+	if ( !file.open( QIODevice::WriteOnly|QIODevice::Truncate ) ) {
+		lasterror = file.errorString();
+		return false;
+	}
+	blocks.clear();
+	failed = file.write( "SIARCH01", 8 ) != 8;
+	return !failed;
+}
+
+bool SiArchiveWriter::close()
+{
+	if ( !file.isOpen() )
+		return true;
+	writeBlock();
+	QByteArray idx;
+	for( int i=0;i<blocks.count();i++ ) {
+		const SiArchive::BlockInfo &b = blocks.at(i);
+		uchar e[SiArchive::IndexEntrySize];
+		qToLittleEndian<qint64>( b.offset, e );
+		qToLittleEndian<quint32>( b.size, e+8 );
+		qToLittleEndian<quint32>( b.rows, e+12 );
+		qToLittleEndian<quint32>( b.mincard, e+16 );
+		qToLittleEndian<quint32>( b.maxcard, e+20 );
+		qToLittleEndian<quint16>( b.mincn, e+24 );
+		qToLittleEndian<quint16>( b.maxcn, e+26 );
+		qToLittleEndian<qint64>( b.mintime, e+28 );
+		qToLittleEndian<qint64>( b.maxtime, e+36 );
+		idx.append( (const char *)e, sizeof( e ) );
+	}
+	uchar foot[SiArchive::FooterSize];
+	qToLittleEndian<quint32>( blocks.count(), foot );
+	qToLittleEndian<qint64>( file.pos(), foot+4 );
+	memcpy( foot+12, "SIARCEND", 8 );
+	idx.append( (const char *)foot, sizeof( foot ) );
+	if ( file.write( idx ) != idx.length() )
+		failed = true;
+	if ( failed )
+		lasterror = file.errorString();
+	file.close();
+	return !failed;
+}
+
+void SiArchiveWriter::add( int cardnum, int cn, qint64 time )
+{
+	if ( !file.isOpen() )
+		return;
+	if ( cn < 0 || cn > SiArchive::MaxControl ) {
+		qWarning( "SiArchive: control code %d out of range", cn );
+		return;
+	}
+	// A block ends when full or when its dictionary is
+	if ( cards.count() == SiArchive::BlockRows ||
+		 ( dict[cn] < 0 && dictcodes.count() == SiArchive::MaxCodes ) )
+		writeBlock();
+	if ( dict[cn] < 0 ) {
+		dict[cn] = dictcodes.count();
+		dictcodes.append( cn );
+	}
+	cards.append( cardnum );
+	codes.append( dict[cn] );
+	times.append( time );
+}
+
+void SiArchiveWriter::addCard( const SiCard &card )
+{
+	const QList<PunchingRecord> &plist = card.getPunches();
+	for( int i=0;i<plist.count();i++ ) {
+		const PunchingRecord &p = plist.at(i);
+		qint64 t = p.fulltime.isValid() ? p.fulltime.toMSecsSinceEpoch() : SiArchive::timeOf( QDate(), p.getTime() );
+		add( card.getCardNumber(), p.cn, t );
+	}
+}
+
+void SiArchiveWriter::addPunch( const SiPunch &p )
+{
+	add( p.cardnum, p.cn, p.hasTime() ? p.msecs : -1 );
+}
+
+void SiArchiveWriter::addBackupPunch( const PunchBackupData &p )
+{
+	add( p.cardnum, p.cn, SiArchive::timeOf( p.d, p.t ) );
+}
+
+bool SiArchiveWriter::writeBlock()
+{
+	int n = cards.count();
+	if ( !n )
+		return true;
+	SiArchive::BlockInfo b;
+	b.offset = file.pos();
+	b.rows = n;
+	b.mincard = b.maxcard = cards.at(0);
+	b.mincn = b.maxcn = dictcodes.at( codes.at(0) );
+	b.mintime = b.maxtime = times.at(0);
+
+	QByteArray ba;
+	ba.reserve( n*8 );
+	putVarint( ba, n );
+	putVarint( ba, dictcodes.count() );
+	for( int i=0;i<dictcodes.count();i++ ) {
+		quint16 cn = dictcodes.at(i);
+		putVarint( ba, cn );
+		b.mincn = qMin( b.mincn, cn );
+		b.maxcn = qMax( b.maxcn, cn );
+		dict[cn] = -1;
+	}
+	for( int i=0;i<n;i++ ) {
+		quint32 c = cards.at(i);
+		putVarint( ba, c );
+		b.mincard = qMin( b.mincard, c );
+		b.maxcard = qMax( b.maxcard, c );
+	}
+	for( int i=0;i<n;i++ )
+		ba.append( (char)codes.at(i) );
+	qint64 prev = 0;
+	for( int i=0;i<n;i++ ) {
+		qint64 t = times.at(i);
+		putVarint( ba, zigzag( t-prev ) );
+		prev = t;
+		b.mintime = qMin( b.mintime, t );
+		b.maxtime = qMax( b.maxtime, t );
+	}
+	b.size = ba.length();
+	if ( file.write( ba ) != ba.length() )
+		failed = true;
+	blocks.append( b );
+	cards.resize( 0 );
+	codes.resize( 0 );
+	times.resize( 0 );
+	dictcodes.resize( 0 );
+	return !failed;
+}
+
+SiArchiveReader::SiArchiveReader() :
+	mem( NULL ),
+	size( 0 ),
+	curblock( 0 ),
+	currow( 0 ),
+	nread( 0 )
+{
+}
+
+SiArchiveReader::~SiArchiveReader()
+{
+	close();
+}
+
+void SiArchiveReader::close()
+{
+	if ( mem )
+		file.unmap( mem );
+	mem = NULL;
+	size = 0;
+	if ( file.isOpen() )
+		file.close();
+	blocks.clear();
+	rows.clear();
+}
+
+bool SiArchiveReader::open( const QString &f )
+{
+	close();
+	file.setFileName( f );
+	if ( !file.open( QIODevice::ReadOnly ) ) {
+		lasterror = file.errorString();
+		return false;
+	}
+	size = file.size();
+	if ( size < 8+SiArchive::FooterSize ) {
+		lasterror = "File too short";
+		close();
+		return false;
+	}
+	if ( !( mem = file.map( 0, size ) ) ) {
+		lasterror = file.errorString();
+		close();
+		return false;
+	}
+	const uchar *foot = mem+size-SiArchive::FooterSize;
+	quint32 n = qFromLittleEndian<quint32>( foot );
+	qint64 idx = qFromLittleEndian<qint64>( foot+4 );
+	if ( memcmp( mem, "SIARCH01", 8 ) || memcmp( foot+12, "SIARCEND", 8 ) ||
+		 idx < 8 || idx+(qint64)n*SiArchive::IndexEntrySize != size-SiArchive::FooterSize ) {
+		lasterror = "Not a punch archive";
+		close();
+		return false;
+	}
+	blocks.resize( n );
+	for( quint32 i=0;i<n;i++ ) {
+		const uchar *e = mem+idx+i*SiArchive::IndexEntrySize;
+		SiArchive::BlockInfo &b = blocks[i];
+		b.offset = qFromLittleEndian<qint64>( e );
+		b.size = qFromLittleEndian<quint32>( e+8 );
+		b.rows = qFromLittleEndian<quint32>( e+12 );
+		b.mincard = qFromLittleEndian<quint32>( e+16 );
+		b.maxcard = qFromLittleEndian<quint32>( e+20 );
+		b.mincn = qFromLittleEndian<quint16>( e+24 );
+		b.maxcn = qFromLittleEndian<quint16>( e+26 );
+		b.mintime = qFromLittleEndian<qint64>( e+28 );
+		b.maxtime = qFromLittleEndian<qint64>( e+36 );
+		if ( b.offset < 8 || b.offset+b.size > idx ) {
+			lasterror = "Damaged archive index";
+			close();
+			return false;
+		}
+	}
+	setQuery( Query() );
+	return true;
+}
+
+qint64 SiArchiveReader::rowCount() const
+{
+	qint64 n = 0;
+	for( int i=0;i<blocks.count();i++ )
+		n += blocks.at(i).rows;
+	return n;
+}
+
+void SiArchiveReader::setQuery( const Query &q )
+{
+	query = q;
+	curblock = -1;
+	currow = 0;
+	nread = 0;
+	rows.resize( 0 );
+}
+
+bool SiArchiveReader::blockMatches( const SiArchive::BlockInfo &b ) const
+{
+	if ( query.cardnum && ( (quint32)query.cardnum < b.mincard || (quint32)query.cardnum > b.maxcard ) )
+		return false;
+	if ( query.cn && ( query.cn < b.mincn || query.cn > b.maxcn ) )
+		return false;
+	if ( query.mintime >= 0 && b.maxtime < query.mintime )
+		return false;
+	if ( query.maxtime >= 0 && b.mintime > query.maxtime )
+		return false;
+	return true;
+}
+
+bool SiArchiveReader::rowMatches( const SiArchive::Row &r ) const
+{
+	return ( !query.cardnum || r.cardnum == query.cardnum ) &&
+		( !query.cn || r.cn == query.cn ) &&
+		( query.mintime < 0 || r.time >= query.mintime ) &&
+		( query.maxtime < 0 || r.time <= query.maxtime );
+}
+
+bool SiArchiveReader::decodeBlock( int i )
+{
+	const SiArchive::BlockInfo &b = blocks.at(i);
+	const uchar *p = mem+b.offset;
+	const uchar *end = p+b.size;
+	quint64 n, ndict, v;
+	if ( !getVarint( p, end, &n ) || n != b.rows || !getVarint( p, end, &ndict ) || ndict > SiArchive::MaxCodes )
+		return false;
+	int dict[SiArchive::MaxCodes];
+	for( quint64 k=0;k<ndict;k++ ) {
+		if ( !getVarint( p, end, &v ) )
+			return false;
+		dict[k] = v;
+	}
+	// Every row takes at least a byte in each of the three columns
+	if ( (quint64)( end-p ) < 3*n )
+		return false;
+	rows.resize( n );
+	for( quint64 k=0;k<n;k++ ) {
+		if ( !getVarint( p, end, &v ) )
+			return false;
+		rows[k].cardnum = v;
+	}
+	if ( end-p < (qint64)n )
+		return false;
+	for( quint64 k=0;k<n;k++ ) {
+		if ( *p >= ndict )
+			return false;
+		rows[k].cn = dict[*p++];
+	}
+	qint64 t = 0;
+	for( quint64 k=0;k<n;k++ ) {
+		if ( !getVarint( p, end, &v ) )
+			return false;
+		t += unzigzag( v );
+		rows[k].time = t;
+	}
+	nread++;
+	return true;
+}
+
+bool SiArchiveReader::next( SiArchive::Row *r )
+{
+	while( true ) {
+		while( currow < rows.count() ) {
+			const SiArchive::Row &row = rows.at( currow++ );
+			if ( rowMatches( row ) ) {
+				*r = row;
+				return true;
+			}
+		}
+		rows.resize( 0 );
+		currow = 0;
+		do {
+			if ( ++curblock >= blocks.count() )
+				return false;
+		} while( !blockMatches( blocks.at( curblock ) ) );
+		if ( !decodeBlock( curblock ) ) {
+			qWarning( "SiArchive: block %d of %s is damaged", curblock, qPrintable( file.fileName() ) );
+			rows.resize( 0 );
+		}
+	}
+}
@@ -0,0 +1,136 @@
+#ifndef SIARCHIVE_H
+#define SIARCHIVE_H
+
+#include <QFile>
+#include <QVector>
+
+#include "siproto.h"
+
+// Compact archive of punches for analysis over many events.
+//
+// Punches are stored in blocks of up to BlockRows rows, column by column:
+// card numbers as varints, control codes as one byte indexes into a per
+// block dictionary and times as zigzag varint deltas. The block index at
+// the end of the file keeps the min/max card, control and time of every
+// block, so the reader skips blocks that can not match a query without
+// touching them.
+//
+// A time is msecs since the epoch when the date is known, msecs since
+// midnight when only the time of day is (SiPunch, backups of old
+// stations) and -1 without time.
+//
+// File format, all numbers little endian:
+//   header: "SIARCH01"
+//   blocks: varint rows, varint dictionary size, varint codes,
+//           varint cards, byte code indexes, zigzag varint time deltas
+//   index:  per block qint64 offset, quint32 size, quint32 rows,
+//           quint32 min/max card, quint16 min/max control,
+//           qint64 min/max time
+//   footer: quint32 block count, qint64 index offset, "SIARCEND"
+
+class SiArchive
+{
+	public:
+		struct Row {
+			int cardnum;
+			int cn;
+			qint64 time;
+		};
+		struct BlockInfo {
+			qint64 offset;
+			quint32 size;
+			quint32 rows;
+			quint32 mincard, maxcard;
+			quint16 mincn, maxcn;
+			qint64 mintime, maxtime;
+		};
+		enum {
+			BlockRows = 16384,
+			MaxCodes = 256,		// in the dictionary of a block
+			MaxControl = 1023,
+			IndexEntrySize = 44,
+			FooterSize = 20
+		};
+
+		static qint64 timeOf( const QDate &d, const QTime &t );
+};
+
+class SiArchiveWriter
+{
+	public:
+		SiArchiveWriter();
+		~SiArchiveWriter();
+
+		bool open( const QString &file );
+		// Writes the last block and the index
+		bool close();
+		bool isOpen() const { return file.isOpen(); }
+		QString lasterror;
+
+		void add( int cardnum, int cn, qint64 time );
+		// Every punch on the card
+		void addCard( const SiCard &card );
+		void addPunch( const SiPunch &p );
+		void addBackupPunch( const PunchBackupData &p );
+
+	private:
+		bool writeBlock();
+
+		QFile file;
+		QVector<SiArchive::BlockInfo> blocks;
+		QVector<int> cards;
+		QVector<int> codes;
+		QVector<qint64> times;
+		int dict[SiArchive::MaxControl+1];
+		QVector<int> dictcodes;
+		bool failed;
+};
+
+class SiArchiveReader
+{
+	public:
+		// Rows matching all of the set limits are returned
+		struct Query {
+			Query() :
+				cardnum( 0 ), cn( 0 ), mintime( -1 ), maxtime( -1 )
+				{}
+			int cardnum;	// 0 for any card
+			int cn;		// 0 for any control
+			qint64 mintime, maxtime;	// -1 for no limit
+		};
+
+		SiArchiveReader();
+		~SiArchiveReader();
+
+		// Maps file, only the index is read here
+		bool open( const QString &file );
+		void close();
+		QString lasterror;
+
+		int blockCount() const { return blocks.count(); }
+		const SiArchive::BlockInfo &block( int i ) const { return blocks.at(i); }
+		qint64 rowCount() const;
+
+		// Starts returning the rows matching q from the beginning
+		void setQuery( const Query &q );
+		bool next( SiArchive::Row *r );
+		// Blocks decoded since setQuery()
+		int blocksRead() const { return nread; }
+
+	private:
+		bool blockMatches( const SiArchive::BlockInfo &b ) const;
+		bool rowMatches( const SiArchive::Row &r ) const;
+		bool decodeBlock( int i );
+
+		QFile file;
+		uchar *mem;
+		qint64 size;
+		QVector<SiArchive::BlockInfo> blocks;
+		Query query;
+		int curblock;
+		int currow;
+		int nread;
+		QVector<SiArchive::Row> rows;
+};
+
+#endif
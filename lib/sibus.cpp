@@ -0,0 +1,213 @@
+#include "sibus.h"
+#include "stationpool.h"
+
+SiBusConsumer::SiBusConsumer( const QString &name, int capacity ) :
+	cname( name ),
+	head( 0 ),
+	tail( 0 ),
+	ndropped( 0 ),
+	active( 1 ),
+	waiting( 0 )
+{
+	int size = 2;
+	while( size < capacity )
+		size <<= 1;
+	ring = new SiBusEvent[size];
+	mask = size-1;
+}
+
+SiBusConsumer::~SiBusConsumer()
+{
+	delete [] ring;
+}
+
+// Bus thread only
+void SiBusConsumer::push( const SiBusEvent &ev )
+{
+	unsigned int h = head.fetchAndAddAcquire( 0 );
+	if ( h-(unsigned int)tail.fetchAndAddAcquire( 0 ) > mask ) {
+		ndropped.fetchAndAddRelaxed( 1 );
+		return;
+	}
+	ring[h&mask] = ev;
+	head.fetchAndStoreOrdered( h+1 );
+	if ( waiting.fetchAndAddOrdered( 0 ) ) {
+		QMutexLocker l( &waitlock );
+		waitcond.wakeAll();
+	}
+}
+
+// Consumer thread only
+bool SiBusConsumer::next( SiBusEvent *ev )
+{
+	unsigned int t = tail.fetchAndAddAcquire( 0 );
+	if ( t == (unsigned int)head.fetchAndAddAcquire( 0 ) )
+		return false;
+	*ev = ring[t&mask];
+	// Let go of the card now rather than when the slot is reused
+	ring[t&mask] = SiBusEvent();
+	tail.fetchAndStoreRelease( t+1 );
+	return true;
+}
+
+bool SiBusConsumer::waitForEvent( int msecs )
+{
+	if ( pending() )
+		return true;
+	waiting.fetchAndStoreOrdered( 1 );
+	waitlock.lock();
+	if ( !pending() )
+		waitcond.wait( &waitlock, msecs );
+	waitlock.unlock();
+	waiting.fetchAndStoreOrdered( 0 );
+	return pending() > 0;
+}
+
+int SiBusConsumer::pending() const
+{
+	return (unsigned int)head.fetchAndAddOrdered( 0 )-(unsigned int)tail.fetchAndAddAcquire( 0 );
+}
+
+SiBus::SiBus( QObject *parent ) :
+	QObject( parent ),
+	nconsumers( 0 ),
+	sequence( 0 )
+{
+}
+
+SiBus::~SiBus()
+{
+	for( int i=0;i<MaxConsumers;i++ )
+		delete consumers[i].fetchAndStoreOrdered( NULL );
+}
+
+SiBusConsumer *SiBus::subscribe( const QString &name, int capacity )
+{
+	int i = nconsumers.fetchAndAddOrdered( 1 );
+	if ( i >= MaxConsumers ) {
+		nconsumers.fetchAndAddOrdered( -1 );
+		qWarning( "SiBus: no room for consumer %s", qPrintable( name ) );
+		return NULL;
+	}
+	SiBusConsumer *c = new SiBusConsumer( name, capacity );
+	consumers[i].fetchAndStoreOrdered( c );
+	return c;
+}
+
+void SiBus::publish( SiBusEvent &ev )
+{
+	ev.sequence = ++sequence;
+	ev.published = siMonotonicNsecs();
+	int n = qMin( nconsumers.fetchAndAddAcquire( 0 ), (int)MaxConsumers );
+	for( int i=0;i<n;i++ ) {
+		SiBusConsumer *c = consumers[i];
+		if ( c && c->active.fetchAndAddAcquire( 0 ) )
+			c->push( ev );
+	}
+}
+
+void SiBus::attach( SiProto *si, int station )
+{
+	stations.insert( si, station );
+	connect( si, SIGNAL( cardRead(const SiCard &) ),
+			this, SLOT( cardRead(const SiCard &) ), Qt::DirectConnection );
+	connect( si, SIGNAL( backupCard(const SiCard &) ),
+			this, SLOT( backupCard(const SiCard &) ), Qt::DirectConnection );
+	connect( si, SIGNAL( backupPunch(const PunchBackupData &) ),
+			this, SLOT( backupPunch(const PunchBackupData &) ), Qt::DirectConnection );
+	connect( si, SIGNAL( punchesAvailable(int) ),
+			this, SLOT( punchesAvailable(int) ), Qt::DirectConnection );
+}
+
+void SiBus::attach( StationPool *pool )
+{
+	connect( pool, SIGNAL( cardRead(int, const SiCard &) ),
+			this, SLOT( poolCardRead(int, const SiCard &) ), Qt::DirectConnection );
+	connect( pool, SIGNAL( backupCard(int, const SiCard &) ),
+			this, SLOT( poolBackupCard(int, const SiCard &) ), Qt::DirectConnection );
+	connect( pool, SIGNAL( backupPunch(int, const PunchBackupData &) ),
+			this, SLOT( poolBackupPunch(int, const PunchBackupData &) ), Qt::DirectConnection );
+	connect( pool, SIGNAL( punchesAvailable(int, int) ),
+			this, SLOT( poolPunchesAvailable(int, int) ), Qt::DirectConnection );
+}
+
+void SiBus::cardRead( const SiCard &card )
+{
+	SiBusEvent ev;
+	ev.type = SiBusEvent::CardRead;
+	ev.station = stations.value( sender() );
+	ev.card = card;
+	publish( ev );
+}
+
+void SiBus::backupCard( const SiCard &card )
+{
+	SiBusEvent ev;
+	ev.type = SiBusEvent::BackupCard;
+	ev.station = stations.value( sender() );
+	ev.card = card;
+	publish( ev );
+}
+
+void SiBus::backupPunch( const PunchBackupData &punch )
+{
+	SiBusEvent ev;
+	ev.type = SiBusEvent::BackupPunch;
+	ev.station = stations.value( sender() );
+	ev.backuppunch = punch;
+	publish( ev );
+}
+
+void SiBus::punchesAvailable( int )
+{
+	SiProto *si = static_cast<SiProto *>( sender() );
+	QList<SiPunch> l = si->punchQueue().take();
+	SiBusEvent ev;
+	ev.type = SiBusEvent::Punch;
+	ev.station = stations.value( si );
+	for( int i=0;i<l.count();i++ ) {
+		ev.punch = l.at(i);
+		ev.punch.station = ev.station;
+		publish( ev );
+	}
+}
+
+void SiBus::poolCardRead( int station, const SiCard &card )
+{
+	SiBusEvent ev;
+	ev.type = SiBusEvent::CardRead;
+	ev.station = station;
+	ev.card = card;
+	publish( ev );
+}
+
+void SiBus::poolBackupCard( int station, const SiCard &card )
+{
+	SiBusEvent ev;
+	ev.type = SiBusEvent::BackupCard;
+	ev.station = station;
+	ev.card = card;
+	publish( ev );
+}
+
+void SiBus::poolBackupPunch( int station, const PunchBackupData &punch )
+{
+	SiBusEvent ev;
+	ev.type = SiBusEvent::BackupPunch;
+	ev.station = station;
+	ev.backuppunch = punch;
+	publish( ev );
+}
+
+void SiBus::poolPunchesAvailable( int, int )
+{
+	StationPool *pool = static_cast<StationPool *>( sender() );
+	QList<SiPunch> l = pool->punchQueue().take();
+	SiBusEvent ev;
+	ev.type = SiBusEvent::Punch;
+	for( int i=0;i<l.count();i++ ) {
+		ev.punch = l.at(i);
+		ev.station = ev.punch.station;
+		publish( ev );
+	}
+}
@@ -0,0 +1,119 @@
+#ifndef SIBUS_H
+#define SIBUS_H
+
+#include <QObject>
+#include <QAtomicInt>
+#include <QAtomicPointer>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QMap>
+
+#include "siproto.h"
+
+class StationPool;
+
+// One result on the bus
+class SiBusEvent {
+	public:
+		enum Type {
+			CardRead,
+			BackupCard,
+			Punch,
+			BackupPunch
+		};
+		SiBusEvent() :
+			type( Punch ), station( 0 ), sequence( 0 ), published( -1 )
+			{}
+
+		Type type;
+		int station;		// StationPool id, 0 outside a pool
+		quint64 sequence;	// counts all events on the bus, gaps are drops
+		qint64 published;	// siMonotonicNsecs()
+		SiCard card;		// CardRead, BackupCard
+		SiPunch punch;		// Punch
+		PunchBackupData backuppunch;	// BackupPunch
+};
+
+// A subscriber of a SiBus. Every consumer has its own ring, filled by the
+// bus thread and emptied by one consumer thread, so each one reads at its
+// own pace. A consumer that falls a whole ring behind loses the newest
+// events instead of holding up the others or the serial port.
+class SiBusConsumer {
+	public:
+		// Takes the oldest event, false when there is none
+		bool next( SiBusEvent *ev );
+		// Blocks until an event is there or msecs passed
+		bool waitForEvent( int msecs );
+
+		int pending() const;
+		// Events lost because the ring was full
+		int dropped() const { return ndropped.fetchAndAddAcquire( 0 ); }
+		const QString &name() const { return cname; }
+
+		// An inactive consumer gets no events
+		void setActive( bool a ) { active.fetchAndStoreRelease( a ? 1 : 0 ); }
+
+	private:
+		friend class SiBus;
+		SiBusConsumer( const QString &name, int capacity );
+		~SiBusConsumer();
+		void push( const SiBusEvent &ev );
+
+		QString cname;
+		SiBusEvent *ring;
+		unsigned int mask;
+		mutable QAtomicInt head;	// written by the bus only
+		mutable QAtomicInt tail;	// written by the consumer only
+		mutable QAtomicInt ndropped;
+		QAtomicInt active;
+		QAtomicInt waiting;
+		QMutex waitlock;
+		QWaitCondition waitcond;
+};
+
+// Hands decoded cards and punches to several independent consumers, e.g. a
+// result engine, a database writer, a printer and a network feed. Events
+// must be published from one thread; attach() publishes from the thread the
+// SiProto or StationPool signals are emitted in.
+class SiBus : public QObject
+{
+	Q_OBJECT
+
+	public:
+		enum {
+			MaxConsumers = 16
+		};
+
+		SiBus( QObject *parent = 0 );
+		~SiBus();
+
+		// capacity is rounded up to a power of two. The consumer belongs to
+		// the bus and lives as long as it. NULL when there are MaxConsumers.
+		SiBusConsumer *subscribe( const QString &name, int capacity = 1024 );
+
+		// Publishes everything si reads. Takes over si's punch queue.
+		void attach( SiProto *si, int station = 0 );
+		// Publishes everything the stations of pool read
+		void attach( StationPool *pool );
+
+		void publish( SiBusEvent &ev );
+
+	private slots:
+		void cardRead( const SiCard &card );
+		void backupCard( const SiCard &card );
+		void backupPunch( const PunchBackupData &punch );
+		void punchesAvailable( int count );
+		void poolCardRead( int station, const SiCard &card );
+		void poolBackupCard( int station, const SiCard &card );
+		void poolBackupPunch( int station, const PunchBackupData &punch );
+		void poolPunchesAvailable( int station, int count );
+
+	private:
+		QMap<QObject *, int> stations;
+
+		QAtomicPointer<SiBusConsumer> consumers[MaxConsumers];
+		QAtomicInt nconsumers;
+		quint64 sequence;
+};
+
+#endif
@@ -0,0 +1,244 @@
+#include "sicardindex.h"
+
+#include <QFileInfo>
+
+#include <string.h>
+
+SiCardIndex::SiCardIndex() :
+	mem( NULL ),
+	header( NULL ),
+	table( NULL )
+{
+}
+
+SiCardIndex::~SiCardIndex()
+{
+	close();
+}
+
+// Murmur3 finalizer, card numbers are far from random in the low bits
+quint32 SiCardIndex::hash( quint32 card, quint32 nslots )
+{
+	card ^= card >> 16;
+	card *= 0x85EBCA6B;
+	card ^= card >> 13;
+	card *= 0xC2B2AE35;
+	card ^= card >> 16;
+	return card & ( nslots-1 );
+}
+
+bool SiCardIndex::create( const QString &name, quint32 nslots )
+{
+	QFile f( name );
+	if ( !f.open( QIODevice::WriteOnly|QIODevice::Truncate ) ) {
+		lasterror = f.errorString();
+		return false;
+	}
+	Header h;
+	memset( &h, 0, sizeof( h ) );
+	memcpy( h.magic, "SICIDX01", 8 );
+	h.nslots = nslots;
+	f.write( (const char *)&h, sizeof( h ) );
+	// The slots are a hole in the file until used
+	if ( !f.resize( sizeof( Header )+(qint64)nslots*sizeof( Slot ) ) ) {
+		lasterror = f.errorString();
+		return false;
+	}
+	return true;
+}
+
+bool SiCardIndex::map()
+{
+	if ( !file.open( QIODevice::ReadWrite ) ) {
+		lasterror = file.errorString();
+		return false;
+	}
+	if ( file.size() < (qint64)sizeof( Header ) ) {
+		lasterror = "Index file too short";
+		file.close();
+		return false;
+	}
+	mem = file.map( 0, file.size() );
+	if ( !mem ) {
+		lasterror = file.errorString();
+		file.close();
+		return false;
+	}
+	header = (Header *)mem;
+	table = (Slot *)( mem+sizeof( Header ) );
+	quint32 s = header->nslots;
+	if ( memcmp( header->magic, "SICIDX01", 8 ) || !s || ( s & ( s-1 ) ) ||
+		 file.size() != (qint64)( sizeof( Header )+(qint64)s*sizeof( Slot ) ) ) {
+		lasterror = "Not a card index";
+		unmap();
+		return false;
+	}
+	return true;
+}
+
+void SiCardIndex::unmap()
+{
+	if ( mem )
+		file.unmap( mem );
+	mem = NULL;
+	header = NULL;
+	table = NULL;
+	file.close();
+}
+
+bool SiCardIndex::open( const QString &indexfile, const QString &journalfile )
+{
+	close();
+	journalname = journalfile;
+	file.setFileName( indexfile );
+	if ( !QFile::exists( indexfile ) && !create( indexfile, InitialSlots ) )
+		return false;
+	if ( !map() ) {
+		qWarning( "Rebuilding card index %s: %s", qPrintable( indexfile ), qPrintable( lasterror ) );
+		if ( !create( indexfile, InitialSlots ) || !map() )
+			return false;
+	}
+	return update();
+}
+
+void SiCardIndex::close()
+{
+	unmap();
+}
+
+bool SiCardIndex::reset()
+{
+	memset( table, 0, (size_t)header->nslots*sizeof( Slot ) );
+	header->used = 0;
+	header->journalsize = 0;
+	header->journalcreated = 0;
+	return true;
+}
+
+void SiCardIndex::insert( Slot *t, quint32 nslots, const Slot &s )
+{
+	quint32 i = hash( s.card, nslots );
+	while( t[i].card )
+		i = ( i+1 ) & ( nslots-1 );
+	t[i] = s;
+}
+
+// Doubles the table into a new file that then replaces the old one
+bool SiCardIndex::grow()
+{
+	QString name = file.fileName();
+	QString tmpname = name+".new";
+	quint32 nslots = header->nslots*2;
+	if ( !create( tmpname, nslots ) )
+		return false;
+	QFile nf( tmpname );
+	uchar *nmem = NULL;
+	if ( !nf.open( QIODevice::ReadWrite ) || !( nmem = nf.map( 0, nf.size() ) ) ) {
+		lasterror = nf.errorString();
+		QFile::remove( tmpname );
+		return false;
+	}
+	Header *nh = (Header *)nmem;
+	Slot *nt = (Slot *)( nmem+sizeof( Header ) );
+	for( quint32 i=0;i<header->nslots;i++ ) {
+		if ( table[i].card )
+			insert( nt, nslots, table[i] );
+	}
+	nh->used = header->used;
+	nh->journalsize = header->journalsize;
+	nh->journalcreated = header->journalcreated;
+	nf.unmap( nmem );
+	nf.close();
+	unmap();
+	QFile::remove( name );
+	if ( !QFile::rename( tmpname, name ) ) {
+		lasterror = "Could not replace "+name;
+		return false;
+	}
+	file.setFileName( name );
+	return map();
+}
+
+bool SiCardIndex::update()
+{
+	if ( !header )
+		return false;
+	if ( !QFile::exists( journalname ) ) {
+		if ( header->journalsize )
+			reset();
+		return true;
+	}
+	SiJournalReader r;
+	if ( !r.open( journalname ) ) {
+		lasterror = r.lasterror;
+		return false;
+	}
+	// A journal started anew has another creation time, even when it
+	// already grew past the size indexed
+	if ( r.created() != header->journalcreated ||
+		 QFileInfo( journalname ).size() < header->journalsize ||
+		 ( header->journalsize && !r.seek( header->journalsize ) ) ) {
+		reset();
+		header->journalcreated = r.created();
+		r.seek( SiJournal::HeaderSize );
+	}
+	SiJournalReader::Record rec;
+	while( r.readRecord( rec ) ) {
+		int cardnum = 0;
+		if ( rec.type == SiJournal::Card || rec.type == SiJournal::BackupCard )
+			cardnum = rec.card().getCardNumber();
+		else if ( rec.type == SiJournal::Punch )
+			cardnum = rec.punch().cardnum;
+		if ( cardnum <= 0 )
+			continue;
+		// Linear probing wants at least half of the slots free
+		if ( ( header->used+1 )*2 > header->nslots && !grow() )
+			return false;
+		Slot s;
+		s.card = cardnum;
+		s.type = rec.type;
+		s.reserved = 0;
+		s.station = rec.station;
+		s.offset = rec.offset;
+		insert( table, header->nslots, s );
+		header->used++;
+	}
+	header->journalsize = r.pos();
+	return true;
+}
+
+QList<SiCardIndex::Entry> SiCardIndex::find( int cardnum ) const
+{
+	QList<Entry> l;
+	if ( !header || cardnum <= 0 )
+		return l;
+	quint32 mask = header->nslots-1;
+	for( quint32 i=hash( cardnum, header->nslots );table[i].card;i=( i+1 ) & mask ) {
+		if ( table[i].card != (quint32)cardnum )
+			continue;
+		Entry e;
+		e.cardnum = cardnum;
+		e.type = (SiJournal::RecordType)table[i].type;
+		e.station = table[i].station;
+		e.offset = table[i].offset;
+		l.append( e );
+	}
+	return l;
+}
+
+bool SiCardIndex::contains( int cardnum ) const
+{
+	if ( !header || cardnum <= 0 )
+		return false;
+	quint32 mask = header->nslots-1;
+	for( quint32 i=hash( cardnum, header->nslots );table[i].card;i=( i+1 ) & mask ) {
+		if ( table[i].card == (quint32)cardnum )
+			return true;
+	}
+	return false;
+}
+
+int SiCardIndex::count() const
+{
+	return header ? header->used : 0;
+}
@@ -0,0 +1,88 @@
+#ifndef SICARDINDEX_H
+#define SICARDINDEX_H
+
+#include <QFile>
+#include <QList>
+
+#include "sijournal.h"
+
+// Card number index over a readout journal, answering "has this card been
+// read, and which stations saw it" without reading the journal.
+//
+// The index file is an open addressing hash table with linear probing that
+// is used through mmap, so opening it costs nothing however large it is.
+// A card read several times has one slot per record. It only holds data
+// derived from the journal, in host byte order, and is rebuilt whenever it
+// does not match the journal: when the journal was created at another
+// time than the one indexed, or is shorter than what was indexed.
+//
+// File format:
+//   header: "SICIDX01", quint32 slot count (a power of two), quint32 used
+//           slots, qint64 journal size indexed so far, qint64 creation
+//           time from the journal header
+//   slot:   quint32 card number (0 is a free slot), quint8 record type,
+//           quint8 reserved, quint16 station, qint64 journal offset
+
+class SiCardIndex
+{
+	public:
+		struct Entry {
+			int cardnum;
+			SiJournal::RecordType type;
+			int station;
+			qint64 offset;
+		};
+
+		SiCardIndex();
+		~SiCardIndex();
+
+		// Opens or creates indexfile for journalfile and indexes what was
+		// added to the journal since
+		bool open( const QString &indexfile, const QString &journalfile );
+		void close();
+		bool isOpen() const { return header != NULL; }
+
+		// Indexes the records appended to the journal since the last call
+		bool update();
+
+		QList<Entry> find( int cardnum ) const;
+		bool contains( int cardnum ) const;
+		// Indexed records
+		int count() const;
+		QString lasterror;
+
+	private:
+		struct Header {
+			char magic[8];
+			quint32 nslots;
+			quint32 used;
+			qint64 journalsize;
+			qint64 journalcreated;
+		};
+		struct Slot {
+			quint32 card;
+			quint8 type;
+			quint8 reserved;
+			quint16 station;
+			qint64 offset;
+		};
+		enum {
+			InitialSlots = 1<<14
+		};
+
+		bool create( const QString &name, quint32 nslots );
+		bool map();
+		void unmap();
+		bool grow();
+		bool reset();
+		void insert( Slot *table, quint32 nslots, const Slot &s );
+		static quint32 hash( quint32 card, quint32 nslots );
+
+		QFile file;
+		QString journalname;
+		uchar *mem;
+		Header *header;
+		Slot *table;
+};
+
+#endif
@@ -0,0 +1,200 @@
+#include "siclock.h"
+
+#include <QSettings>
+#include <QStringList>
+
+#include <math.h>
+
+namespace {
+
+QString stationKey( int cn )
+{
+	return QString( "siclock/stations/%1/samples" ).arg( cn );
+}
+
+}
+
+SiClockModel::SiClockModel( QObject *parent ) :
+	QObject( parent )
+{
+}
+
+void SiClockModel::attach( SiProto *si )
+{
+	connect( si, SIGNAL( gotTime(const QDateTime &, const QDateTime &, int) ),
+			this, SLOT( gotTime(const QDateTime &, const QDateTime &, int) ) );
+	connect( si, SIGNAL( gotSetTime(const QDateTime &, int) ),
+			this, SLOT( gotSetTime(const QDateTime &, int) ) );
+}
+
+void SiClockModel::gotTime( const QDateTime &station, const QDateTime &pc, int cn )
+{
+	addSample( cn, station, pc );
+	save( cn );
+}
+
+void SiClockModel::gotSetTime( const QDateTime &/*station*/, int cn )
+{
+	if ( !samples.contains( cn ) && !models.contains( cn ) )
+		return;
+	forget( cn );
+	emit modelChanged( cn );
+}
+
+void SiClockModel::addSample( int cn, const QDateTime &station, const QDateTime &pc )
+{
+	if ( !station.isValid() || !pc.isValid() )
+		return;
+	// Stations do not always know the date, the time of day is compared
+	qint64 off = pc.time().msecsTo( station.time() );
+	if ( off > 43200000 )
+		off -= 86400000;
+	else if ( off < -43200000 )
+		off += 86400000;
+	Sample s;
+	s.pc = pc.toMSecsSinceEpoch();
+	s.offset = off;
+	QVector<Sample> &v = samples[cn];
+	if ( v.count() >= MaxSamples )
+		v.remove( 0 );
+	v.append( s );
+	fit( cn );
+}
+
+void SiClockModel::fit( int cn )
+{
+	const QVector<Sample> &v = samples[cn];
+	if ( v.isEmpty() ) {
+		models.remove( cn );
+		return;
+	}
+	Model m;
+	m.reference = v.at(0).pc;
+	m.samples = v.count();
+	double sx = 0, sy = 0, sxx = 0, sxy = 0;
+	for( int i=0;i<v.count();i++ ) {
+		double x = v.at(i).pc-m.reference;
+		double y = v.at(i).offset;
+		sx += x;
+		sy += y;
+		sxx += x*x;
+		sxy += x*y;
+	}
+	double n = v.count();
+	double den = n*sxx-sx*sx;
+	if ( v.last().pc-m.reference >= MinSkewSpan && den > 0 ) {
+		m.skew = ( n*sxy-sx*sy )/den;
+		m.offset = ( sy-m.skew*sx )/n;
+	} else
+		m.offset = sy/n;
+	models.insert( cn, m );
+	emit modelChanged( cn );
+}
+
+qint64 SiClockModel::offsetAt( int cn, qint64 msecs ) const
+{
+	QMap<int, Model>::const_iterator it = models.constFind( cn );
+	if ( it == models.constEnd() )
+		return 0;
+	return (qint64)floor( it->offset+it->skew*( msecs-it->reference )+0.5 );
+}
+
+void SiClockModel::forget( int cn )
+{
+	samples.remove( cn );
+	models.remove( cn );
+	QSettings set;
+	set.remove( stationKey( cn ) );
+}
+
+// station = pc+offset+skew*(pc-reference), solved for pc. The loop is
+// plain arithmetic over the array so the compiler can vectorize it.
+void SiClockModel::correct( int cn, qint64 *msecs, int n ) const
+{
+	QMap<int, Model>::const_iterator it = models.constFind( cn );
+	if ( it == models.constEnd() )
+		return;
+	const qint64 ref = it->reference;
+	const double off = it->offset;
+	const double scale = 1.0/( 1.0+it->skew );
+	for( int i=0;i<n;i++ )
+		msecs[i] = ref+(qint64)floor( ( (double)( msecs[i]-ref )-off )*scale+0.5 );
+}
+
+void SiClockModel::correct( QList<PunchBackupData> &punches ) const
+{
+	QVector<qint64> t;
+	t.reserve( punches.count() );
+	int i = 0;
+	while( i < punches.count() ) {
+		// A run of punches from the same station is corrected in one pass
+		int cn = punches.at(i).cn;
+		int first = i;
+		QMap<int, Model>::const_iterator it = models.constFind( cn );
+		QDate refdate;
+		if ( it != models.constEnd() )
+			refdate = QDateTime::fromMSecsSinceEpoch( it->reference ).date();
+		t.resize( 0 );
+		for( ;i<punches.count() && punches.at(i).cn == cn;i++ ) {
+			const PunchBackupData &p = punches.at(i);
+			t.append( QDateTime( p.d.isValid() ? p.d : refdate, p.t ).toMSecsSinceEpoch() );
+		}
+		if ( it == models.constEnd() )
+			continue;
+		correct( cn, t.data(), t.count() );
+		for( int j=first;j<i;j++ ) {
+			PunchBackupData &p = punches[j];
+			if ( !p.t.isValid() )
+				continue;
+			QDateTime dt = QDateTime::fromMSecsSinceEpoch( t.at( j-first ) );
+			if ( p.d.isValid() )
+				p.d = dt.date();
+			p.t = dt.time();
+		}
+	}
+}
+
+void SiClockModel::correct( QList<PunchingRecord> &punches ) const
+{
+	for( int i=0;i<punches.count();i++ ) {
+		PunchingRecord &p = punches[i];
+		if ( !p.fulltime.isValid() || !models.contains( p.cn ) )
+			continue;
+		qint64 t = p.fulltime.toMSecsSinceEpoch();
+		correct( p.cn, &t, 1 );
+		p.fulltime = QDateTime::fromMSecsSinceEpoch( t );
+		p.time = p.fulltime.time();
+		p.pm = false;
+	}
+}
+
+void SiClockModel::load()
+{
+	QSettings set;
+	set.beginGroup( "siclock/stations" );
+	QStringList cns = set.childGroups();
+	set.endGroup();
+	for( int i=0;i<cns.count();i++ ) {
+		int cn = cns.at(i).toInt();
+		QStringList l = set.value( stationKey( cn ) ).toStringList();
+		QVector<Sample> &v = samples[cn];
+		v.clear();
+		for( int j=0;j<l.count();j++ ) {
+			Sample s;
+			s.pc = l.at(j).section( ':', 0, 0 ).toLongLong();
+			s.offset = l.at(j).section( ':', 1, 1 ).toLongLong();
+			v.append( s );
+		}
+		fit( cn );
+	}
+}
+
+void SiClockModel::save( int cn ) const
+{
+	QStringList l;
+	const QVector<Sample> v = samples.value( cn );
+	for( int i=0;i<v.count();i++ )
+		l.append( QString( "%1:%2" ).arg( v.at(i).pc ).arg( v.at(i).offset ) );
+	QSettings set;
+	set.setValue( stationKey( cn ), l );
+}
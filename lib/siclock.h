@@ -0,0 +1,78 @@
+#ifndef SICLOCK_H
+#define SICLOCK_H
+
+#include <QObject>
+#include <QMap>
+#include <QVector>
+
+#include "siproto.h"
+
+// Clock of every station relative to the PC, by station code.
+//
+// Each GetTime answer is a sample of the station offset. The samples of a
+// station are fitted to offset+skew*(t-reference) by least squares, so a
+// station running fast or slow over a multi day event is corrected by the
+// time of the punch rather than by a single offset. The samples are kept
+// in QSettings under siclock/stations/<code> and fitted again on load().
+
+class SiClockModel : public QObject
+{
+	Q_OBJECT
+
+	public:
+		struct Model {
+			Model() :
+				reference( 0 ), offset( 0 ), skew( 0 ), samples( 0 )
+				{}
+			qint64 reference;	// PC msecs since epoch of the first sample
+			double offset;		// station-PC msecs at reference
+			double skew;		// offset change per msec
+			int samples;
+		};
+		enum {
+			MaxSamples = 256,
+			// Shorter spans only give an offset, the skew would be noise
+			MinSkewSpan = 10*60*1000
+		};
+
+		SiClockModel( QObject *parent = 0 );
+
+		void attach( SiProto *si );
+		void addSample( int cn, const QDateTime &station, const QDateTime &pc );
+
+		bool hasModel( int cn ) const { return models.contains( cn ); }
+		Model model( int cn ) const { return models.value( cn ); }
+		// station-PC msecs at PC time msecs
+		qint64 offsetAt( int cn, qint64 msecs ) const;
+		void forget( int cn );
+
+		// Turns n station times (msecs since epoch) of station cn into PC
+		// times in place
+		void correct( int cn, qint64 *msecs, int n ) const;
+		// Punch times, each by the model of its own station
+		void correct( QList<PunchBackupData> &punches ) const;
+		void correct( QList<PunchingRecord> &punches ) const;
+
+		void load();
+		void save( int cn ) const;
+
+	public slots:
+		void gotTime( const QDateTime &station, const QDateTime &pc, int cn );
+		// The clock jumped, the samples before no longer fit
+		void gotSetTime( const QDateTime &station, int cn );
+
+	signals:
+		void modelChanged( int cn );
+
+	private:
+		struct Sample {
+			qint64 pc;
+			qint64 offset;
+		};
+		void fit( int cn );
+
+		QMap<int, QVector<Sample> > samples;
+		QMap<int, Model> models;
+};
+
+#endif
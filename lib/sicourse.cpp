@@ -0,0 +1,361 @@
+#include "sicourse.h"
+
+namespace {
+
+qint64 elapsed( const PunchingRecord &p, const QDateTime &start )
+{
+	if ( !start.isValid() )
+		return -1;
+	if ( p.fulltime.isValid() )
+		return start.msecsTo( p.fulltime );
+	QTime t = p.getTime();
+	if ( !t.isValid() )
+		return -1;
+	// Only the time of day, a course takes less than a day
+	int ms = start.time().msecsTo( t );
+	return ms < 0 ? ms+86400000 : ms;
+}
+
+}
+
+SiCourse::SiCourse( const QString &name ) :
+	cname( name )
+{
+}
+
+bool SiCourse::valid( int cn ) const
+{
+	if ( cn > 0 && cn <= MaxControl )
+		return true;
+	qWarning( "SiCourse %s: bad control code %d", qPrintable( cname ), cn );
+	return false;
+}
+
+// code -> index table of a part, -1 for codes not in it
+int SiCourse::newLookup()
+{
+	int l = lookups.count();
+	lookups.insert( l, MaxControl+1, -1 );
+	return l;
+}
+
+void SiCourse::addControl( int cn )
+{
+	if ( !valid( cn ) )
+		return;
+	Part p;
+	p.type = Control;
+	p.first = codes.count();
+	p.count = 1;
+	p.needed = 1;
+	p.lookup = -1;
+	codes.append( cn );
+	parts.append( p );
+}
+
+void SiCourse::addFreeOrder( const QList<int> &cns, int needed )
+{
+	Part p;
+	p.type = FreeOrder;
+	p.first = codes.count();
+	p.lookup = newLookup();
+	for( int i=0;i<cns.count();i++ ) {
+		int cn = cns.at(i);
+		if ( !valid( cn ) || lookups.at( p.lookup+cn ) >= 0 )
+			continue;
+		lookups[p.lookup+cn] = codes.count()-p.first;
+		codes.append( cn );
+	}
+	p.count = codes.count()-p.first;
+	p.needed = needed < 0 ? p.count : qMin( needed, p.count );
+	if ( p.count )
+		parts.append( p );
+}
+
+void SiCourse::addLoops( const QList<QList<int> > &l )
+{
+	Part p;
+	p.type = Loops;
+	p.first = loops.count();
+	p.lookup = newLookup();
+	for( int i=0;i<l.count();i++ ) {
+		Range r;
+		r.first = codes.count();
+		for( int j=0;j<l.at(i).count();j++ ) {
+			if ( valid( l.at(i).at(j) ) )
+				codes.append( l.at(i).at(j) );
+		}
+		r.count = codes.count()-r.first;
+		if ( !r.count )
+			continue;
+		// Loops are told apart by their first control
+		int cn = codes.at( r.first );
+		if ( lookups.at( p.lookup+cn ) >= 0 )
+			qWarning( "SiCourse %s: two loops start at %d", qPrintable( cname ), cn );
+		else
+			lookups[p.lookup+cn] = loops.count()-p.first;
+		loops.append( r );
+	}
+	p.count = loops.count()-p.first;
+	p.needed = p.count;
+	if ( p.count )
+		parts.append( p );
+}
+
+int SiCourse::controlCount() const
+{
+	int n = 0;
+	for( int i=0;i<parts.count();i++ ) {
+		const Part &p = parts.at(i);
+		if ( p.type == Loops ) {
+			for( int j=0;j<p.count;j++ )
+				n += loops.at( p.first+j ).count;
+		} else
+			n += p.needed;
+	}
+	return n;
+}
+
+// Whether cn can be the first punch of part
+bool SiCourse::accepts( int part, int cn ) const
+{
+	if ( part >= parts.count() || cn <= 0 || cn > MaxControl )
+		return false;
+	const Part &p = parts.at( part );
+	if ( p.type == Control )
+		return codes.at( p.first ) == cn;
+	return lookups.at( p.lookup+cn ) >= 0;
+}
+
+// Number of controls of a free order part, or of first controls of its
+// loops, punched again at punch from or later. last is the last punch of
+// each code.
+int SiCourse::pending( int part, int from, const QVector<int> &last ) const
+{
+	const Part &p = parts.at( part );
+	int r = 0;
+	for( int j=0;j<p.count;j++ ) {
+		int cn = p.type == Loops ? codes.at( loops.at( p.first+j ).first ) : codes.at( p.first+j );
+		if ( last.at( cn ) >= from )
+			r++;
+	}
+	return r;
+}
+
+SiCourse SiCourse::fromString( const QString &name, const QString &def, bool *ok )
+{
+	SiCourse c( name );
+	bool good = true;
+	QList<int> group;
+	QList<QList<int> > loopl;
+	int needed = -1;
+	enum { Top, InGroup, InLoops } state = Top;
+	int num = -1;
+	for( int i=0;i<=def.length();i++ ) {
+		char ch = i < def.length() ? def.at(i).toLatin1() : ' ';
+		if ( ch >= '0' && ch <= '9' ) {
+			num = ( num < 0 ? 0 : num*10 )+ch-'0';
+			continue;
+		}
+		if ( ch == '(' && state == Top ) {
+			needed = num;
+			num = -1;
+			group.clear();
+			state = InGroup;
+			continue;
+		}
+		if ( num >= 0 ) {
+			if ( state == Top )
+				c.addControl( num );
+			else if ( state == InGroup )
+				group.append( num );
+			else
+				loopl.last().append( num );
+			num = -1;
+		}
+		if ( ch == ' ' || ch == '\t' || ch == ',' )
+			continue;
+		if ( ch == ')' && state == InGroup ) {
+			c.addFreeOrder( group, needed );
+			state = Top;
+		} else if ( ch == '[' && state == Top ) {
+			loopl.clear();
+			loopl.append( QList<int>() );
+			state = InLoops;
+		} else if ( ch == '|' && state == InLoops ) {
+			loopl.append( QList<int>() );
+		} else if ( ch == ']' && state == InLoops ) {
+			c.addLoops( loopl );
+			state = Top;
+		} else
+			good = false;
+	}
+	if ( state != Top )
+		good = false;
+	if ( ok )
+		*ok = good;
+	return c;
+}
+
+SiCourse::Result SiCourse::match( const SiCard &card ) const
+{
+	return match( card.getPunches(), card.getFullStartTime(), card.getFullFinishTime() );
+}
+
+SiCourse::Result SiCourse::match( const QList<PunchingRecord> &punches, const QDateTime &start, const QDateTime &finish ) const
+{
+	Result r;
+	int np = parts.count();
+	int part = 0;
+	// State of the free order or loops part being matched
+	QVector<bool> done;
+	int ndone = 0;
+	int curloop = -1;
+	int looppos = 0;
+	// Controls of the part not done yet (first controls of loops not
+	// started) that are punched at the current punch or later
+	int left = 0;
+	qint64 prevtime = 0;
+
+	QVector<int> last( MaxControl+1, -1 );
+	for( int i=0;i<punches.count();i++ ) {
+		int cn = punches.at(i).cn;
+		if ( cn > 0 && cn <= MaxControl )
+			last[cn] = i;
+	}
+
+	for( int i=0;i<punches.count();i++ ) {
+		int cn = punches.at(i).cn;
+		int idx = cn > 0 && cn <= MaxControl ? cn : 0;
+		int matched = -1;
+		while( part < np && matched < 0 ) {
+			const Part &p = parts.at( part );
+			if ( p.type == Control ) {
+				int want = codes.at( p.first );
+				if ( want != cn && last.at( want ) > i )
+					break;
+				if ( want == cn )
+					matched = cn;
+				else
+					r.missing.append( want );
+				part++;
+				continue;
+			}
+			if ( done.isEmpty() ) {
+				done.fill( false, p.count );
+				left = pending( part, i, last );
+			}
+			bool finished = false;
+			if ( p.type == FreeOrder ) {
+				int j = idx ? lookups.at( p.lookup+idx ) : -1;
+				if ( j >= 0 && !done.at( j ) ) {
+					done[j] = true;
+					left--;
+					matched = cn;
+					finished = ++ndone == p.count;
+				} else if ( !left || ( ndone >= p.needed && accepts( part+1, cn ) ) ) {
+					// Nothing more of it is punched, or enough of it and
+					// the next part starts here
+					for( int k=0,miss=p.needed-ndone;miss>0 && k<p.count;k++ ) {
+						if ( !done.at(k) ) {
+							r.missing.append( codes.at( p.first+k ) );
+							miss--;
+						}
+					}
+					finished = true;
+				} else
+					break;
+			} else {
+				if ( curloop < 0 ) {
+					int li = idx ? lookups.at( p.lookup+idx ) : -1;
+					if ( li >= 0 && !done.at( li ) ) {
+						curloop = li;
+						looppos = 0;
+						left--;
+					} else if ( !left ) {
+						// No loop left is started again
+						for( int k=0;k<p.count;k++ ) {
+							if ( done.at(k) )
+								continue;
+							const Range &l = loops.at( p.first+k );
+							for( int m=0;m<l.count;m++ )
+								r.missing.append( codes.at( l.first+m ) );
+						}
+						finished = true;
+					} else
+						break;
+				}
+				if ( curloop >= 0 ) {
+					const Range &l = loops.at( p.first+curloop );
+					int want = codes.at( l.first+looppos );
+					if ( want != cn && last.at( want ) > i )
+						break;
+					if ( want == cn )
+						matched = cn;
+					else
+						r.missing.append( want );
+					if ( ++looppos == l.count ) {
+						done[curloop] = true;
+						curloop = -1;
+						finished = ++ndone == p.count;
+					}
+				}
+			}
+			if ( finished ) {
+				done.clear();
+				ndone = 0;
+				curloop = -1;
+				part++;
+			}
+		}
+		// A control of the part left at its last punch is not punched again
+		if ( idx && last.at( idx ) == i && part < np && !done.isEmpty() ) {
+			const Part &p = parts.at( part );
+			int j = lookups.at( p.lookup+idx );
+			if ( j >= 0 && !done.at( j ) && ( p.type == FreeOrder || j != curloop ) )
+				left--;
+		}
+		if ( matched < 0 ) {
+			r.extra++;
+			continue;
+		}
+		Split s;
+		s.cn = matched;
+		s.punch = i;
+		s.time = elapsed( punches.at(i), start );
+		s.leg = s.time >= 0 && prevtime >= 0 ? s.time-prevtime : -1;
+		prevtime = s.time;
+		r.splits.append( s );
+	}
+
+	// Whatever is left was not punched
+	for( ;part<np;part++ ) {
+		const Part &p = parts.at( part );
+		if ( p.type == Control ) {
+			r.missing.append( codes.at( p.first ) );
+		} else if ( p.type == FreeOrder ) {
+			for( int j=0,miss=p.needed-ndone;miss>0 && j<p.count;j++ ) {
+				if ( done.isEmpty() || !done.at(j) ) {
+					r.missing.append( codes.at( p.first+j ) );
+					miss--;
+				}
+			}
+		} else {
+			for( int j=0;j<p.count;j++ ) {
+				if ( !done.isEmpty() && done.at(j) )
+					continue;
+				const Range &l = loops.at( p.first+j );
+				int from = j == curloop ? looppos : 0;
+				for( int k=from;k<l.count;k++ )
+					r.missing.append( codes.at( l.first+k ) );
+			}
+		}
+		done.clear();
+		ndone = 0;
+		curloop = -1;
+	}
+	if ( start.isValid() && finish.isValid() )
+		r.runningtime = start.msecsTo( finish );
+	r.ok = r.missing.isEmpty();
+	return r;
+}
@@ -0,0 +1,101 @@
+#ifndef SICOURSE_H
+#define SICOURSE_H
+
+#include <QString>
+#include <QVector>
+
+#include "siproto.h"
+
+// Course to check readouts against, compiled once into flat tables so that
+// matching a card is a single pass over its punches.
+//
+// A course is a list of parts:
+//   control    punched in order
+//   free order all of a set of controls in any order, or for a score part
+//              at least needed of them
+//   loops      every loop (an ordered list of controls) once in any order,
+//              e.g. the wings of a butterfly each ending at the centre
+// Extra punches between parts are allowed. The course is matched as a
+// subsequence of the punches: a punch only advances when it is a control
+// the course expects next, anything else is extra. A control is missing
+// once it is not punched anywhere later, matching then carries on with
+// the next one.
+//
+// fromString() reads courses written as
+//   "31 32 (33 34 35) 3(40 41 42 43) 50 [51 52 50 | 53 54 50] 100"
+// where ( ) is free order, n( ) a score part and [ | ] loops.
+
+class SiCourse
+{
+	public:
+		enum {
+			MaxControl = 1023
+		};
+
+		struct Split {
+			int cn;
+			int punch;		// index in the punch list
+			qint64 time;	// msecs since start, -1 when not known
+			qint64 leg;		// msecs since the previous split, -1 when not known
+		};
+		struct Result {
+			Result() :
+				ok( false ), extra( 0 ), runningtime( -1 )
+				{}
+			bool ok;
+			QList<Split> splits;
+			QList<int> missing;
+			int extra;		// punches not on the course
+			qint64 runningtime;	// msecs from start to finish, -1 when not known
+		};
+
+		SiCourse( const QString &name = QString() );
+
+		static SiCourse fromString( const QString &name, const QString &def, bool *ok = NULL );
+
+		void addControl( int cn );
+		// needed < 0 means all of them
+		void addFreeOrder( const QList<int> &cns, int needed = -1 );
+		void addLoops( const QList<QList<int> > &loops );
+
+		QString name() const { return cname; }
+		// Controls to punch, the minimum for score parts
+		int controlCount() const;
+
+		Result match( const SiCard &card ) const;
+		Result match( const QList<PunchingRecord> &punches, const QDateTime &start, const QDateTime &finish ) const;
+
+	private:
+		enum PartType {
+			Control,
+			FreeOrder,
+			Loops
+		};
+		// Controls of a part are codes[first..first+count), for loops the
+		// loops are loops[first..first+count) and each loop is a range of
+		// codes. lookup is the offset of the part's code -> index table.
+		struct Part {
+			PartType type;
+			int first;
+			int count;
+			int needed;
+			int lookup;
+		};
+		struct Range {
+			int first;
+			int count;
+		};
+
+		bool valid( int cn ) const;
+		int newLookup();
+		bool accepts( int part, int cn ) const;
+		int pending( int part, int from, const QVector<int> &last ) const;
+
+		QString cname;
+		QVector<Part> parts;
+		QVector<int> codes;
+		QVector<Range> loops;
+		QVector<qint16> lookups;
+};
+
+#endif
@@ -0,0 +1,261 @@
+#include "sidevicemonitor.h"
+
+#include <QDir>
+#include <QFileSystemWatcher>
+#include <QSocketNotifier>
+#include <QThread>
+#include <QTimer>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+enum {
+	// udev may still be setting permissions when the node appears, a
+	// failed probe is repeated a few times
+	MaxProbeAttempts = 3,
+	RetryInterval = 500
+};
+
+const char DevDir[] = "/dev";
+
+class DeviceProbe : public QThread
+{
+	public:
+		DeviceProbe( const QString &d, int dl, QObject *parent ) :
+			QThread( parent ), device( d ), deadline( dl ), found( false )
+			{}
+		void run() {
+			found = SiProbe::probeDevice( device, deadline, &result );
+		}
+		QString device;
+		int deadline;
+		bool found;
+		SiProbeResult result;
+};
+
+}
+
+SiDeviceMonitor::SiDeviceMonitor( QObject *parent ) :
+	QObject( parent ),
+	inotifyfd( -1 ),
+	notifier( NULL ),
+	watcher( NULL ),
+	probeenabled( true ),
+	probedeadline( 2000 )
+{
+}
+
+SiDeviceMonitor::~SiDeviceMonitor()
+{
+	stop();
+}
+
+bool SiDeviceMonitor::isSerialDevice( const QString &name )
+{
+#if defined( __APPLE__ )
+	return name.startsWith( "cu." );
+#else
+	return name.startsWith( "ttyUSB" ) || name.startsWith( "ttyACM" );
+#endif
+}
+
+bool SiDeviceMonitor::start()
+{
+	if ( isRunning() )
+		return true;
+	known.clear();
+	stations.clear();
+	results.clear();
+	attempts.clear();
+	QStringList entries = QDir( DevDir ).entryList( QDir::System );
+	for( int i=0;i<entries.count();i++ ) {
+		if ( isSerialDevice( entries.at(i) ) )
+			known.append( QDir( DevDir ).filePath( entries.at(i) ) );
+	}
+#ifdef __linux__
+	inotifyfd = inotify_init1( IN_NONBLOCK|IN_CLOEXEC );
+	if ( inotifyfd != -1 &&
+		 inotify_add_watch( inotifyfd, DevDir, IN_CREATE|IN_DELETE|IN_ATTRIB|IN_MOVED_FROM|IN_MOVED_TO ) != -1 ) {
+		notifier = new QSocketNotifier( inotifyfd, QSocketNotifier::Read, this );
+		connect( notifier, SIGNAL( activated(int) ), this, SLOT( inotifyActivated(int) ) );
+		return true;
+	}
+	qWarning( "inotify on %s failed, falling back to QFileSystemWatcher", DevDir );
+	if ( inotifyfd != -1 )
+		::close( inotifyfd );
+	inotifyfd = -1;
+#endif
+	watcher = new QFileSystemWatcher( this );
+	watcher->addPath( DevDir );
+	if ( watcher->directories().isEmpty() ) {
+		qWarning( "Can not watch %s for serial devices", DevDir );
+		delete watcher;
+		watcher = NULL;
+		return false;
+	}
+	connect( watcher, SIGNAL( directoryChanged(const QString &) ),
+			this, SLOT( directoryChanged(const QString &) ) );
+	return true;
+}
+
+void SiDeviceMonitor::stop()
+{
+	delete notifier;
+	notifier = NULL;
+#ifdef __linux__
+	if ( inotifyfd != -1 )
+		::close( inotifyfd );
+	inotifyfd = -1;
+#endif
+	delete watcher;
+	watcher = NULL;
+	// Probes end by themselves within the deadline
+	for( int i=0;i<probes.count();i++ ) {
+		probes.at(i)->wait();
+		delete probes.at(i);
+	}
+	probes.clear();
+	retry.clear();
+}
+
+void SiDeviceMonitor::setDevicesInUse( const QStringList &devices )
+{
+	inuse = devices;
+	for( int i=0;i<inuse.count();i++ )
+		retry.removeAll( inuse.at(i) );
+}
+
+bool SiDeviceMonitor::isRunning() const
+{
+	return notifier || watcher;
+}
+
+void SiDeviceMonitor::inotifyActivated( int )
+{
+#ifdef __linux__
+	char buf[4096] __attribute__(( aligned( __alignof__( struct inotify_event ) ) ));
+	ssize_t len;
+	while( ( len = ::read( inotifyfd, buf, sizeof( buf ) ) ) > 0 ) {
+		for( char *p = buf; p < buf+len; p += sizeof( struct inotify_event )+((struct inotify_event *)p)->len ) {
+			const struct inotify_event *ev = (const struct inotify_event *)p;
+			if ( !ev->len || !isSerialDevice( ev->name ) )
+				continue;
+			QString device = QDir( DevDir ).filePath( ev->name );
+			if ( ev->mask & ( IN_DELETE|IN_MOVED_FROM ) )
+				removeDevice( device );
+			else if ( ev->mask & ( IN_CREATE|IN_MOVED_TO ) )
+				addDevice( device );
+			else if ( ( ev->mask & IN_ATTRIB ) && known.contains( device ) && !stations.contains( device ) ) {
+				// Permissions set by udev, the first probe may have
+				// been refused
+				attempts.remove( device );
+				startProbe( device );
+			}
+		}
+	}
+#endif
+}
+
+void SiDeviceMonitor::directoryChanged( const QString & )
+{
+	rescan();
+}
+
+void SiDeviceMonitor::rescan()
+{
+	QStringList now;
+	QStringList entries = QDir( DevDir ).entryList( QDir::System );
+	for( int i=0;i<entries.count();i++ ) {
+		if ( isSerialDevice( entries.at(i) ) )
+			now.append( QDir( DevDir ).filePath( entries.at(i) ) );
+	}
+	QStringList old = known;
+	for( int i=0;i<old.count();i++ ) {
+		if ( !now.contains( old.at(i) ) )
+			removeDevice( old.at(i) );
+	}
+	for( int i=0;i<now.count();i++ ) {
+		if ( !known.contains( now.at(i) ) )
+			addDevice( now.at(i) );
+	}
+}
+
+void SiDeviceMonitor::addDevice( const QString &device )
+{
+	if ( known.contains( device ) )
+		return;
+	known.append( device );
+	attempts.remove( device );
+	emit deviceAdded( device );
+	startProbe( device );
+}
+
+void SiDeviceMonitor::removeDevice( const QString &device )
+{
+	if ( !known.removeAll( device ) )
+		return;
+	stations.removeAll( device );
+	results.remove( device );
+	retry.removeAll( device );
+	attempts.remove( device );
+	emit deviceRemoved( device );
+}
+
+void SiDeviceMonitor::startProbe( const QString &device )
+{
+	if ( !probeenabled || inuse.contains( device ) )
+		return;
+	for( int i=0;i<probes.count();i++ ) {
+		if ( static_cast<DeviceProbe *>( probes.at(i) )->device == device )
+			return;
+	}
+	attempts[device]++;
+	DeviceProbe *p = new DeviceProbe( device, probedeadline, this );
+	connect( p, SIGNAL( finished() ), this, SLOT( probeFinished() ) );
+	probes.append( p );
+	p->start();
+}
+
+void SiDeviceMonitor::probeFinished()
+{
+	DeviceProbe *p = static_cast<DeviceProbe *>( sender() );
+	if ( !probes.removeAll( p ) )
+		return;
+	p->wait();
+	// Gone again or opened elsewhere while probing
+	if ( known.contains( p->device ) && !inuse.contains( p->device ) ) {
+		if ( p->found ) {
+			attempts.remove( p->device );
+			stations.append( p->device );
+			results.insert( p->device, p->result );
+			emit stationFound( p->result );
+		} else if ( attempts.value( p->device ) < MaxProbeAttempts && !retry.contains( p->device ) ) {
+			retry.append( p->device );
+			QTimer::singleShot( RetryInterval, this, SLOT( retryProbes() ) );
+		}
+	}
+	p->deleteLater();
+}
+
+void SiDeviceMonitor::reportStations()
+{
+	QStringList l = stations;
+	for( int i=0;i<l.count();i++ ) {
+		if ( !inuse.contains( l.at(i) ) && results.contains( l.at(i) ) )
+			emit stationFound( results.value( l.at(i) ) );
+	}
+}
+
+void SiDeviceMonitor::retryProbes()
+{
+	QStringList r = retry;
+	retry.clear();
+	for( int i=0;i<r.count();i++ ) {
+		if ( known.contains( r.at(i) ) && !stations.contains( r.at(i) ) )
+			startProbe( r.at(i) );
+	}
+}
@@ -0,0 +1,82 @@
+#ifndef SIDEVICEMONITOR_H
+#define SIDEVICEMONITOR_H
+
+#include <QObject>
+#include <QStringList>
+#include <QMap>
+
+#include "siprobe.h"
+
+class QSocketNotifier;
+class QFileSystemWatcher;
+class QThread;
+
+// Watches /dev for serial devices coming and going, so a station that is
+// unplugged and plugged in again is picked up without a restart. Uses
+// inotify on Linux and QFileSystemWatcher elsewhere. New devices are
+// probed in the background and reported with stationFound().
+class SiDeviceMonitor : public QObject
+{
+	Q_OBJECT
+
+	public:
+		SiDeviceMonitor( QObject *parent = 0 );
+		~SiDeviceMonitor();
+
+		// Devices present at start() are remembered but not probed,
+		// they are expected to be handled by SiProto::searchAndOpen()
+		bool start();
+		void stop();
+		bool isRunning() const;
+
+		// Serial devices currently present
+		QStringList devices() const { return known; }
+		// Devices open elsewhere, these are never probed
+		void setDevicesInUse( const QStringList &devices );
+		QStringList devicesInUse() const { return inuse; }
+
+		void setProbeEnabled( bool enabled ) { probeenabled = enabled; }
+		// Time one probe may take
+		void setProbeDeadline( int msecs ) { probedeadline = msecs; }
+
+		// Whether a /dev entry looks like a station, e.g. ttyUSB0
+		static bool isSerialDevice( const QString &name );
+
+	public slots:
+		// Emits stationFound() again for every station found before that
+		// is not in use, e.g. when the one in use went away
+		void reportStations();
+
+	signals:
+		void deviceAdded( const QString &device );
+		void deviceRemoved( const QString &device );
+		void stationFound( const SiProbeResult &r );
+
+	private slots:
+		void inotifyActivated( int );
+		void directoryChanged( const QString & );
+		void probeFinished();
+		void retryProbes();
+
+	private:
+		void rescan();
+		void addDevice( const QString &device );
+		void removeDevice( const QString &device );
+		void startProbe( const QString &device );
+
+		int inotifyfd;
+		QSocketNotifier *notifier;
+		QFileSystemWatcher *watcher;
+
+		QStringList known;
+		QStringList stations;
+		QMap<QString, SiProbeResult> results;
+		QStringList inuse;
+		QList<QThread *> probes;
+		QMap<QString, int> attempts;
+		QStringList retry;
+		bool probeenabled;
+		int probedeadline;
+};
+
+#endif
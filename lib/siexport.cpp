@@ -0,0 +1,242 @@
+#include "siexport.h"
+
+#include <string.h>
+
+SiExport::SiExport( Format f, QObject *parent ) :
+	QObject( parent ),
+	format( f ),
+	dev( NULL ),
+	buf( new char[BufferSize] ),
+	used( 0 ),
+	records( 0 ),
+	failed( false )
+{
+}
+
+SiExport::~SiExport()
+{
+	close();
+	delete [] buf;
+}
+
+SiExport::Format SiExport::formatForFile( const QString &file )
+{
+	return file.endsWith( ".xml", Qt::CaseInsensitive ) ? IofXml : Csv;
+}
+
+bool SiExport::open( const QString &f )
+{
+	close();
+	file.setFileName( f );
+	if ( !file.open( QIODevice::WriteOnly|QIODevice::Truncate ) ) {
+		lasterror = file.errorString();
+		return false;
+	}
+	return open( &file );
+}
+
+bool SiExport::open( QIODevice *d )
+{
+	if ( d != &file )
+		close();
+	dev = d;
+	used = 0;
+	records = 0;
+	failed = false;
+	if ( format == IofXml ) {
+		put( "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+			"<PunchList xmlns=\"http://www.orienteering.org/datastandard/3.0\" iofVersion=\"3.0\" createTime=\"" );
+		putTime( QDateTime::currentDateTime() );
+		put( "\" creator=\"qsilib\">\n" );
+	}
+	return true;
+}
+
+bool SiExport::close()
+{
+	if ( !dev )
+		return true;
+	if ( format == IofXml )
+		put( "</PunchList>\n" );
+	bool ok = flush() && !failed;
+	if ( !ok )
+		lasterror = dev->errorString();
+	dev = NULL;
+	if ( file.isOpen() )
+		file.close();
+	return ok;
+}
+
+bool SiExport::flush()
+{
+	if ( used && dev->write( buf, used ) != used )
+		failed = true;
+	used = 0;
+	return !failed;
+}
+
+void SiExport::put( const char *s, int len )
+{
+	while( len > 0 ) {
+		if ( used == BufferSize )
+			flush();
+		int n = qMin( len, (int)BufferSize-used );
+		memcpy( buf+used, s, n );
+		used += n;
+		s += n;
+		len -= n;
+	}
+}
+
+void SiExport::put( const char *s )
+{
+	put( s, strlen( s ) );
+}
+
+void SiExport::putInt( int n )
+{
+	char d[12];
+	int i = sizeof( d );
+	unsigned int u = n < 0 ? -(unsigned int)n : n;
+	do {
+		d[--i] = '0'+u%10;
+		u /= 10;
+	} while( u );
+	if ( n < 0 )
+		d[--i] = '-';
+	put( d+i, sizeof( d )-i );
+}
+
+// QDateTime::toString() would allocate for every time written
+void SiExport::putTime( const QDate &d, const QTime &t )
+{
+	char s[32];
+	int n = 0;
+	if ( d.isValid() )
+		n = qsnprintf( s, sizeof( s ), "%04d-%02d-%02dT", d.year(), d.month(), d.day() );
+	n += qsnprintf( s+n, sizeof( s )-n, "%02d:%02d:%02d", t.hour(), t.minute(), t.second() );
+	if ( t.msec() )
+		n += qsnprintf( s+n, sizeof( s )-n, ".%03d", t.msec() );
+	put( s, n );
+}
+
+void SiExport::putTime( const QDateTime &dt )
+{
+	putTime( dt.date(), dt.time() );
+}
+
+void SiExport::putElement( const char *name, const QDateTime &dt )
+{
+	if ( !dt.isValid() )
+		return;
+	put( "\t\t<" );
+	put( name );
+	put( ">" );
+	putTime( dt );
+	put( "</" );
+	put( name );
+	put( ">\n" );
+}
+
+void SiExport::writeCard( const SiCard &card )
+{
+	if ( !dev )
+		return;
+	const QList<PunchingRecord> &plist = card.getPunches();
+	if ( format == Csv ) {
+		put( "Card;" );
+		putInt( card.getCardNumber() );
+		put( ";" );
+		if ( card.getFullStartTime().isValid() )
+			putTime( card.getFullStartTime() );
+		put( ";" );
+		if ( card.getFullFinishTime().isValid() )
+			putTime( card.getFullFinishTime() );
+		put( ";" );
+		if ( card.getFullCheckTime().isValid() )
+			putTime( card.getFullCheckTime() );
+		for( int i=0;i<plist.count();i++ ) {
+			const PunchingRecord &p = plist.at(i);
+			put( ";" );
+			putInt( p.cn );
+			put( ";" );
+			if ( p.fulltime.isValid() )
+				putTime( p.fulltime );
+			else if ( p.getTime().isValid() )
+				putTime( QDate(), p.getTime() );
+		}
+		put( "\n" );
+	} else {
+		put( "\t<CardRead>\n\t\t<ControlCard punchingSystem=\"SI\">" );
+		putInt( card.getCardNumber() );
+		put( "</ControlCard>\n" );
+		putElement( "CheckTime", card.getFullCheckTime() );
+		putElement( "StartTime", card.getFullStartTime() );
+		for( int i=0;i<plist.count();i++ ) {
+			const PunchingRecord &p = plist.at(i);
+			put( "\t\t<Punch>\n\t\t\t<ControlCode>" );
+			putInt( p.cn );
+			put( "</ControlCode>\n" );
+			// xsd:dateTime needs the date
+			if ( p.fulltime.isValid() || ( p.getTime().isValid() && eventdate.isValid() ) ) {
+				put( "\t\t\t<Time>" );
+				if ( p.fulltime.isValid() )
+					putTime( p.fulltime );
+				else
+					putTime( eventdate, p.getTime() );
+				put( "</Time>\n" );
+			}
+			put( "\t\t</Punch>\n" );
+		}
+		putElement( "FinishTime", card.getFullFinishTime() );
+		put( "\t</CardRead>\n" );
+	}
+	records++;
+}
+
+void SiExport::putPunch( int cardnum, int cn, const QDate &d, const QTime &t )
+{
+	if ( !dev )
+		return;
+	if ( format == Csv ) {
+		put( "Punch;" );
+		putInt( cn );
+		put( ";" );
+		putInt( cardnum );
+		put( ";" );
+		if ( t.isValid() )
+			putTime( d, t );
+		put( "\n" );
+	} else {
+		put( "\t<Punch>\n\t\t<ControlCard punchingSystem=\"SI\">" );
+		putInt( cardnum );
+		put( "</ControlCard>\n\t\t<ControlCode>" );
+		putInt( cn );
+		put( "</ControlCode>\n" );
+		QDate day = d.isValid() ? d : eventdate;
+		if ( t.isValid() && day.isValid() ) {
+			put( "\t\t<Time>" );
+			putTime( day, t );
+			put( "</Time>\n" );
+		}
+		put( "\t</Punch>\n" );
+	}
+	records++;
+}
+
+void SiExport::writePunch( const SiPunch &p )
+{
+	putPunch( p.cardnum, p.cn, QDate(), p.time() );
+}
+
+void SiExport::writeBackupPunch( const PunchBackupData &p )
+{
+	putPunch( p.cardnum, p.cn, p.d, p.t );
+}
+
+void SiExport::attach( SiProto *si )
+{
+	connect( si, SIGNAL( cardRead(const SiCard &) ), this, SLOT( writeCard(const SiCard &) ) );
+	connect( si, SIGNAL( backupCard(const SiCard &) ), this, SLOT( writeCard(const SiCard &) ) );
+	connect( si, SIGNAL( backupPunch(const PunchBackupData &) ), this, SLOT( writeBackupPunch(const PunchBackupData &) ) );
+}
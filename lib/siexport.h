@@ -0,0 +1,83 @@
+#ifndef SIEXPORT_H
+#define SIEXPORT_H
+
+#include <QObject>
+#include <QFile>
+
+#include "siproto.h"
+
+// Writes cards and punches to a file as they are decoded, in CSV or as
+// IOF XML 3.0. Records go through a fixed buffer straight to the device,
+// nothing is kept per record, so the number of records only costs I/O.
+//
+// CSV, one record a line, fields separated by ';':
+//   Card;card number;start;finish;check;control;time;control;time...
+//   Punch;control;card number;time
+// IOF XML: a PunchList with a CardRead for every card and a Punch for
+// every single punch. Times are ISO 8601. In CSV they go without the date
+// when the station did not know it, in XML they take the event date then
+// and are left out without one.
+
+class SiExport : public QObject
+{
+	Q_OBJECT
+
+	public:
+		enum Format {
+			Csv,
+			IofXml
+		};
+
+		SiExport( Format format = Csv, QObject *parent = 0 );
+		~SiExport();
+
+		// IofXml for *.xml, Csv otherwise
+		static Format formatForFile( const QString &file );
+
+		bool open( const QString &file );
+		// dev is not owned and has to be open for writing
+		bool open( QIODevice *dev );
+		// Ends the document and writes what is buffered
+		bool close();
+		bool isOpen() const { return dev != NULL; }
+		QString lasterror;
+
+		// Records written since open
+		int count() const { return records; }
+
+		// Date of punches the station kept without one, for IofXml
+		void setEventDate( const QDate &d ) { eventdate = d; }
+
+		// Exports every card and backup record si reads
+		void attach( SiProto *si );
+
+	public slots:
+		void writeCard( const SiCard &card );
+		void writePunch( const SiPunch &p );
+		void writeBackupPunch( const PunchBackupData &p );
+
+	private:
+		enum {
+			BufferSize = 64*1024
+		};
+
+		void put( const char *s, int len );
+		void put( const char *s );
+		void putInt( int n );
+		void putTime( const QDate &d, const QTime &t );
+		void putTime( const QDateTime &dt );
+		void putElement( const char *name, const QDateTime &dt );
+		void putPunch( int cardnum, int cn, const QDate &d, const QTime &t );
+		bool flush();
+
+		Format format;
+		QFile file;
+		QIODevice *dev;
+		char *buf;
+		int used;
+		int records;
+		bool failed;
+		QDate eventdate;
+};
+
+#endif
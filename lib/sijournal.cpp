@@ -0,0 +1,407 @@
+#include "sijournal.h"
+#include "silatency.h"
+
+#include <QDateTime>
+#include <QFileInfo>
+#include <QtEndian>
+
+#include <string.h>
+
+#if ( defined( __linux__ ) | defined( __APPLE__ ) )
+#include <unistd.h>
+#else
+#include <windows.h>
+#include <io.h>
+#endif
+
+namespace {
+
+quint32 crc32( const char *data, int len )
+{
+	static quint32 table[256];
+	static bool init = false;
+	if ( !init ) {
+		for( quint32 i=0;i<256;i++ ) {
+			quint32 c = i;
+			for( int k=0;k<8;k++ )
+				c = ( c & 1 ) ? 0xEDB88320 ^ ( c >> 1 ) : c >> 1;
+			table[i] = c;
+		}
+		init = true;
+	}
+	quint32 c = 0xFFFFFFFF;
+	for( int i=0;i<len;i++ )
+		c = table[( c ^ (uchar)data[i] ) & 0xFF] ^ ( c >> 8 );
+	return c ^ 0xFFFFFFFF;
+}
+
+// Name to move journal f to that is not taken yet
+QString asideName( const QString &f, const QString &what )
+{
+	QString base = f+"."+what+"-"+QDateTime::currentDateTime().toString( "yyyyMMdd-hhmmss" );
+	QString n = base;
+	for( int i=1;QFile::exists( n );i++ )
+		n = QString( "%1-%2" ).arg( base ).arg( i );
+	return n;
+}
+
+}
+
+SiJournal::SiJournal( QObject *parent ) :
+	QThread( parent ),
+	sequence( 0 ),
+	syncinterval( 200 ),
+	maxunsynced( 64 ),
+	stopping( false ),
+	syncnow( false ),
+	unsynced( 0 ),
+	firstunsynced( 0 ),
+	written( 0 ),
+	synced( 0 )
+{
+	// Computes the CRC table before there is a second thread
+	crc32( "", 0 );
+}
+
+SiJournal::~SiJournal()
+{
+	close();
+}
+
+QByteArray SiJournal::fileHeader()
+{
+	uchar h[HeaderSize];
+	memcpy( h, "SIJRNL01", 8 );
+	qToLittleEndian<qint64>( QDateTime::currentDateTime().toMSecsSinceEpoch(), h+8 );
+	return QByteArray( (const char *)h, HeaderSize );
+}
+
+bool SiJournal::open( const QString &f )
+{
+	close();
+	sequence = 0;
+	qint64 end = 0;
+	bool damaged = false;
+	// Anything shorter than a header is a file torn while being created
+	if ( QFile::exists( f ) && QFileInfo( f ).size() >= HeaderSize ) {
+		SiJournalReader r;
+		if ( !r.open( f ) ) {
+			lasterror = r.lasterror;
+			return false;
+		}
+		SiJournalReader::Record rec;
+		while( r.readRecord( rec ) )
+			sequence = rec.sequence;
+		end = r.pos();
+		damaged = !r.lasterror.isEmpty() && !r.tornTail();
+	}
+	if ( damaged ) {
+		// Records after the damage may still be read by hand, the file is
+		// kept whole and numbering goes on in a new one
+		QString aside = asideName( f, "damaged" );
+		if ( !QFile::rename( f, aside ) ) {
+			lasterror = "Could not move damaged journal "+f;
+			return false;
+		}
+		qWarning( "Journal %s is damaged at offset %lld, moved to %s", qPrintable( f ), end, qPrintable( aside ) );
+		end = 0;
+	}
+	file.setFileName( f );
+	if ( !file.open( QIODevice::ReadWrite ) ) {
+		lasterror = file.errorString();
+		return false;
+	}
+	if ( end == 0 ) {
+		file.resize( 0 );
+		file.write( fileHeader() );
+		file.flush();
+	} else if ( file.size() > end ) {
+		qWarning( "Cutting %lld torn bytes off journal %s", file.size()-end, qPrintable( f ) );
+		file.resize( end );
+	}
+	file.seek( file.size() );
+	syncFile();
+	written = synced = sequence;
+	unsynced = 0;
+	stopping = false;
+	start( QThread::LowPriority );
+	return true;
+}
+
+void SiJournal::close()
+{
+	if ( !file.isOpen() )
+		return;
+	lock.lock();
+	stopping = true;
+	wakeup.wakeAll();
+	lock.unlock();
+	wait();
+	file.close();
+}
+
+bool SiJournal::startNew()
+{
+	QString f = file.fileName();
+	close();
+	if ( QFile::exists( f ) && !QFile::rename( f, asideName( f, "old" ) ) ) {
+		lasterror = "Could not move "+f;
+		return false;
+	}
+	return open( f );
+}
+
+quint32 SiJournal::append( RecordType type, const QByteArray &data, int station )
+{
+	if ( !file.isOpen() )
+		return 0;
+	int blen = BodyHeaderSize+data.length();
+	QByteArray rec( RecordHeaderSize+blen, 0 );
+	uchar *r = (uchar *)rec.data();
+	uchar *b = r+RecordHeaderSize;
+	quint32 seq = sequence+1;
+	qToLittleEndian<quint32>( seq, b );
+	b[4] = type;
+	b[5] = 0;
+	qToLittleEndian<quint16>( station, b+6 );
+	qToLittleEndian<qint64>( QDateTime::currentDateTime().toMSecsSinceEpoch(), b+8 );
+	memcpy( b+BodyHeaderSize, data.constData(), data.length() );
+	qToLittleEndian<quint32>( blen, r );
+	qToLittleEndian<quint32>( crc32( (const char *)b, blen ), r+4 );
+
+	QMutexLocker l( &lock );
+	// Straight to the OS, only the sync is left to the thread
+	if ( file.write( rec ) != rec.length() || !file.flush() ) {
+		qWarning( "Failed to write journal %s: %s", qPrintable( file.fileName() ), qPrintable( file.errorString() ) );
+		return 0;
+	}
+	sequence = seq;
+	written = seq;
+	if ( unsynced++ == 0 )
+		firstunsynced = siMonotonicNsecs();
+	if ( unsynced >= maxunsynced || unsynced == 1 )
+		wakeup.wakeAll();
+	return seq;
+}
+
+bool SiJournal::waitForDurable( quint32 seq, int msecs )
+{
+	QMutexLocker l( &lock );
+	qint64 end = siMonotonicNsecs()+(qint64)msecs*1000000;
+	while( synced < seq ) {
+		qint64 left = ( end-siMonotonicNsecs() )/1000000;
+		if ( left <= 0 || stopping )
+			return false;
+		// Do not wait for the interval to pass
+		syncnow = true;
+		wakeup.wakeAll();
+		durable.wait( &lock, left );
+	}
+	return true;
+}
+
+quint32 SiJournal::lastDurable() const
+{
+	QMutexLocker l( &lock );
+	return synced;
+}
+
+bool SiJournal::syncFile()
+{
+#if defined( __linux__ )
+	return fdatasync( file.handle() ) == 0;
+#elif defined( __APPLE__ )
+	return fsync( file.handle() ) == 0;
+#else
+	return FlushFileBuffers( (HANDLE)_get_osfhandle( file.handle() ) );
+#endif
+}
+
+void SiJournal::run()
+{
+	lock.lock();
+	while( true ) {
+		if ( !unsynced ) {
+			if ( stopping )
+				break;
+			wakeup.wait( &lock );
+			continue;
+		}
+		qint64 due = firstunsynced+(qint64)syncinterval*1000000;
+		qint64 now = siMonotonicNsecs();
+		if ( !stopping && !syncnow && unsynced < maxunsynced && now < due ) {
+			wakeup.wait( &lock, ( due-now )/1000000+1 );
+			continue;
+		}
+		quint32 seq = written;
+		unsynced = 0;
+		syncnow = false;
+		lock.unlock();
+		if ( !syncFile() )
+			qWarning( "Failed to sync journal %s", qPrintable( file.fileName() ) );
+		lock.lock();
+		synced = seq;
+		durable.wakeAll();
+	}
+	lock.unlock();
+}
+
+void SiJournal::attach( SiProto *si, int station )
+{
+	stations.insert( si, station );
+	connect( si, SIGNAL( cardRead(const SiCard &) ), this, SLOT( appendCard(const SiCard &) ) );
+	connect( si, SIGNAL( backupCard(const SiCard &) ), this, SLOT( appendBackupCard(const SiCard &) ) );
+}
+
+void SiJournal::appendCard( const SiCard &card )
+{
+	append( Card, card.getRawData(), stations.value( sender() ) );
+}
+
+void SiJournal::appendBackupCard( const SiCard &card )
+{
+	append( BackupCard, card.getRawData(), stations.value( sender() ) );
+}
+
+QByteArray SiJournal::punchData( const SiPunch &p )
+{
+	uchar d[16];
+	qToLittleEndian<quint32>( p.cardnum, d );
+	qToLittleEndian<quint16>( p.cn, d+4 );
+	qToLittleEndian<qint32>( p.msecs, d+6 );
+	d[10] = p.dayofweek;
+	d[11] = p.weekcounter;
+	qToLittleEndian<qint32>( p.memaddr, d+12 );
+	return QByteArray( (const char *)d, 16 );
+}
+
+void SiJournal::appendPunch( const SiPunch &p )
+{
+	append( Punch, punchData( p ), p.station );
+}
+
+SiCard SiJournalReader::Record::card() const
+{
+	return SiCard::fromRawData( data );
+}
+
+SiPunch SiJournalReader::Record::punch() const
+{
+	SiPunch p;
+	if ( data.length() < 16 )
+		return p;
+	const uchar *d = (const uchar *)data.constData();
+	p.cardnum = qFromLittleEndian<quint32>( d );
+	p.cn = qFromLittleEndian<quint16>( d+4 );
+	p.msecs = qFromLittleEndian<qint32>( d+6 );
+	p.dayofweek = d[10];
+	p.weekcounter = d[11];
+	p.memaddr = qFromLittleEndian<qint32>( d+12 );
+	p.station = station;
+	return p;
+}
+
+SiJournalReader::SiJournalReader() :
+	goodpos( 0 ),
+	createdmsecs( 0 ),
+	torn( false )
+{
+}
+
+bool SiJournalReader::open( const QString &f )
+{
+	close();
+	file.setFileName( f );
+	if ( !file.open( QIODevice::ReadOnly ) ) {
+		lasterror = file.errorString();
+		return false;
+	}
+	QByteArray h = file.read( SiJournal::HeaderSize );
+	if ( h.length() != SiJournal::HeaderSize || !h.startsWith( "SIJRNL01" ) ) {
+		lasterror = "Not a readout journal";
+		file.close();
+		return false;
+	}
+	createdmsecs = qFromLittleEndian<qint64>( (const uchar *)h.constData()+8 );
+	goodpos = file.pos();
+	return true;
+}
+
+void SiJournalReader::close()
+{
+	if ( file.isOpen() )
+		file.close();
+	goodpos = 0;
+	createdmsecs = 0;
+	torn = false;
+}
+
+bool SiJournalReader::seek( qint64 offset )
+{
+	if ( offset < SiJournal::HeaderSize || !file.seek( offset ) )
+		return false;
+	goodpos = offset;
+	torn = false;
+	return true;
+}
+
+bool SiJournalReader::zerosToEnd( qint64 from )
+{
+	if ( !file.seek( from ) )
+		return false;
+	while( !file.atEnd() ) {
+		QByteArray b = file.read( 65536 );
+		if ( b.isEmpty() )
+			return false;
+		for( int i=0;i<b.length();i++ ) {
+			if ( b.at(i) )
+				return false;
+		}
+	}
+	return true;
+}
+
+// A record is torn when it runs into the end of the file, or when all
+// from its start to the end is zeros, the file having grown before the
+// data got to the disk.
+bool SiJournalReader::readRecord( Record &r )
+{
+	r.offset = file.pos();
+	lasterror.clear();
+	torn = false;
+	QByteArray h = file.read( SiJournal::RecordHeaderSize );
+	if ( h.isEmpty() )
+		return false;
+	if ( h.length() != SiJournal::RecordHeaderSize ) {
+		lasterror = "Truncated record";
+		torn = true;
+		return false;
+	}
+	const uchar *hd = (const uchar *)h.constData();
+	quint32 blen = qFromLittleEndian<quint32>( hd );
+	quint32 c = qFromLittleEndian<quint32>( hd+4 );
+	if ( blen < SiJournal::BodyHeaderSize || blen > 1024*1024 ) {
+		lasterror = "Bad record length";
+		torn = zerosToEnd( r.offset );
+		return false;
+	}
+	QByteArray body = file.read( blen );
+	if ( (quint32)body.length() != blen ) {
+		lasterror = "Truncated record";
+		torn = true;
+		return false;
+	}
+	if ( crc32( body.constData(), blen ) != c ) {
+		lasterror = "Checksum error";
+		torn = file.atEnd() || zerosToEnd( r.offset );
+		return false;
+	}
+	const uchar *b = (const uchar *)body.constData();
+	r.sequence = qFromLittleEndian<quint32>( b );
+	r.type = (SiJournal::RecordType)b[4];
+	r.station = qFromLittleEndian<quint16>( b+6 );
+	r.wallmsecs = qFromLittleEndian<qint64>( b+8 );
+	r.data = body.mid( SiJournal::BodyHeaderSize );
+	goodpos = file.pos();
+	return true;
+}
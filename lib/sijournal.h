@@ -0,0 +1,147 @@
+#ifndef SIJOURNAL_H
+#define SIJOURNAL_H
+
+#include <QThread>
+#include <QFile>
+#include <QMutex>
+#include <QWaitCondition>
+
+#include "siproto.h"
+
+// Append only log of everything read, so a crash loses no readouts.
+//
+// Records are written to the file at once, which is enough to survive the
+// program crashing. A background thread makes them durable with fdatasync,
+// committing as a group at most syncInterval ms after the first unsynced
+// record or when maxUnsynced records are waiting, instead of once a card.
+//
+// File format, all numbers little endian:
+//   header: "SIJRNL01", qint64 wall clock msecs when the file was created
+//   record: quint32 body length, quint32 CRC-32 of the body, body
+//   body:   quint32 sequence, quint8 type, quint8 reserved,
+//           quint16 station, qint64 wall clock msecs, data
+// Card data is SiCard::getRawData(), punches are stored as 16 bytes:
+//   quint32 card, quint16 cn, qint32 msecs, quint8 day of week,
+//   quint8 week counter, qint32 memory address
+// A torn record at the end is cut off when the journal is opened again.
+// A journal damaged before its end is left as it is under the name
+// file.damaged-<date and time> and a new one is started.
+
+class SiJournal : public QThread
+{
+	Q_OBJECT
+
+	public:
+		enum RecordType {
+			Card = 0,
+			BackupCard = 1,
+			Punch = 2
+		};
+		enum {
+			HeaderSize = 16,
+			RecordHeaderSize = 8,
+			BodyHeaderSize = 16
+		};
+
+		SiJournal( QObject *parent = 0 );
+		~SiJournal();
+
+		// Opens or creates file. Records already there are kept and can be
+		// read with SiJournalReader before or after.
+		bool open( const QString &file );
+		void close();
+		bool isOpen() const { return file.isOpen(); }
+		QString fileName() const { return file.fileName(); }
+		QString lasterror;
+
+		// Moves the file to file.old-<date and time> and starts an empty
+		// one. Journals moved away before are kept.
+		bool startNew();
+
+		void setSyncInterval( int msecs ) { syncinterval = msecs; }
+		void setMaxUnsynced( int records ) { maxunsynced = records; }
+
+		// Sequence number of the record, 0 when it could not be written.
+		// Only to be called from one thread.
+		quint32 append( RecordType type, const QByteArray &data, int station = 0 );
+		// Waits until record seq is on disk
+		bool waitForDurable( quint32 seq, int msecs );
+		quint32 lastDurable() const;
+
+		// Journals every card read by si
+		void attach( SiProto *si, int station = 0 );
+
+		static QByteArray fileHeader();
+		static QByteArray punchData( const SiPunch &p );
+
+	public slots:
+		void appendCard( const SiCard &card );
+		void appendBackupCard( const SiCard &card );
+		void appendPunch( const SiPunch &p );
+
+	protected:
+		void run();
+
+	private:
+		bool syncFile();
+
+		QFile file;
+		quint32 sequence;
+		int syncinterval;
+		int maxunsynced;
+
+		mutable QMutex lock;
+		QWaitCondition wakeup;
+		QWaitCondition durable;
+		bool stopping;
+		bool syncnow;
+		int unsynced;
+		qint64 firstunsynced;
+		quint32 written;
+		quint32 synced;
+		QMap<QObject *, int> stations;
+};
+
+// Reads journals written by SiJournal
+class SiJournalReader
+{
+	public:
+		struct Record {
+			quint32 sequence;
+			SiJournal::RecordType type;
+			int station;
+			qint64 wallmsecs;
+			QByteArray data;
+			qint64 offset;	// of the record in the file
+
+			SiCard card() const;
+			SiPunch punch() const;
+		};
+
+		SiJournalReader();
+
+		bool open( const QString &file );
+		void close();
+		// false at the end or at a damaged record
+		bool readRecord( Record &r );
+		// Continues reading at the record starting at offset
+		bool seek( qint64 offset );
+		// File offset after the last good record
+		qint64 pos() const { return goodpos; }
+		// Wall clock msecs from the file header
+		qint64 created() const { return createdmsecs; }
+		// The last readRecord() stopped at a record the end of the file
+		// cut off, as a crash while appending leaves it
+		bool tornTail() const { return torn; }
+		QString lasterror;
+
+	private:
+		bool zerosToEnd( qint64 from );
+
+		QFile file;
+		qint64 goodpos;
+		qint64 createdmsecs;
+		bool torn;
+};
+
+#endif
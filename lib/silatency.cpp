@@ -0,0 +1,166 @@
+#include "silatency.h"
+
+#include <QElapsedTimer>
+#include <QStringList>
+
+#include <string.h>
+
+namespace {
+
+QElapsedTimer startedClock()
+{
+	QElapsedTimer t;
+	t.start();
+	return t;
+}
+
+}
+
+qint64 siMonotonicNsecs()
+{
+	// Started by the static initializer, which runs once even when many
+	// threads get here first at the same time
+	static const QElapsedTimer clock = startedClock();
+	return clock.nsecsElapsed();
+}
+
+SiLatencyHistogram::SiLatencyHistogram()
+{
+	reset();
+}
+
+void SiLatencyHistogram::reset()
+{
+	memset( buckets, 0, sizeof( buckets ) );
+	total = 0;
+	sum = 0;
+	minvalue = 0;
+	maxvalue = 0;
+}
+
+int SiLatencyHistogram::bucketOf( qint64 v )
+{
+	if ( v < (1<<MinShift) )
+		return v>>(MinShift-SubBucketBits);
+	int msb = MinShift;
+	while( msb < 62 && (v>>(msb+1)) )
+		msb++;
+	int row = msb-MinShift+1;
+	return row*SubBuckets + ((v>>(msb-SubBucketBits))&(SubBuckets-1));
+}
+
+qint64 SiLatencyHistogram::bucketLimit( int b )
+{
+	int row = b/SubBuckets;
+	int sub = b%SubBuckets;
+	if ( !row )
+		return (((qint64)sub+1)<<(MinShift-SubBucketBits))-1;
+	int msb = row+MinShift-1;
+	return (((qint64)SubBuckets+sub+1)<<(msb-SubBucketBits))-1;
+}
+
+void SiLatencyHistogram::record( qint64 nsecs )
+{
+	if ( nsecs < 0 )
+		nsecs = 0;
+	buckets[bucketOf( nsecs )]++;
+	if ( !total || nsecs < minvalue )
+		minvalue = nsecs;
+	if ( nsecs > maxvalue )
+		maxvalue = nsecs;
+	total++;
+	sum += nsecs;
+}
+
+qint64 SiLatencyHistogram::percentile( double p ) const
+{
+	if ( !total )
+		return 0;
+	qint64 wanted = (qint64)( p/100.0*total+0.5 );
+	if ( wanted < 1 )
+		wanted = 1;
+	qint64 seen = 0;
+	for( int i=0;i<BucketCount;i++ ) {
+		seen += buckets[i];
+		if ( seen >= wanted )
+			return qMin( bucketLimit( i ), maxvalue );
+	}
+	return maxvalue;
+}
+
+// Times in microseconds
+QString SiLatencyHistogram::toString() const
+{
+	return QString( "n=%1 min=%2 p50=%3 p90=%4 p99=%5 max=%6 mean=%7" )
+		.arg( total )
+		.arg( min()/1000 )
+		.arg( percentile( 50 )/1000 )
+		.arg( percentile( 90 )/1000 )
+		.arg( percentile( 99 )/1000 )
+		.arg( max()/1000 )
+		.arg( mean()/1000 );
+}
+
+SiLatency::SiLatency() :
+	readoutstart( -1 ), readoutcount( 0 )
+{
+}
+
+void SiLatency::start( qint64 firstbyte )
+{
+	readoutstart = firstbyte;
+}
+
+void SiLatency::mark( Stage s, qint64 when )
+{
+	if ( readoutstart < 0 )
+		return;
+	if ( when < 0 )
+		when = siMonotonicNsecs();
+	stages[s].record( when-readoutstart );
+}
+
+void SiLatency::finish()
+{
+	if ( readoutstart < 0 )
+		return;
+	mark( Emitted );
+	readoutstart = -1;
+	readoutcount++;
+}
+
+void SiLatency::reset()
+{
+	for( int i=0;i<StageCount;i++ )
+		stages[i].reset();
+	readoutstart = -1;
+	readoutcount = 0;
+}
+
+QString SiLatency::stageName( Stage s )
+{
+	switch( s ) {
+		case FrameComplete:
+			return "frame";
+		case Detected:
+			return "detect";
+		case BlockReceived:
+			return "block";
+		case Decoded:
+			return "decode";
+		case Emitted:
+			return "emit";
+		default:
+			break;
+	}
+	return QString::null;
+}
+
+QString SiLatency::dump() const
+{
+	QStringList lines;
+	lines << QString( "Card readout latency since first byte (us), %1 readouts" ).arg( readoutcount );
+	for( int i=0;i<StageCount;i++ )
+		lines << QString( "%1: %2" ).arg( stageName( (Stage)i ), -7 ).arg( stages[i].toString() );
+	return lines.join( "\n" );
+}
@@ -0,0 +1,85 @@
+#ifndef SILATENCY_H
+#define SILATENCY_H
+
+#include <QString>
+#include <QtGlobal>
+
+// Monotonic clock in nanoseconds shared by the serial port and the protocol
+// so their timestamps can be compared.
+qint64 siMonotonicNsecs();
+
+// Latency histogram with log-linear buckets: every power of two is split
+// into SubBuckets equal buckets, so each value is kept with about 3%
+// precision from 1 us up to hours with a fixed amount of memory.
+class SiLatencyHistogram
+{
+	public:
+		SiLatencyHistogram();
+
+		void record( qint64 nsecs );
+		void reset();
+
+		qint64 count() const { return total; }
+		qint64 min() const { return total ? minvalue : 0; }
+		qint64 max() const { return maxvalue; }
+		qint64 mean() const { return total ? sum/total : 0; }
+		// Upper bound of the bucket holding the given percentile (0-100)
+		qint64 percentile( double p ) const;
+
+		QString toString() const;
+
+	private:
+		enum {
+			// Values below 2^MinShift ns share the first bucket row
+			MinShift = 10,
+			SubBucketBits = 5,
+			SubBuckets = 1<<SubBucketBits,
+			Rows = 64-MinShift,
+			BucketCount = Rows*SubBuckets
+		};
+		static int bucketOf( qint64 v );
+		static qint64 bucketLimit( int b );
+
+		quint32 buckets[BucketCount];
+		qint64 total;
+		qint64 sum;
+		qint64 minvalue;
+		qint64 maxvalue;
+};
+
+// Card readout timeline. A readout starts with the first byte of the card
+// detected frame, every later stage is recorded as time since that byte.
+class SiLatency
+{
+	public:
+		enum Stage {
+			FrameComplete,	// detect frame parsed in readCommand
+			Detected,	// detect command handled, read request sent
+			BlockReceived,	// every card block reply
+			Decoded,	// card data decoded
+			Emitted,	// cardRead emitted
+			StageCount
+		};
+
+		SiLatency();
+
+		void start( qint64 firstbyte );
+		void mark( Stage s, qint64 when = -1 );
+		// Records Emitted and ends the readout.
+		void finish();
+		bool isActive() const { return readoutstart >= 0; }
+
+		const SiLatencyHistogram &histogram( Stage s ) const { return stages[s]; }
+		qint64 readouts() const { return readoutcount; }
+		void reset();
+
+		static QString stageName( Stage s );
+		QString dump() const;
+
+	private:
+		SiLatencyHistogram stages[StageCount];
+		qint64 readoutstart;
+		qint64 readoutcount;
+};
+
+#endif // SILATENCY_H
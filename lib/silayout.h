@@ -0,0 +1,190 @@
+#ifndef SILAYOUT_H
+#define SILAYOUT_H
+
+#include <QString>
+
+// Memory layouts of the SPORTident card families.
+//
+// Every field is described at compile time by its offset and width. The
+// decoders check the length of the card data once and then read the fields
+// through these descriptors, which the compiler turns into plain loads from
+// the data pointer. All multi byte values on the cards are big endian.
+
+template<int Offset, int Width = 1, bool BigEndian = true>
+struct SiField {
+	enum {
+		offset = Offset,
+		width = Width,
+		end = Offset+Width
+	};
+	static inline unsigned int get( const unsigned char *d ) {
+		unsigned int v = 0;
+		for( int i=0;i<Width;i++ )
+			v |= ((unsigned int)d[Offset+i]) << ( BigEndian ? (Width-1-i)*8 : i*8 );
+		return v;
+	}
+	static inline bool isEmpty( const unsigned char *d, unsigned char fill = 0xEE ) {
+		for( int i=0;i<Width;i++ )
+			if ( d[Offset+i] != fill )
+				return false;
+		return true;
+	}
+};
+
+// Zero or space padded text field.
+template<int Offset, int Width>
+struct SiText {
+	enum {
+		offset = Offset,
+		width = Width,
+		end = Offset+Width
+	};
+	static inline QString get( const unsigned char *d ) {
+		int len = 0;
+		while( len < Width && d[Offset+len] )
+			len++;
+		return QString::fromUtf8( (const char *)d+Offset, len ).trimmed();
+	}
+};
+
+// SI-Card 5: one 128 byte block.
+struct SiCard5Layout {
+	enum {
+		Size = 128,
+		// 30 punches with time, 3 bytes each. Every 16 byte row starts
+		// with one byte holding the control number of punch 31-36 which
+		// has no time.
+		PunchStart = 0x21,
+		PunchRecordSize = 3,
+		PunchesPerRow = 5,
+		RowSize = 16,
+		ExtraPunchStart = 0x20,
+		MaxTimedPunches = 30,
+		MaxPunches = 36
+	};
+	typedef SiField<0x01> CountryCode;
+	typedef SiField<0x02,2> ClubCode;
+	typedef SiField<0x04,2> CardNumber;
+	typedef SiField<0x06> CardSeries;
+	typedef SiField<0x11,2> StartNumber;
+	typedef SiField<0x13,2> StartTime;
+	typedef SiField<0x15,2> FinishTime;
+	typedef SiField<0x17> PunchCounter;
+	typedef SiField<0x19,2> CheckTime;
+	typedef SiField<0x1B> SoftwareVersion;
+	typedef SiField<0x1C> StartNumberSeries;
+	typedef SiField<0x1D> Checksum;
+	// Bytes 30 and 31 are 0x00 0x07 on every card 5.
+	typedef SiField<0x1E,2> Signature;
+
+	static inline int punchOffset( int i ) {
+		return PunchStart+(i/PunchesPerRow)+(i*PunchRecordSize);
+	}
+	static inline int extraPunchOffset( int i ) {
+		return ExtraPunchStart+(i-MaxTimedPunches)*RowSize;
+	}
+};
+
+// SI-Card 6: 128 byte blocks. Block 0 and 1 hold the card and owner data,
+// blocks 6, 7 and 2-5 hold 32 punches each as 4 byte punching records.
+struct SiCard6Layout {
+	enum {
+		BlockSize = 128,
+		PunchRecordSize = 4,
+		PunchesPerBlock = 32,
+		MaxPunches = 192
+	};
+	// Block 0
+	typedef SiField<0x04,4> Signature; // 0xEDEDEDED
+	typedef SiField<0x0A> CN3;
+	typedef SiField<0x0B> CN2;
+	typedef SiField<0x0C> CN1;
+	typedef SiField<0x0D> CN0;
+	typedef SiField<0x10,2> LastControl;
+	typedef SiField<0x12> PunchCounter;
+	enum {
+		FinishRecord = 0x14,
+		StartRecord = 0x18,
+		CheckRecord = 0x1C,
+		ClearRecord = 0x20
+	};
+	typedef SiField<0x28,4> StartNumber;
+	typedef SiText<0x2C,4> Class;
+	typedef SiText<0x30,20> LastName;
+	typedef SiText<0x44,20> FirstName;
+	typedef SiText<0x58,4> Country;
+	typedef SiText<0x5C,36> Club;
+	// Block 1
+	typedef SiText<0x00,16> UserId;
+	typedef SiText<0x10,16> Phone;
+	typedef SiText<0x20,36> Email;
+	typedef SiText<0x44,20> Street;
+	typedef SiText<0x58,16> City;
+	typedef SiText<0x68,8> Zip;
+	typedef SiField<0x73> Sex;
+	typedef SiText<0x74,8> DayOfBirth;
+	typedef SiField<0x7C,4> DateOfProduction;
+
+	// Index of the first punch stored in block bn, -1 for the data blocks.
+	static inline int firstPunchOfBlock( int bn ) {
+		if ( bn > 5 )
+			return (bn-6)*PunchesPerBlock;
+		if ( bn > 1 )
+			return bn*PunchesPerBlock;
+		return -1;
+	}
+};
+
+// SI-Card 8, 9, 10, 11, SIAC, pCard and tCard: memory is read in 128 byte
+// blocks and addressed in 4 byte pages. Punches are 4 byte punching records
+// from a series dependent page on. 8/9/p/t hold the punches in blocks 0-1,
+// 10/11/SIAC in blocks 4-7.
+struct SiCard89ptLayout {
+	enum {
+		BlockSize = 128,
+		PageSize = 4,
+		PagesPerBlock = 32,
+		ClearCheckPage = 2,
+		StartPage = 3,
+		FinishPage = 4,
+		UserDataPage = 8,
+		// Block number requesting all blocks of the card with one command
+		ReadAllBlocks = 0x08
+	};
+	typedef SiField<0x04,4> Signature; // 0xEAEAEAEA
+	typedef SiField<20,2> LastControl;
+	typedef SiField<22> PunchCounter;
+	typedef SiField<24> SI3;
+	typedef SiField<25> SI2;
+	typedef SiField<26> SI1;
+	typedef SiField<27> SI0;
+	typedef SiField<28> ValidMonth;
+	typedef SiField<29> ValidYear;
+
+	// Per card series (SI3 of the card number) punch geometry. blockmask
+	// has a bit set for every block the station sends when all blocks are
+	// requested.
+	struct Geometry {
+		int series;
+		int firstpunchpage;
+		int maxpunches;
+		int userdatalength;
+		int blockmask;
+	};
+	static inline const Geometry *geometry( int series ) {
+		static const Geometry g[] = {
+			{ 0x1, 14, 50, 24, 0x03 },  // Card 9
+			{ 0x2, 34, 30, 24, 0x03 },  // Card 8
+			{ 0x4, 44, 20, 128, 0x03 }, // pCard
+			{ 0x6, 14, 50, 24, 0x03 },  // tCard
+			{ 0xF, 128, 128, 0, 0xF1 }, // Card 10, 11 and SIAC
+			{ 0x0, 0, 0, 0, 0 }
+		};
+		for( int i=0;g[i].series;i++ )
+			if ( g[i].series == series )
+				return &g[i];
+		return NULL;
+	}
+};
+
+#endif // SILAYOUT_H
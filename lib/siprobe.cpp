@@ -0,0 +1,226 @@
+#include "siprobe.h"
+
+#include <QAtomicInt>
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QThread>
+
+#include <string.h>
+#include <unistd.h>
+
+#if ( defined( __linux__ ) | defined( __APPLE__ ) )
+#include <fcntl.h>
+#include <termios.h>
+#include <sys/select.h>
+#endif
+
+extern "C" unsigned int crc( unsigned int uiCount, unsigned char *pucDat );
+
+namespace {
+
+enum {
+	STX = 0x02,
+	ETX = 0x03,
+	DLE = 0x10,
+	CommandSetMSMode = 0xF0,
+	BaseCommandSetMSMode = 0x70,
+	DirectCommunication = 0x4D,
+	// Longest wait for one answer, a station replies within a few ms
+	AttemptTimeout = 1000,
+	PollInterval = 50
+};
+
+struct Attempt {
+	int speed;
+	bool extended;
+};
+
+const Attempt attempts[] = {
+	{ 38400, true },
+	{ 4800, true },
+	{ 4800, false }
+};
+
+QByteArray setMSModeFrame( bool extended )
+{
+	QByteArray ba;
+	ba.append( (char)0xFF );
+	ba.append( STX );
+	if ( extended ) {
+		ba.append( CommandSetMSMode );
+		ba.append( 1 );
+		ba.append( DirectCommunication );
+		unsigned int c = crc( 3, (unsigned char *)ba.data()+2 );
+		ba.append( (c>>8)&0xFF );
+		ba.append( c&0xFF );
+	} else {
+		ba.append( BaseCommandSetMSMode );
+		ba.append( DirectCommunication );
+	}
+	ba.append( ETX );
+	return ba;
+}
+
+// Station code of a SetMSMode reply in buf, -1 while there is none
+int parseReply( const QByteArray &buf, bool extended )
+{
+	for( int i=0;i<buf.length();i++ ) {
+		if ( buf.at(i) != STX )
+			continue;
+		QByteArray f = buf.mid( i );
+		if ( extended ) {
+			// STX F0 03 CN1 CN0 4D CRC1 CRC0 ETX
+			if ( f.length() < 9 || (unsigned char)f.at(1) != CommandSetMSMode || f.at(2) != 3 || f.at(8) != ETX )
+				continue;
+			unsigned int c = ((unsigned char)f.at(6)<<8)|(unsigned char)f.at(7);
+			if ( c != crc( 5, (unsigned char *)f.data()+1 ) )
+				continue;
+			return ((unsigned char)f.at(3)<<8)|(unsigned char)f.at(4);
+		}
+		// STX 70 [DLE] CN 4D ETX
+		if ( f.length() < 5 || f.at(1) != BaseCommandSetMSMode )
+			continue;
+		int p = 2;
+		if ( f.at(p) == DLE )
+			p++;
+		if ( f.length() < p+3 || (unsigned char)f.at(p+1) != DirectCommunication || f.at(p+2) != ETX )
+			continue;
+		return (unsigned char)f.at(p);
+	}
+	return -1;
+}
+
+#if ( defined( __linux__ ) | defined( __APPLE__ ) )
+speed_t baudConstant( int speed )
+{
+	return speed == 38400 ? B38400 : B4800;
+}
+
+int tryAttempt( const QString &device, const Attempt &a, const QElapsedTimer &t, int deadline, QAtomicInt *stop )
+{
+	int fd = ::open( device.toLocal8Bit(), O_RDWR|O_NOCTTY|O_NONBLOCK );
+	if ( fd == -1 )
+		return -2;
+	struct termios tio;
+	memset( &tio, 0, sizeof( tio ) );
+	cfsetispeed( &tio, baudConstant( a.speed ) );
+	cfsetospeed( &tio, baudConstant( a.speed ) );
+	tio.c_cflag |= CS8|CLOCAL|CREAD;
+	tio.c_iflag = IGNBRK|IGNPAR;
+	tcflush( fd, TCIOFLUSH );
+	tcsetattr( fd, TCSANOW, &tio );
+
+	QByteArray frame = setMSModeFrame( a.extended );
+	int code = -1;
+	if ( ::write( fd, frame.constData(), frame.length() ) == frame.length() ) {
+		QByteArray buf;
+		qint64 end = qMin( t.elapsed()+AttemptTimeout, (qint64)deadline );
+		while( code < 0 && t.elapsed() < end && !( stop && stop->fetchAndAddAcquire( 0 ) ) ) {
+			fd_set rset;
+			FD_ZERO( &rset );
+			FD_SET( fd, &rset );
+			struct timeval tv;
+			tv.tv_sec = 0;
+			tv.tv_usec = PollInterval*1000;
+			if ( select( fd+1, &rset, NULL, NULL, &tv ) <= 0 )
+				continue;
+			char b[256];
+			ssize_t len = ::read( fd, b, sizeof( b ) );
+			if ( len > 0 ) {
+				buf.append( b, len );
+				code = parseReply( buf, a.extended );
+			}
+		}
+	}
+	::close( fd );
+	return code;
+}
+#endif
+
+bool probeOne( const QString &device, int deadline, SiProbeResult *result, QAtomicInt *stop )
+{
+#if ( defined( __linux__ ) | defined( __APPLE__ ) )
+	QElapsedTimer t;
+	t.start();
+	for( unsigned int i=0;i<sizeof( attempts )/sizeof( attempts[0] );i++ ) {
+		if ( t.elapsed() >= deadline || ( stop && stop->fetchAndAddAcquire( 0 ) ) )
+			break;
+		int code = tryAttempt( device, attempts[i], t, deadline, stop );
+		if ( code == -2 )
+			break; // can not open, no use trying other speeds
+		if ( code >= 0 ) {
+			result->device = device;
+			result->speed = attempts[i].speed;
+			result->extended = attempts[i].extended;
+			result->stationcode = code;
+			return true;
+		}
+	}
+#else
+	Q_UNUSED( device );
+	Q_UNUSED( deadline );
+	Q_UNUSED( result );
+	Q_UNUSED( stop );
+#endif
+	return false;
+}
+
+class ProbeThread : public QThread
+{
+	public:
+		ProbeThread( const QString &d, int dl, QAtomicInt *s ) :
+			device( d ), deadline( dl ), stop( s ), found( false )
+			{}
+		void run() {
+			found = probeOne( device, deadline, &result, stop );
+		}
+		QString device;
+		int deadline;
+		QAtomicInt *stop;
+		bool found;
+		SiProbeResult result;
+};
+
+}
+
+bool SiProbe::probeDevice( const QString &device, int deadline, SiProbeResult *result )
+{
+	return probeOne( device, deadline, result, NULL );
+}
+
+QList<SiProbeResult> SiProbe::probe( const QStringList &devices, int deadline, Mode mode )
+{
+	QAtomicInt stop( 0 );
+	QList<ProbeThread *> threads;
+	for( int i=0;i<devices.count();i++ ) {
+		threads.append( new ProbeThread( devices.at(i), deadline, &stop ) );
+		threads.last()->start();
+	}
+	QElapsedTimer t;
+	t.start();
+	bool done = false;
+	while( !done && t.elapsed() < deadline ) {
+		done = true;
+		for( int i=0;i<threads.count();i++ ) {
+			if ( !threads.at(i)->isFinished() )
+				done = false;
+			else if ( mode == FirstFound && threads.at(i)->found ) {
+				done = true;
+				break;
+			}
+		}
+		if ( !done ) {
+			QCoreApplication::processEvents();
+			usleep( 5000 );
+		}
+	}
+	stop.fetchAndStoreRelease( 1 );
+	QList<SiProbeResult> found;
+	for( int i=0;i<threads.count();i++ ) {
+		threads.at(i)->wait();
+		if ( threads.at(i)->found && ( mode == AllFound || found.isEmpty() ) )
+			found.append( threads.at(i)->result );
+		delete threads.at(i);
+	}
+	return found;
+}
@@ -0,0 +1,40 @@
+#ifndef SIPROBE_H
+#define SIPROBE_H
+
+#include <QList>
+#include <QString>
+#include <QStringList>
+
+class SiProbeResult {
+	public:
+		SiProbeResult() :
+			speed( 0 ), extended( false ), stationcode( -1 )
+			{}
+		QString device;
+		int speed;
+		bool extended;
+		int stationcode;
+};
+
+// Looks for stations on several serial devices at once. Every device is
+// probed in its own thread by sending SetMSMode(DirectCommunication) at
+// 38400 and 4800 baud with the extended protocol and at 4800 with the base
+// protocol. Devices do not wait for each other, so a search takes about as
+// long as the slowest single device instead of the sum of all of them.
+class SiProbe
+{
+	public:
+		enum Mode {
+			FirstFound,	// return as soon as one station answered
+			AllFound	// wait for all devices or the deadline
+		};
+
+		// Stations found before deadline ms passed, in device list order
+		// for AllFound. Keeps the event loop running while waiting.
+		static QList<SiProbeResult> probe( const QStringList &devices, int deadline = 3000, Mode mode = FirstFound );
+
+		// Probes a single device in the calling thread
+		static bool probeDevice( const QString &device, int deadline, SiProbeResult *result );
+};
+
+#endif
@@ -1,6 +1,8 @@
 
 #include "siproto_p.h"
 #include "siproto.h"
+#include "sidevicemonitor.h"
+#include "silayout.h"
 
 #include <QDir>
 #include <QTimer>
@@ -12,7 +14,6 @@
 #include "crc529.c"
 #include <unistd.h>
 
-QMap<int, int> SiProto::baseCommands;
 int SiProto::timeoutforcommands = 2000; // In milliseconds
 
 CommandReceiver::CommandReceiver(SiProto *si, unsigned char cmnd, QObject *parent) :
@@ -20,7 +21,10 @@ CommandReceiver::CommandReceiver(SiProto *si, unsigned char cmnd, QObject *paren
 		command( cmnd ),
 		extendedCommand( false ),
 		haveit( false ),
-		havenak( false )
+		havenak( false ),
+		address( -1 ),
+		length( 0 ),
+		proto( si )
 {
 	connect( si, SIGNAL(gotCommand(unsigned char,QByteArray,int)), SLOT(gotCommand(unsigned char,QByteArray,int)) );
 	connect( si, SIGNAL(gotNAK()), SLOT(gotNAK()) );
@@ -28,7 +32,9 @@ CommandReceiver::CommandReceiver(SiProto *si, unsigned char cmnd, QObject *paren
 
 void CommandReceiver::gotCommand(unsigned char cmnd, const QByteArray &d, int cnum)
 {
-	if ( cmnd != command && cmnd != SiProto::baseCommands[command] )
+	if ( cmnd != command && cmnd != SiProto::baseCommand( command ) )
+		return;
+	if ( address >= 0 && ( d.isEmpty() || (unsigned char)d.at(0) != address || d.length()-1 < length ) )
 		return;
 	data = d;
 	cn = cnum;
@@ -41,13 +47,22 @@ void CommandReceiver::gotNAK()
 	havenak = true;
 }
 
+void CommandReceiver::expectSystemValue( unsigned char addr, unsigned char len )
+{
+	address = addr;
+	length = len;
+}
+
 bool CommandReceiver::waitForCommand( int timeoutms)
 {
 	QTime t;
 	t.start();
+	// No cache refresh is started from the events processed here
+	proto->waitingcommands++;
 	while( !havenak && !haveit && (timeoutms && t.elapsed() < timeoutms) ) {
 		qApp->processEvents();
 	}
+	proto->waitingcommands--;
 	return haveit;
 }
 
@@ -111,6 +126,42 @@ QString PunchBackupData::dumpstr( void ) const
 	return s;
 }
 
+SiCardData::SiCardData() :
+	cardtype(SiCard::UnknownCard),
+	countrycode(0),
+	clubcode(0),
+	cardnum(0),
+	intcardnum(0),
+	startnum(0),
+	punchingcounter(0),
+	blocksread(0),
+	valid(false),
+	softwareversion(0),
+	checksum(0),
+	sex(0)
+{
+}
+
+SiCard::SiCard() :
+	d(new SiCardData)
+{
+}
+
+SiCard::SiCard( const SiCard &other ) :
+	d(other.d)
+{
+}
+
+SiCard::~SiCard()
+{
+}
+
+SiCard &SiCard::operator=( const SiCard &other )
+{
+	d = other.d;
+	return *this;
+}
+
 QDateTime SiCard::closestVariant( const QDateTime &from, const QTime &t )
 {
 	QDateTime dt = from;
@@ -147,83 +198,124 @@ void SiCard::print( void ) const
 
 QDateTime SiCard::getFullStartTime() const
 {
-	return fullstarttime;
+	return d->fullstarttime;
 }
 
 QDateTime SiCard::getFullFinishTime() const
 {
-	return fullfinishtime;
+	return d->fullfinishtime;
 }
 
 QDateTime SiCard::getFullCheckTime() const
 {
-	return fullchecktime;
+	return d->fullchecktime;
 }
 
 const QList<PunchingRecord> &SiCard::getPunches() const
 {
-	return punches;
+	return d->punches;
 }
 
 void SiCard::calcFullTimes( void )
 {
-	fullchecktime = fullstarttime = fullfinishtime = QDateTime();
-	QDateTime prevtime = inittime;
-	if ( checktime.time.isValid() )
-		prevtime = fullchecktime = closestVariant( prevtime, starttime.time );
-	if ( starttime.time.isValid() )
-		prevtime = fullstarttime = closestVariant( prevtime, starttime.time );
-	for( int i=0;i<punchingcounter && i<punches.count();i++ ) {
-		prevtime = punches[i].fulltime = closestVariant( prevtime, punches[i].time);
+	d->fullchecktime = d->fullstarttime = d->fullfinishtime = QDateTime();
+	QDateTime prevtime = d->inittime;
+	if ( d->checktime.time.isValid() )
+		prevtime = d->fullchecktime = closestVariant( prevtime, d->starttime.time );
+	if ( d->starttime.time.isValid() )
+		prevtime = d->fullstarttime = closestVariant( prevtime, d->starttime.time );
+	for( int i=0;i<d->punchingcounter && i<d->punches.count();i++ ) {
+		prevtime = d->punches[i].fulltime = closestVariant( prevtime, d->punches[i].time);
 	}
-	if ( finishtime.time.isValid() )
-		fullfinishtime = closestVariant(prevtime, finishtime.time);
+	if ( d->finishtime.time.isValid() )
+		d->fullfinishtime = closestVariant(prevtime, d->finishtime.time);
 }
 
 void SiCard::setEventStartTime( const QDateTime &dt )
 {
-	inittime = dt;
+	d->inittime = dt;
 	calcFullTimes();
 }
 
+SiCard::CardType SiCard::getCardType() const
+{
+	return d->cardtype;
+}
+
+bool SiCard::isValid() const
+{
+	return d->valid;
+}
+
 int SiCard::getCardNumber() const
 {
-	return cardnum;
+	return d->cardnum;
+}
+
+QString SiCard::getFirstName() const
+{
+	return d->firstname;
+}
+
+QString SiCard::getLastName() const
+{
+	return d->lastname;
+}
+
+QString SiCard::getClub() const
+{
+	return d->club;
+}
+
+QString SiCard::getCountry() const
+{
+	return d->country;
+}
+
+QString SiCard::getClass() const
+{
+	return d->contclass;
 }
 
 QByteArray SiCard::getRawData() const
 {
-	return rawData;
+	return d->rawData;
 }
 
 QString SiCard::dumpstr( void ) const
 {
-	if ( !valid ) {
+	if ( !d->valid ) {
 		return "Invalid card";
 	}
 	QString s;
-	s += QString( "Card number: %0\n").arg(cardnum);
-	if ( !starttime.time.isNull() )
-		s += QString("Start: %0\n").arg( starttime.time.toString() );
+	switch ( d->cardtype ) {
+		case Card5:
+			s = dumpCard5(); break;
+		case Card6:
+			s = dumpCard6(); break;
+		case Card8: case Card9: case pCard: case tCard:
+		case Card10: case Card11: case SIAC:
+			s = dumpCard89pt(); break;
+		default:
+			break;
+	}
+	s += QString( "Card number: %0\n").arg(d->cardnum);
+	if ( !d->starttime.time.isNull() )
+		s += QString("Start: %0\n").arg( d->starttime.time.toString() );
 	QString tmp;
-	tmp.sprintf( "Country code: 0x%02X, %i\n", countrycode, countrycode );
+	tmp.sprintf( "Country code: 0x%02X, %i\n", d->countrycode, d->countrycode );
 	s += tmp;
-	tmp.sprintf( "Club code: 0x%02X, %i\n", clubcode, clubcode );
+	tmp.sprintf( "Club code: 0x%02X, %i\n", d->clubcode, d->clubcode );
 	s += tmp;
-	s += QString("Start number: %0\n").arg(startnum);
-	s += QString("Punching counter: %0\n").arg(punchingcounter);
-	if (!name.isEmpty())
-	s += QString("Name: %0\n").arg(name);
-	for( int i=0;i<punches.count();i++ )
-		s += QString( "P %0: CN: %1, %2, %3\n").arg(i).arg(punches.at(i).cn).arg( punches.at(i).getTime().toString()).arg(punches.at(i).pm);
+	s += QString("Start number: %0\n").arg(d->startnum);
+	s += QString("Punching counter: %0\n").arg(d->punchingcounter);
+	if (!d->name.isEmpty())
+	s += QString("Name: %0\n").arg(d->name);
+	for( int i=0;i<d->punches.count();i++ )
+		s += QString( "P %0: CN: %1, %2, %3\n").arg(i).arg(d->punches.at(i).cn).arg( d->punches.at(i).getTime().toString()).arg(d->punches.at(i).pm);
 	return s;
 }
 
-int SiCard::word2int(const unsigned char *d)
-{
-	return ((d[0]<<24)|(d[1]<<16)|(d[2]<<8)|d[3]);
-}
-
 QTime SiCard::siTime( unsigned char s2, unsigned char s1 )
 {
 	if ( s2 == 0xEE && s1 == 0xEE )
@@ -233,82 +325,177 @@ QTime SiCard::siTime( unsigned char s2, unsigned char s1 )
 
 SiCard89pt::SiCard89pt( const QByteArray &data )
 {
-	if ( data.length() < 256 ) {
+	typedef SiCard89ptLayout L;
+	if ( data.length() < 2*L::BlockSize ) {
 		qWarning("SiCard89 needs 256 bytes. Got only : %i", data.length() );
 	}
-	addBlock( 0, data.mid(0,128) );
-	addBlock( 1, data.mid(128,128) );
+	addBlock( 0, data.mid(0,L::BlockSize) );
+	int blocks = data.length()/L::BlockSize;
+	for( int i=1;i<blocks;i++ ) {
+		// Either the full card memory or only the blocks read
+		int bn = ( blocks >= 8 ? i : nextBlock() );
+		if ( bn < 0 )
+			break;
+		addBlock( bn, data.mid(i*L::BlockSize,L::BlockSize) );
+	}
+}
 
-QString SiCard89pt::dumpstr( void ) const
+QString SiCard::dumpCard89pt( void ) const
 {
 	QString s;
-	switch ( si3 & 0xF ) {
-		case 1:
+	switch ( d->cardtype ) {
+		case Card9:
 			s = "SPORTident-Card 9\n"; break;
-		case 2:
+		case Card8:
 			s = "SPORTident-Card 8\n"; break;
-		case 4:
+		case pCard:
 			s = "SPORTident pCard\n"; break;
-		case 6:
+		case tCard:
 			s = "SPORTident tCard\n"; break;
-
+		case Card10:
+			s = "SPORTident-Card 10\n"; break;
+		case Card11:
+			s = "SPORTident-Card 11\n"; break;
+		case SIAC:
+			s = "SPORTident SIAC\n"; break;
+		default:
+			break;
 	}
-	s += SiCard::dumpstr();
 	return s;
 }
 
+// A card handed out earlier may still share the data, so start from fresh
+// data instead of clearing it in place.
 void SiCard89pt::reset()
 {
-	punchingcounter = 0;
-	punches.clear();
-	rawData.clear();
+	d = new SiCardData;
 }
 
 void SiCard89pt::addBlock(int bn, const QByteArray &data)
 {
-	rawData.append(data);
-	unsigned char *d = (unsigned char *)data.data();
-	if ( bn == 0 ) {
-		intcardnum = siCardNum(d[SI0], d[SI1], d[SI2], d[SI3]);
-		cardnum = intcardnum&0xFFFFFF;
-		punchingcounter = d[point];
-	}
-	int startpage = 0; //incorrect value
-	int si3 = intcardnum>>24;
-	if (si3 == 0x1)
-		startpage = card9startpage;
-	else if (si3 == 0x2)
-		startpage = card8startpage;
-	else if (si3 == 0x4)
-		startpage = 44;
-	if ( bn == 0 ) {
-		checktime = PunchingRecord(d+(clearcheckpage*4));
-		starttime = PunchingRecord(d+(startpage*4));
-		finishtime = PunchingRecord(d+(finishpage*4));
-		int userdatalength = 0;
-		if ( si3 == 1 || si3 == 2 || si3 == 6 )
-			userdatalength = 24;
-		else if ( si3 == 4 )
-			userdatalength = 128;
+	typedef SiCard89ptLayout L;
+	if ( data.length() != L::BlockSize || bn < 0 || bn > 7 ) {
+		qWarning( "Block %i with incorrect length: %i", bn, data.length() );
+		return;
+	}
+	// Keep the card memory in one piece so punches can run over block
+	// boundaries.
+	int end = (bn+1)*L::BlockSize;
+	if ( d->rawData.length() < end )
+		d->rawData.append( QByteArray( end-d->rawData.length(), (char)0xEE ) );
+	memcpy( d->rawData.data()+bn*L::BlockSize, data.constData(), L::BlockSize );
+	d->blocksread |= 1<<bn;
+
+	const unsigned char *b = (const unsigned char *)d->rawData.constData();
+	if ( bn == 0 )
+		decodeHeader( b );
+	decodePunches( b );
+	decodeUserData( b );
+	calcFullTimes();
+}
+
+void SiCard89pt::decodeHeader(const unsigned char *b)
+{
+	typedef SiCard89ptLayout L;
+	d->intcardnum = siCardNum(L::SI0::get(b), L::SI1::get(b), L::SI2::get(b), L::SI3::get(b));
+	d->cardnum = d->intcardnum&0xFFFFFF;
+	d->punchingcounter = L::PunchCounter::get(b);
+	d->valid = true;
+	int si3 = d->intcardnum>>24;
+	if ( si3 == 0x1 )
+		d->cardtype = Card9;
+	else if ( si3 == 0x2 )
+		d->cardtype = Card8;
+	else if ( si3 == 0x4 )
+		d->cardtype = pCard;
+	else if ( si3 == 0x6 )
+		d->cardtype = tCard;
+	else if ( si3 == 0xF ) {
+		if ( d->cardnum >= 8000000 && d->cardnum <= 8999999 )
+			d->cardtype = SIAC;
+		else if ( d->cardnum >= 9000000 && d->cardnum <= 9999999 )
+			d->cardtype = Card11;
 		else
-			qWarning("Unknown 89 card version(SI3): %i", si3);
-		if ( userdatalength > 0 ) {
-			QString namedata(data.mid(8*4,userdatalength));
-			QStringList nparts = namedata.split(";");
-			if ( nparts.count() > 2 )
-				name = QString("%1 %2").arg(nparts[0]).arg(nparts[1]);
-		}
+			d->cardtype = Card10;
+	}
+	d->checktime = PunchingRecord(b+(L::ClearCheckPage*L::PageSize));
+	d->starttime = PunchingRecord(b+(L::StartPage*L::PageSize));
+	d->finishtime = PunchingRecord(b+(L::FinishPage*L::PageSize));
+	if ( !L::geometry( si3 ) )
+		qWarning("Unknown 89 card version(SI3): %i", si3);
+}
 
-		for( int i=startpage;i<32 && i-startpage < punchingcounter;i++ )
-			punches.append(PunchingRecord(d+(i*4)));
-	} else if ( bn == 1 ) {
-		for( int i=startpage-32;i<32 && i < punchingcounter;i++ )
-			punches.append(PunchingRecord(d+(i*4)));
+// The name runs over block boundaries on a pCard, it is decoded once every
+// block it is in has been read.
+void SiCard89pt::decodeUserData(const unsigned char *b)
+{
+	typedef SiCard89ptLayout L;
+	if ( !(d->blocksread & 0x01) )
+		return;
+	const L::Geometry *g = L::geometry( d->intcardnum>>24 );
+	if ( !g || g->userdatalength <= 0 )
+		return;
+	int start = L::UserDataPage*L::PageSize;
+	int len = qMin( g->userdatalength, d->rawData.length()-start );
+	if ( len <= 0 )
+		return;
+	for( int bn=start/L::BlockSize;bn<=(start+g->userdatalength-1)/L::BlockSize;bn++ ) {
+		if ( !(d->blocksread & (1<<bn)) )
+			return;
+	}
+	QString namedata = QString::fromLatin1((const char *)b+start, len);
+	QStringList nparts = namedata.split(";");
+	if ( nparts.count() > 2 ) {
+		d->firstname = nparts[0];
+		d->lastname = nparts[1];
+		d->name = QString("%1 %2").arg(d->firstname).arg(d->lastname);
+	}
+}
+
+// True when all blocks the station sends for this card type are read. A
+// card of an unknown series is complete only after the last block.
+bool SiCard89pt::isComplete() const
+{
+	if ( !(d->blocksread & 0x01) )
+		return false;
+	const SiCard89ptLayout::Geometry *g = SiCard89ptLayout::geometry( d->intcardnum>>24 );
+	if ( !g )
+		return (d->blocksread & 0x80) != 0;
+	return (d->blocksread & g->blockmask) == g->blockmask;
+}
+
+// Next block the station sends, for reading blocks that come without a
+// block number (backup memory).
+int SiCard89pt::nextBlock() const
+{
+	const SiCard89ptLayout::Geometry *g = SiCard89ptLayout::geometry( d->intcardnum>>24 );
+	int mask = ( g ? g->blockmask : 0x03 );
+	for( int bn=0;bn<8;bn++ )
+		if ( (mask & (1<<bn)) && !(d->blocksread & (1<<bn)) )
+			return bn;
+	return -1;
+}
+
+// Decodes the punches of all blocks read so far.
+void SiCard89pt::decodePunches(const unsigned char *b)
+{
+	typedef SiCard89ptLayout L;
+	const L::Geometry *g = L::geometry( d->intcardnum>>24 );
+	if ( !g )
+		return;
+	int count = qMin( d->punchingcounter, g->maxpunches );
+	d->punches.clear();
+	for( int i=0;i<count;i++ ) {
+		int page = g->firstpunchpage+i;
+		if ( !(d->blocksread & (1<<(page/L::PagesPerBlock))) )
+			break;
+		d->punches.append(PunchingRecord(b+(page*L::PageSize)));
 	}
 }
 
 SiCard6::SiCard6(const QByteArray &data)
 {
+	d->cardtype = Card6;
 	addBlock(0, data.mid(0,128));
 	QList<QByteArray> blocks;
 	for( int i=128;i<data.length();i+=128 ) {
@@ -320,9 +507,8 @@ SiCard6::SiCard6(const QByteArray &data)
 
 void SiCard6::reset()
 {
-	rawData.clear();
-	punchingcounter = 0;
-	punches.clear();
+	d = new SiCardData;
+	d->cardtype = Card6;
 }
 
 void SiCard6::resolveBackupBlocks( const QList<QByteArray> &blocks )
@@ -348,85 +534,75 @@ void SiCard6::resolveBackupBlocks( const QList<QByteArray> &blocks )
 	}
 }
 
-QString SiCard6::dumpstr() const
+QString SiCard::dumpCard6() const
 {
 	QString s;
 	s = QString( "SI card 6\n" );
-	s+=QString("First/Last name: %0/%1\n").arg(firstname).arg(lastname);
-	s+=QString("Country: %0\n").arg(country);
-	s+=QString("Club: %0\n").arg(club);
-	s+=QString("Start number: %0\n").arg(startnum);
-	s+=QString("Class: %0\n").arg(contclass);
-	s+=QString("User-id: %0\n").arg(userid);
-	s+=QString("Phone number: %0\n").arg(phone);
-	s+=QString("E-mail: %0\n").arg(email);
-	s+=QString("Street: %0\n").arg(street);
-	s+=QString("City: %0\n").arg(city);
-	s+=QString("Zip-code: %0\n").arg(zip);
-	s+=QString("Day Of Birth: %0\n").arg(dayofbirth);
-	s+=QString("Sex: %0\n").arg(sex);
+	s+=QString("First/Last name: %0/%1\n").arg(d->firstname).arg(d->lastname);
+	s+=QString("Country: %0\n").arg(d->country);
+	s+=QString("Club: %0\n").arg(d->club);
+	s+=QString("Start number: %0\n").arg(d->startnum);
+	s+=QString("Class: %0\n").arg(d->contclass);
+	s+=QString("User-id: %0\n").arg(d->userid);
+	s+=QString("Phone number: %0\n").arg(d->phone);
+	s+=QString("E-mail: %0\n").arg(d->email);
+	s+=QString("Street: %0\n").arg(d->street);
+	s+=QString("City: %0\n").arg(d->city);
+	s+=QString("Zip-code: %0\n").arg(d->zip);
+	s+=QString("Day Of Birth: %0\n").arg(d->dayofbirth);
+	s+=QString("Sex: %0\n").arg(d->sex);
 	// user-id, mobile, e-mail, street, city, zip, sex, day of birth, date of product
-	s += SiCard::dumpstr();
 	return s;
 }
 
-void SiCard6::addInfoBlock1(const unsigned char *d)
+void SiCard6::addInfoBlock1(const unsigned char *b)
 {
-	cardnum = siCardNum(d[CN0], d[CN1], d[CN2], d[CN3]);
-	punchingcounter = d[punchingPointer+2];
-	QByteArray strdata(36, 0x00);
-	memcpy(strdata.data(), d+firstnamestart, 20 );
-	firstname = QString::fromUtf8(strdata, 20).trimmed();
-	memcpy(strdata.data(), d+lastnamestart, 20 );
-	lastname = QString::fromUtf8(strdata, 20).trimmed();
-	memcpy(strdata.data(), d+clubstart, 36 );
-	club = QString::fromUtf8(strdata, 36).trimmed();
-	memcpy(strdata.data(), d+countrystart, 4 );
-	country = QString::fromUtf8(strdata, 4).trimmed();
-	memcpy(strdata.data(), d+contclassstart, 4 );
-	contclass = QString::fromUtf8(strdata, 4).trimmed();
-	startnum = word2int(d+startnumstart);
+	typedef SiCard6Layout L;
+	d->cardnum = siCardNum(L::CN0::get(b), L::CN1::get(b), L::CN2::get(b), L::CN3::get(b));
+	d->punchingcounter = L::PunchCounter::get(b);
+	d->finishtime = PunchingRecord(b+L::FinishRecord);
+	d->starttime = PunchingRecord(b+L::StartRecord);
+	d->checktime = PunchingRecord(b+L::CheckRecord);
+	d->firstname = L::FirstName::get(b);
+	d->lastname = L::LastName::get(b);
+	d->club = L::Club::get(b);
+	d->country = L::Country::get(b);
+	d->contclass = L::Class::get(b);
+	d->startnum = L::StartNumber::get(b);
 
-	valid = true;
+	d->valid = true;
 }
 
-void SiCard6::addInfoBlock2(const unsigned char *d)
+void SiCard6::addInfoBlock2(const unsigned char *b)
 {
+	typedef SiCard6Layout L;
 	// user-id, mobile, e-mail, street, city, zip, sex, day of birth, date of product
-	QByteArray strdata(36, 0x00);
-	memcpy(strdata.data(), d+useridstart, 16 );
-	userid = QString::fromUtf8(strdata, 16).trimmed();
-	memcpy(strdata.data(), d+phonestart, 16 );
-	phone = QString::fromUtf8(strdata, 16).trimmed();
-	memcpy(strdata.data(), d+emailstart, 36 );
-	email = QString::fromUtf8(strdata, 36).trimmed();
-	memcpy(strdata.data(), d+streetstart, 20 );
-	street = QString::fromUtf8(strdata, 20).trimmed();
-	memcpy(strdata.data(), d+citystart, 16 );
-	city = QString::fromUtf8(strdata, 16).trimmed();
-	memcpy(strdata.data(), d+zipstart, 8 );
-	zip = QString::fromUtf8(strdata, 8).trimmed();
-	memcpy(strdata.data(), d+dayofbirthstart, 8 );
-	dayofbirth = QString::fromUtf8(strdata, 8).trimmed();
-	sex = d[0x73];
+	d->userid = L::UserId::get(b);
+	d->phone = L::Phone::get(b);
+	d->email = L::Email::get(b);
+	d->street = L::Street::get(b);
+	d->city = L::City::get(b);
+	d->zip = L::Zip::get(b);
+	d->dayofbirth = L::DayOfBirth::get(b);
+	d->sex = L::Sex::get(b);
 }
 
 void SiCard6::addBlock(int bn, const QByteArray &data)
 {
-	rawData.append( data );
-	if ( data.length() != 128 ) {
+	typedef SiCard6Layout L;
+	d->rawData.append( data );
+	if ( data.length() != L::BlockSize ) {
 		qWarning( "Block with incorrect length: %i", data.length() );
 		return;
 	}
 
+	const unsigned char *b = (const unsigned char *)data.constData();
 	if (bn == 0 )
-		addInfoBlock1((const unsigned char *)data.data());
+		addInfoBlock1(b);
 	else if ( bn == 1 )
-		addInfoBlock2((const unsigned char *)data.data());
-	else if ( bn > 5 )
-		addPunchBlock((bn-6)*32, data);
-	else if ( bn > 1 && bn < 6 )
-		addPunchBlock(bn*32, data);
+		addInfoBlock2(b);
+	else if ( L::firstPunchOfBlock(bn) >= 0 )
+		addPunchBlock(L::firstPunchOfBlock(bn), b);
 	calcFullTimes();
 }
 
@@ -447,80 +623,81 @@ PunchingRecord::PunchingRecord(const unsigned char *d)
 	}
 }
 
-void SiCard6::addPunchBlock(int firstindex, const QByteArray &data)
+void SiCard6::addPunchBlock(int firstindex, const unsigned char *b)
 {
+	typedef SiCard6Layout L;
+	int last = qMin( firstindex+L::PunchesPerBlock, d->punchingcounter );
 	// Make the size of punces list enough to hold this block.
-	for( int i=punches.length();i<(firstindex+32) && i<punchingcounter;i++ )
-		punches.append(PunchingRecord());
-	unsigned char *d = (unsigned char *)data.data();
-	for( int i=firstindex;i<(firstindex+32) && i<punchingcounter;i++ ) {
-		punches[i] = PunchingRecord(d+((i-firstindex)*4));
-	}
+	for( int i=d->punches.length();i<last;i++ )
+		d->punches.append(PunchingRecord());
+	for( int i=firstindex;i<last;i++ )
+		d->punches[i] = PunchingRecord(b+((i-firstindex)*L::PunchRecordSize));
+}
+
+template<class F>
+static inline QTime siFieldTime( const unsigned char *b )
+{
+	if ( F::isEmpty( b ) )
+		return QTime();
+	return QTime(0, 0).addSecs( F::get( b ) );
 }
 
 SiCard5::SiCard5( const QByteArray &data )
 {
-	if (data.length() != 128 )
+	typedef SiCard5Layout L;
+	d->cardtype = Card5;
+	if (data.length() != L::Size )
 		return;
-	rawData = data;
+	d->rawData = data;
 #ifdef SI_COMM_DEBUG
 	qDebug( "Settings SiCard5 data:" );
-	for( int i=0;i<128;i++ )
+	for( int i=0;i<L::Size;i++ )
 		qDebug( "%i:%02x - %i, 0x%02X", i, i, (unsigned char)data.at(i), (unsigned char)data.at(i) );
 #endif
-	countrycode = ((unsigned char)data.at(CI6));
-	clubcode = ((unsigned char)data.at(CI5)<<8);
-	clubcode |= ((unsigned char)data.at(CI4));
-	cardnum = ((unsigned char)data.at(CN1)<<8);
-	cardnum |= ((unsigned char)data.at(CN0));
-	if ( data.at(CNS) > 1 )
-		cardnum += ((unsigned char)data.at(CNS))*100000;
-	startnum = ((unsigned char)data.at(SN1)<<8);
-	startnum |= ((unsigned char)data.at(SN0));
-	if ( data.at(SNS) > 1 )
-		startnum += ((unsigned char)data.at(SNS))*100000;
-	starttime.time = siTime( data.at(ST2), data.at(ST1) );
-	finishtime.time = siTime( data.at(FT2), data.at(FT1) );
-	checktime.time = siTime( data.at(CT2), data.at(CT1) );
-	softwareversion = (unsigned char)data.at(SW);
-	checksum = (unsigned char)data.at(CS);
-	if( checksum != 
-		(unsigned char)((unsigned char)data.at(SNS)+
-						(unsigned char)data.at(SN1)+
-						(unsigned char)data.at(SN0)) )
+	const unsigned char *b = (const unsigned char *)data.constData();
+	d->countrycode = L::CountryCode::get(b);
+	d->clubcode = L::ClubCode::get(b);
+	d->cardnum = L::CardNumber::get(b);
+	unsigned int series = L::CardSeries::get(b);
+	if ( series > 1 && series < 0x80 )
+		d->cardnum += series*100000;
+	d->startnum = L::StartNumber::get(b);
+	series = L::StartNumberSeries::get(b);
+	if ( series > 1 && series < 0x80 )
+		d->startnum += series*100000;
+	d->starttime.time = siFieldTime<L::StartTime>( b );
+	d->finishtime.time = siFieldTime<L::FinishTime>( b );
+	d->checktime.time = siFieldTime<L::CheckTime>( b );
+	d->softwareversion = L::SoftwareVersion::get(b);
+	d->checksum = L::Checksum::get(b);
+	if( d->checksum != 
+		(unsigned char)(b[L::StartNumberSeries::offset]+
+						b[L::StartNumber::offset]+
+						b[L::StartNumber::offset+1]) )
 		qWarning( "Failed checksum of si card" );
-	punchingcounter = (unsigned char)data.at(PC);
-	punches.clear();
+	d->punchingcounter = L::PunchCounter::get(b);
+	d->punches.clear();
 	int i;
-	for( i=0;i<(punchingcounter-1) && i<30;i++ ) {
-		int pstart = 0x21+((int)((i)/5))+(i*3);
-		punches.append( PunchingRecord( data.at(pstart), siTime( data.at(pstart+1), data.at(pstart+2) ) ) );
-	}
-	for(;i<(punchingcounter-1)&&i<36;i++ )
-		punches.append( PunchingRecord( data.at(0x20+(i-30)*16) ) );
-	valid = true;
-	rawdata = data;
-	inittime = QDateTime::currentDateTime();
+	for( i=0;i<(d->punchingcounter-1) && i<L::MaxTimedPunches;i++ ) {
+		const unsigned char *p = b+L::punchOffset(i);
+		d->punches.append( PunchingRecord( p[0], siTime( p[1], p[2] ) ) );
+	}
+	for(;i<(d->punchingcounter-1)&&i<L::MaxPunches;i++ )
+		d->punches.append( PunchingRecord( b[L::extraPunchOffset(i)] ) );
+	d->valid = true;
+	d->inittime = QDateTime::currentDateTime();
 	calcFullTimes();
 }
 
 
-QString SiCard5::dumpstr( void ) const
+QString SiCard::dumpCard5( void ) const
 {
 	QString s;
 	s = "SI Card 5\n";
-	s+= QString( "Software versoin: %0\n").arg(softwareversion);
+	s+= QString( "Software versoin: %0\n").arg(d->softwareversion);
 	QString tmp;
-	tmp.sprintf("checksum: %i,0x%02X\n", checksum, checksum );
+	tmp.sprintf("checksum: %i,0x%02X\n", d->checksum, d->checksum );
 	s += tmp;
-	/*
-	unsigned char sn1 = rawdata.at(SN1);
-	unsigned char sn0 = rawdata.at(SN0);
-	unsigned char sns = rawdata.at(SNS);
-	unsigned char st = sn1+sn0+sns;
-	qDebug( "Test: %i,0x%02X", st, st );
-	*/
-	s += SiCard::dumpstr();
 	return s;
 }
 
@@ -538,22 +715,128 @@ SiProto::SiProto( QObject *parent ) :
 	LENformatting = SPORTident;
 	CRCformatting = SPORTident;
 	STXtwice = false;
-
-	if ( baseCommands.isEmpty() ) {
-		baseCommands.insert( CommandGetSICard6, BaseCommandGetSICard6 );
-		baseCommands.insert( CommandGetSICard5, BaseCommandGetSICard5 );
-		baseCommands.insert( CommandSICard5Detected, BaseCommandSICard5Detected );
-		baseCommands.insert( CommandSICard6Detected, BaseCommandSICard6Detected );
-		baseCommands.insert( CommandSetMSMode, BaseCommandSetMSMode );
-		baseCommands.insert( CommandGetBackupData, BaseCommandGetBackupData );
-		baseCommands.insert( CommandEraseBackupData, BaseCommandEraseBackupData );
-		baseCommands.insert( CommandSetTime, BaseCommandSetTime );
-		baseCommands.insert( CommandGetTime, BaseCommandGetTime );
-		baseCommands.insert( CommandSetBaudRate, 0x7E );
-	}
+	extendedmode = true;
+	msmode = DirectCommunication;
+	systeminforefresh = -1;
+	waitingcommands = 0;
+	card89ptemitted = false;
+	lastreadinfo.valid = false;
+	framestart = -1;
+	framedone = -1;
+	lastrx = -1;
+	timerequested = -1;
+	searchdeadline = 3000;
+	devicemonitor = NULL;
+	latencydumptimer = NULL;
+
+	qRegisterMetaType<SiCard>("SiCard");
+	nakcount = 0;
+	qRegisterMetaType<PunchBackupData>("PunchBackupData");
+	qRegisterMetaType<SiPunch>("SiPunch");
 	
-	connect( &serial, SIGNAL( readyRead() ), this,
+	serial = NULL;
+	setDevice( new QSerial );
+}
+
+// Base protocol command for an extended one, 0 when there is none. A plain
+// switch so sessions on different threads share no state.
+int SiProto::baseCommand( int cmnd )
+{
+	switch( cmnd ) {
+		case CommandGetSICard6: return BaseCommandGetSICard6;
+		case CommandGetSICard5: return BaseCommandGetSICard5;
+		case CommandSICard5Detected: return BaseCommandSICard5Detected;
+		case CommandSICard6Detected: return BaseCommandSICard6Detected;
+		case CommandSetMSMode: return BaseCommandSetMSMode;
+		case CommandGetBackupData: return BaseCommandGetBackupData;
+		case CommandEraseBackupData: return BaseCommandEraseBackupData;
+		case CommandSetTime: return BaseCommandSetTime;
+		case CommandGetTime: return BaseCommandGetTime;
+		case CommandSetBaudRate: return 0x7E;
+		case CommandTransmitRecord: return BaseCommandTransmitRecord;
+	}
+	return 0;
+}
+
+void SiProto::setDevice( QSerial *dev )
+{
+	delete serial;
+	serial = dev;
+	serial->setParent( this );
+	sibuf.clear();
+	invalidateSystemInfo();
+	connect( serial, SIGNAL( readyRead() ), this,
 			 SLOT( serialReadyRead() ) );
+	connect( serial, SIGNAL( disconnected() ), this,
+			 SLOT( serialDisconnected() ) );
+	updateDeviceInUse();
+}
+
+void SiProto::setHotPlugEnabled( bool enabled )
+{
+	if ( !enabled ) {
+		delete devicemonitor;
+		devicemonitor = NULL;
+		return;
+	}
+	if ( devicemonitor )
+		return;
+	devicemonitor = new SiDeviceMonitor( this );
+	connect( devicemonitor, SIGNAL( deviceRemoved(const QString &) ),
+			this, SLOT( stationRemoved(const QString &) ) );
+	connect( devicemonitor, SIGNAL( stationFound(const SiProbeResult &) ),
+			this, SLOT( stationFound(const SiProbeResult &) ) );
+	if ( !devicemonitor->start() ) {
+		delete devicemonitor;
+		devicemonitor = NULL;
+	}
+	updateDeviceInUse();
+}
+
+// Keeps the device monitor off the port this session has open, or is
+// opening, so it is not probed while in use
+void SiProto::updateDeviceInUse( const QString &opening )
+{
+	if ( !devicemonitor )
+		return;
+	QStringList l;
+	if ( !opening.isEmpty() )
+		l.append( opening );
+	else if ( serial && serial->isOpen() )
+		l.append( serial->deviceName() );
+	devicemonitor->setDevicesInUse( l );
+}
+
+void SiProto::serialDisconnected()
+{
+	QString dev = serial->deviceName();
+	serial->close();
+	sibuf.clear();
+	invalidateSystemInfo();
+	updateDeviceInUse();
+	// Stations found while this one was open were passed over, one of
+	// them can take its place. Not from in here, opening blocks.
+	if ( devicemonitor )
+		QMetaObject::invokeMethod( devicemonitor, "reportStations", Qt::QueuedConnection );
+	siCard6Inserted = false;
+	emit statusMessage( "SportIdent station disconnected: "+dev );
+	emit stationDisconnected( dev );
+}
+
+void SiProto::stationRemoved( const QString &device )
+{
+	// The read error usually comes first, this covers a port that was
+	// idle when it went away
+	if ( serial->isOpen() && serial->deviceName() == device )
+		serialDisconnected();
+}
+
+void SiProto::stationFound( const SiProbeResult &r )
+{
+	if ( serial->isOpen() )
+		return;
+	if ( openProbed( r ) )
+		emit stationConnected( r.device );
 }
 
 void SiProto::setEventStartTime( const QDateTime &dt )
@@ -561,14 +844,40 @@ void SiProto::setEventStartTime( const QDateTime &dt )
 	eventStartTime = dt;
 }
 
+void SiProto::setLatencyDumpInterval( int msecs )
+{
+	if ( msecs <= 0 ) {
+		delete latencydumptimer;
+		latencydumptimer = NULL;
+		return;
+	}
+	if ( !latencydumptimer ) {
+		latencydumptimer = new QTimer( this );
+		connect( latencydumptimer, SIGNAL( timeout() ), this, SLOT( dumpLatency() ) );
+	}
+	latencydumptimer->start( msecs );
+}
+
+void SiProto::dumpLatency()
+{
+	if ( latency.readouts() )
+		qDebug( "%s", qPrintable( latency.dump() ) );
+}
+
 void SiProto::serialReadyRead()
 {
-	QByteArray tmp = serial.read(100);
+	if ( sibuf.isEmpty() )
+		framestart = serial->lastReadStart();
+	QByteArray tmp = serial->read(100);
 	while( tmp.length() > 0 ) {
 		sibuf.append( tmp );
-		tmp = serial.read(100);
+		tmp = serial->read(100);
 	}
-	if ( sibuf.count() ) {
+	lastrx = serial->lastRead();
+	// Handle every complete frame, stations in autosend mode send bursts
+	// of transmit records. A partial frame waits for the next read.
+	int newpunches = 0;
+	while ( frameComplete() ) {
 		unsigned char cmnd;
 		QByteArray data;
 		QVariant cnum = QVariant();
@@ -581,54 +890,70 @@ void SiProto::serialReadyRead()
 					t += 2;
 				if ( data.length() >= 4 )
 					cnum = siCardNum(t[3],t[2],t[1],t[0]);
+				latency.start( framestart );
+				latency.mark( SiLatency::FrameComplete, framedone );
 			}
 			switch ( cmnd ) {
-			case 0x46: // FI ( SICard5 detected ) baseCommands[CommandSICard5Detected];
+			case 0x46: // FI ( SICard5 detected ) baseCommand( CommandSICard5Detected )
 				if ( data.at(0) != SICard5Inserted )
 					break;
 			case CommandSICard5Detected:
 				cardver = "5";
 				if ( doHandshake )
 					sendCommand( CommandGetSICard5 );
+				latency.mark( SiLatency::Detected );
 				break;
 			case CommandSICard6Detected: case BaseCommandSICard6Detected:
 				qDebug("Detected card ver 6");
 				if (cnum.toInt() >= 1000000 && cnum.toInt() <= 2999999) {
 					qDebug("Which is actually 89pt");
 					card89ptforread.reset();
+					card89ptemitted = false;
 					QByteArray ba;
-					ba.append((char)0);
+					ba.append((char)SiCard89ptLayout::ReadAllBlocks);
 					sendCommand( CommandGetSICard89pt,ba );
 				} else {
 					cardver = "6";
 					if ( doHandshake ) {
-						siCard6Inserted = true;
 						card6forread.reset();
-						GetSystemValue(CardBlocks, 1);
+						if ( lastreadinfo.valid ) {
+							readCard6( lastreadinfo.memory.at(CardBlocks) );
+						} else {
+							siCard6Inserted = true;
+							GetSystemValue(CardBlocks, 1);
+						}
 					}
 				}
+				latency.mark( SiLatency::Detected );
 				break;
 			case CommandSICard89ptDetected:
-				cardver = "8/9/p";
+				cardver = "8/9/10/11/p/t/SIAC";
 				if ( doHandshake ) {
 					card89ptforread.reset();
+					card89ptemitted = false;
 					QByteArray ba;
-					ba.append((char)0);
+					ba.append((char)SiCard89ptLayout::ReadAllBlocks);
 					sendCommand( CommandGetSICard89pt,ba );
 				}
+				latency.mark( SiLatency::Detected );
 				break;
 			case CommandGetSICard89pt:
 				{
+					// All blocks were requested at once, the station sends
+					// them one after another. Each block is decoded as it
+					// arrives.
+					latency.mark( SiLatency::BlockReceived, framedone );
 					unsigned char bn = (unsigned char)data.at(0);
+					if ( card89ptemitted )
+						break;
 					card89ptforread.addBlock(bn, data.mid(1));
-					if ( bn == 0 ) {
-						QByteArray ba;
-						ba.append((char)1);
-						sendCommand( CommandGetSICard89pt,ba );
-					} else if ( bn == 1 ) {
+					if ( card89ptforread.isComplete() ) {
+						card89ptemitted = true;
 						if (eventStartTime.isValid())
 							card89ptforread.setEventStartTime(eventStartTime);
+						latency.mark( SiLatency::Decoded );
 						emit cardRead( card89ptforread );
+						latency.finish();
 						if ( autoAccept )
 							sendACK();
 					}
@@ -636,24 +961,30 @@ void SiProto::serialReadyRead()
 				}
 			case CommandGetSICard5: case BaseCommandGetSICard5:
 				{
+					latency.mark( SiLatency::BlockReceived, framedone );
 					SiCard5 card( data );
-					card.print();
 					if (eventStartTime.isValid())
 						card.setEventStartTime(eventStartTime);
+					latency.mark( SiLatency::Decoded );
+					card.print();
 					emit cardRead( card );
+					latency.finish();
 					if ( autoAccept )
 						sendACK();
 					break;
 				}
 			case CommandGetSICard6: case BaseCommandGetSICard6:
 				{
+					latency.mark( SiLatency::BlockReceived, framedone );
 					unsigned char bn = (unsigned char)data.at(0);
 					card6forread.addBlock(bn, data.mid(1));
 					if ( bn == lastcard6block ) {
-						card6forread.print();
 						if (eventStartTime.isValid())
 							card6forread.setEventStartTime(eventStartTime);
+						latency.mark( SiLatency::Decoded );
+						card6forread.print();
 						emit cardRead( card6forread );
+						latency.finish();
 						if ( autoAccept )
 							sendACK();
 					}
@@ -661,35 +992,44 @@ void SiProto::serialReadyRead()
 				break;
 			case CommandGetTime: case BaseCommandGetTime:
 				{
+					QDateTime st = handleGetTime(data, cmnd == CommandGetTime);
 					QDateTime ct = QDateTime::currentDateTime();
-					emit gotTime( handleGetTime(data, cmnd == CommandGetTime), ct, cn );
+					if ( timerequested > 0 && lastrx > timerequested ) {
+						// The PC time halfway between request and answer,
+						// not when the answer got parsed
+						qint64 mid = timerequested+( lastrx-timerequested )/2;
+						ct = ct.addMSecs( -( siMonotonicNsecs()-mid )/1000000 );
+						timesync.addSample( st, ct, lastrx-timerequested );
+					}
+					timerequested = -1;
+					emit gotTime( st, ct, cn );
 					break;
 				}
 			case CommandSetTime: case BaseCommandSetTime:
 				{
+					// Samples from before say nothing about the new time
+					timesync.reset();
 					emit gotSetTime( handleGetTime(data, cmnd==CommandSetTime), cn );
 					break;
 				}
 			case CommandSetMSMode: case BaseCommandSetMSMode:
+				msmode = (MSMode)data.at(0);
 				emit gotMSMode((MSMode)data.at(0), cn);
 				break;
 			case CommandGetSystemValue:
 				updateSystemInfo( data.at(0), data.mid(1) );
+				if ( systeminforefresh >= 0 && data.at(0) == FullData && data.length() > 0x80 ) {
+					// Replies come in the order of the requests. The first
+					// full read after the refresh is its reply, unless it
+					// timed out and this one answers a later request
+					bool own = siMonotonicNsecs()-systeminforefresh < qint64(timeoutforcommands)*1000000;
+					systeminforefresh = -1;
+					if ( own )
+						break;
+				}
 				if ( siCard6Inserted && data.length() > 1 && ((unsigned char )data.at(0) == CardBlocks) ) {
 					siCard6Inserted = false;
-					unsigned char b = (unsigned char)data.at(1);
-					lastcard6block = 7;
-					if ( b != 0xFF ) {
-						lastcard6block = 0;
-						b = b>>1;
-						while( b ) {
-							lastcard6block++;
-							b = b>>1;
-						}
-					}
-					QByteArray ba;
-					ba.append((unsigned char)0x08);
-					sendCommand( CommandGetSICard6, ba );
+					readCard6( data.at(1) );
 					break;
 				} else if ( startingbackup ) {
 					if ( (backupreadpointer-0x100) % lastreadinfo.backuprecordsize ) {
@@ -723,6 +1063,8 @@ void SiProto::serialReadyRead()
 				emit gotSystemValue( data.at(0), data.mid(1), cn );
 				break;
 			case CommandSetSystemValue:
+				if ( msmode == DirectCommunication )
+					invalidateSystemInfo();
 				emit gotSetSystemValue( data.at(0), data.mid(1), cn );
 				break;
 			case CommandEraseBackupData: case BaseCommandEraseBackupData:
@@ -754,6 +1096,15 @@ void SiProto::serialReadyRead()
 					emit gotBackupData(readaddr, data.mid(3),cn);
 					break;
 				}
+			case CommandTransmitRecord: case BaseCommandTransmitRecord:
+				{
+					SiPunch p;
+					if ( !SiPunch::fromTransmitRecord( data, cn, cmnd == CommandTransmitRecord, &p ) )
+						break;
+					if ( punchqueue.push( p ) )
+						newpunches++;
+					break;
+				}
 			default:
 				break;
 			};
@@ -768,6 +1119,35 @@ void SiProto::serialReadyRead()
 			}
 		}
 	};
+	if ( newpunches )
+		emit punchesAvailable( newpunches );
+}
+
+// Drops bytes in front of the next frame and tells whether sibuf holds a
+// whole frame or a NAK, so readCommand() will not wait for more data
+bool SiProto::frameComplete()
+{
+	int i = 0;
+	while( i < sibuf.length() && sibuf.at(i) != STX && sibuf.at(i) != NAK )
+		i++;
+	if ( i )
+		sibuf.remove( 0, i );
+	if ( sibuf.isEmpty() )
+		return false;
+	if ( sibuf.at(0) == NAK )
+		return true;
+	if ( sibuf.length() < 2 )
+		return false;
+	unsigned char cmnd = sibuf.at(1);
+	if ( cmnd >= 0x80 && cmnd != 0xC4 )
+		return sibuf.length() >= 3 && sibuf.length() >= 6+(unsigned char)sibuf.at(2);
+	for( int pos=2;pos<sibuf.length();pos++ ) {
+		if ( sibuf.at(pos) == DLE )
+			pos++;
+		else if ( sibuf.at(pos) == ETX )
+			return true;
+	}
+	return false;
 }
 
 QStringList SiProto::fullDeviceList( void )
@@ -776,7 +1156,7 @@ QStringList SiProto::fullDeviceList( void )
 #if defined( __APPLE__ )
 	QDir d( "/dev", "cu.*" );
 #elif defined( __linux__ )
-	QDir d( "/dev", "ttyUSB*" );
+	QDir d( "/dev", "ttyUSB* ttyACM*" );
 #endif
 	d.setFilter( QDir::System );
 	QFileInfoList fl = d.entryInfoList();
@@ -788,11 +1168,70 @@ QStringList SiProto::fullDeviceList( void )
 #endif
 }
 
+// Settings key for what is known about the station on a device
+static QString fingerprintKey( const QString &d, const char *name )
+{
+	return QString( "siproto/stations/%1/%2" ).arg( QFileInfo( d ).fileName() ).arg( name );
+}
+
+void SiProto::saveFingerprint( const QString &d, int speed, int stationcode )
+{
+	if ( QApplication::applicationName().isEmpty() )
+		return;
+	QSettings set;
+	set.setValue( fingerprintKey( d, "speed" ), speed );
+	set.setValue( fingerprintKey( d, "extended" ), extendedmode );
+	set.setValue( fingerprintKey( d, "stationcode" ), stationcode );
+}
+
+// Opens d with the speed and protocol the station had last time and checks
+// with one SetMSMode that a station with the same code and protocol still
+// answers. Another station set to the same code passes too. The probe
+// cascade in tryDevice() is only needed when this fails.
+bool SiProto::tryFingerprint( const QString &d )
+{
+	QSettings set;
+	if ( !set.contains( fingerprintKey( d, "speed" ) ) )
+		return false;
+	int speed = set.value( fingerprintKey( d, "speed" ) ).toInt();
+	bool extended = set.value( fingerprintKey( d, "extended" ) ).toBool();
+	int stationcode = set.value( fingerprintKey( d, "stationcode" ), -1 ).toInt();
+
+	invalidateSystemInfo();
+	msmode = DirectCommunication;
+	if ( serial->isOpen() )
+		serial->close();
+	updateDeviceInUse( d );
+	if ( !serial->open( d, speed, true ) ) {
+		updateDeviceInUse();
+		return false;
+	}
+	extendedmode = extended;
+	CommandReceiver cr( this, CommandSetMSMode );
+	if ( !SetMSMode( DirectCommunication, false ) || !cr.waitForCommand( FingerprintTimeout )
+		 || cr.extendedCommand != extended || cr.cn != stationcode ) {
+		serial->close();
+		updateDeviceInUse();
+		return false;
+	}
+	emit statusMessage( QString( "SportIdent at %1 with speed %2. %3 extended mode" )
+			.arg( d ).arg( speed ).arg( extended ? "Using" : "Not using" ) );
+	if ( extendedmode )
+		refreshSystemInfo();
+	return true;
+}
+
 bool SiProto::tryDevice( const QString &d )
 {
-	if ( serial.isOpen() )
-		serial.close();
-	if ( !serial.open( d, 38400 ) ) {
+	if ( tryFingerprint( d ) )
+		return true;
+	invalidateSystemInfo();
+	msmode = DirectCommunication;
+	if ( serial->isOpen() )
+		serial->close();
+	updateDeviceInUse( d );
+	if ( !serial->open( d, 38400, true ) ) {
+		updateDeviceInUse();
 		emit statusMessage( "Failed to open serial device: "+d );
 		return false;
 	}
@@ -800,28 +1239,35 @@ bool SiProto::tryDevice( const QString &d )
 	CommandReceiver cr( this, CommandSetMSMode );
 	if( SetMSMode( DirectCommunication )  && cr.waitForCommand(1000) ) {
 		emit statusMessage( "SportIdent at "+d+" with speed 38400. Using extended mode" );
+		saveFingerprint( d, 38400, cr.cn );
+		refreshSystemInfo();
 		return true;
 	}
 	
 	// TODO Problems with close / open 
-	serial.close();
-	if ( !serial.open( d, 4800 ) ) {
+	serial->close();
+	if ( !serial->open( d, 4800, true ) ) {
+		updateDeviceInUse();
 		emit statusMessage( "Failed to open serial device: "+d );
 		return false;
 	}
 	cr.haveit = false;
 	if( SetMSMode( DirectCommunication ) && cr.waitForCommand(1000) ) {
 		emit statusMessage( "SportIdent at "+d+" with speed 4800. Using extended mode" );
+		saveFingerprint( d, 4800, cr.cn );
+		refreshSystemInfo();
 		return true;
 	}
 	extendedmode = false;
 	cr.haveit = false;
 	if( SetMSMode( DirectCommunication ) && cr.waitForCommand(1000) ) {
 		emit statusMessage( "SportIdent at "+d+" with speed 4800. Not using extended mode" );
+		saveFingerprint( d, 4800, cr.cn );
 		return true;
 	}
 
 	emit statusMessage( "Could not find SporIdent on serial device: "+d );
+	updateDeviceInUse();
 	// TODO Try more modes
 	return false;
 }
@@ -829,13 +1275,13 @@ bool SiProto::tryDevice( const QString &d )
 bool SiProto::sendACK( void )
 {
 	unsigned char ba[] = { (unsigned char)ACK };
-	return serial.write( (const char *)ba, 1 );
+	return serial->write( (const char *)ba, 1 );
 }
 
 bool SiProto::sendNAK( void )
 {
 	unsigned char ba[] = { (unsigned char)NAK };
-	return serial.write( (const char *)ba, 1 );
+	return serial->write( (const char *)ba, 1 );
 }
 
 bool SiProto::sendCommand( unsigned char command, const QByteArray &data )
@@ -847,8 +1293,8 @@ bool SiProto::sendCommand( unsigned char command, const QByteArray &data )
 	if ( STXtwice )
 		ba.append( STX );
 	if ( !extendedmode ) {
-		if ( baseCommands.contains( command ) ) {
-			command = baseCommands[command];
+		if ( baseCommand( command ) ) {
+			command = baseCommand( command );
 		} else
 			qWarning( "No base command for 0x%02X, trying to use extended one.", command );
 	}
@@ -885,7 +1331,7 @@ bool SiProto::sendCommand( unsigned char command, const QByteArray &data )
 #ifdef SI_COMM_DEBUG
 	dumpBuffer( ba, ">> Writing" );
 #endif
-	if ( serial.write( ba ) == ba.length() ) {
+	if ( serial->write( ba ) == ba.length() ) {
 		emit sentCommand(command, data);
 		return true;
 	}
@@ -917,7 +1363,7 @@ bool SiProto::getCommand( unsigned char &cmnd, QByteArray &data, int *scn )
 	if ( !readCommand( cmnd, data ) )
 		return false;
 	bool hascn = true;
-	if ( cmnd == baseCommands[CommandSICard5Detected] )
+	if ( cmnd == baseCommand( CommandSICard5Detected ) )
 		hascn = false;
 	int cn;
 	if ( hascn ) {
@@ -956,13 +1402,12 @@ void SiProto::dumpBuffer( const QByteArray &buf, const QString &s )
 bool SiProto::readCommand( unsigned char &cmnd, QByteArray &data )
 {
 	int length;
-	static int nakcount = 0;
 	bool musttry = false;
 	if ( sibuf.length() ) 
 		musttry = true;
-	while ( musttry || serial.waitForReadyRead( 1000 ) ) {
+	while ( musttry || serial->waitForReadyRead( 1000 ) ) {
 		if ( !musttry )
-			sibuf.append( serial.read(1024) );
+			sibuf.append( serial->read(1024) );
 		musttry = false;
 #ifdef SI_COMM_DEBUG
 		dumpBuffer(sibuf, "<< readCommand");
@@ -1006,17 +1451,20 @@ bool SiProto::readCommand( unsigned char &cmnd, QByteArray &data )
 #endif
 			unsigned int creal = (((unsigned char)sibuf.at(length+3))<<8)|((unsigned char)sibuf.at(length+4));
 			unsigned int ctest = crc( length+2, (unsigned char *)sibuf.mid( 1 ).data() );
-			if ( creal != ctest ) {
-				sibuf = sibuf.mid(1);
-				qWarning( "CRC Not ok: %x != %x", creal, ctest );
-				continue;
-			}
-			if ( sibuf.at(length+5) != ETX ) {
+			if ( creal != ctest || sibuf.at(length+5) != ETX ) {
+				if ( creal != ctest )
+					qWarning( "CRC Not ok: %x != %x", creal, ctest );
 				sibuf = sibuf.mid(1);
+				// The next frame may already be buffered, a burst goes on
+				// with it. Without one the next readyRead carries on.
+				if ( !frameComplete() )
+					return false;
+				musttry = true;
 				continue;
 			}
 			data = sibuf.mid( 3, length );
 			sibuf = sibuf.mid( length+6 );
+			framedone = siMonotonicNsecs();
 			return true;
 		} else {
 			int pos = 2;
@@ -1030,6 +1478,7 @@ bool SiProto::readCommand( unsigned char &cmnd, QByteArray &data )
 			}
 			if ( sibuf.at(pos) == ETX ) {
 		qDebug( "Have ETX" );
+				framedone = siMonotonicNsecs();
 				data = sibuf.mid( 2, pos-2 );
 				removeDLE( data );
 				sibuf = sibuf.mid( pos+1 );
@@ -1117,6 +1566,7 @@ bool SiProto::GetSystemValue( unsigned char addr, unsigned char len )
 bool SiProto::GetSystemValue( unsigned char addr, unsigned char len, QByteArray *mem, int *cn )
 {
 	CommandReceiver cr( this, CommandGetSystemValue );
+	cr.expectSystemValue( addr, len );
 	QByteArray ba;
 	ba.append( addr );
 	ba.append( len );
@@ -1148,7 +1598,7 @@ bool SiProto::SetBaudRate( int speed, int *cn )
 	QByteArray data;
 	if ( !getCommand( cmnd, data, cn ) )
 		return false;
-	if ( !(cmnd == CommandSetBaudRate || cmnd == baseCommands[CommandSetBaudRate] ) )
+	if ( !(cmnd == CommandSetBaudRate || cmnd == baseCommand( CommandSetBaudRate ) ) )
 		return false;
 	if ( data.length() != 1 || (unsigned char)data.at(0) != speed )
 		return false;
@@ -1200,9 +1650,21 @@ bool SiProto::SetTime( const QDateTime &sdt, QDateTime *dt, int *cn )
 	return true;
 }
 
+bool SiProto::SyncTime()
+{
+	// STX, command, length, CRC and ETX around the data
+	int bytes = timeForSI( QDateTime::currentDateTime() ).length()+6;
+	qint64 transmit = serial->baudRate() > 0 ? (qint64)bytes*10*1000000000/serial->baudRate() : 0;
+	return SetTime( timesync.setTimeArgument( QDateTime::currentDateTime(), transmit ) );
+}
+
 bool SiProto::GetTime()
 {
-	return sendCommand( CommandGetTime );
+	if ( !sendCommand( CommandGetTime ) )
+		return false;
+	serial->drain();
+	timerequested = serial->lastWriteDone();
+	return true;
 }
 
 bool SiProto::GetTime( QDateTime *dt, int *cn )
@@ -1275,24 +1737,57 @@ void SiProto::setFeedbackEnabled( bool enabled )
 	autoAccept = enabled;
 }
 
+// All devices are probed at once, the last used one is preferred when
+// several stations answer at the same time.
 bool SiProto::searchAndOpen( void )
 {
 	QSettings set;
+	QStringList dl = fullDeviceList();
 	if ( set.contains( "siproto/dev" ) ) {
-		if ( tryDevice( set.value( "siproto/dev" ).toString() ) )
+		QString last = set.value( "siproto/dev" ).toString();
+		if ( dl.contains( last ) && tryFingerprint( last ) )
 			return true;
+		dl.removeAll( last );
+		dl.prepend( last );
 	}
-	QStringList dl = fullDeviceList();
-	for( int i=0;i<dl.count();i++ ) {
-		if ( i== 1 || i == 2)
-			continue;
-		if ( tryDevice( dl.at(i) ) ) {
-			if ( !QApplication::applicationName().isEmpty() )
-				set.setValue( "siproto/dev", dl.at(i) );
-			return true;
-		}
+	emit statusMessage( "Searching SportIdent stations" );
+	QList<SiProbeResult> found = SiProbe::probe( dl, searchdeadline );
+	if ( found.isEmpty() || !openProbed( found.first() ) ) {
+		emit statusMessage( "Could not find SportIdent station" );
+		return false;
 	}
-	return false;
+	if ( !QApplication::applicationName().isEmpty() )
+		set.setValue( "siproto/dev", found.first().device );
+	return true;
+}
+
+// Opens a device with the speed and protocol a probe found
+bool SiProto::openProbed( const SiProbeResult &r )
+{
+	invalidateSystemInfo();
+	msmode = DirectCommunication;
+	if ( serial->isOpen() )
+		serial->close();
+	updateDeviceInUse( r.device );
+	if ( !serial->open( r.device, r.speed, true ) ) {
+		updateDeviceInUse();
+		emit statusMessage( "Failed to open serial device: "+r.device );
+		return false;
+	}
+	extendedmode = r.extended;
+	CommandReceiver cr( this, CommandSetMSMode );
+	if( !SetMSMode( DirectCommunication ) || !cr.waitForCommand(1000) ) {
+		serial->close();
+		updateDeviceInUse();
+		emit statusMessage( "Could not find SporIdent on serial device: "+r.device );
+		return false;
+	}
+	emit statusMessage( QString( "SportIdent at %1 with speed %2. %3 extended mode" )
+			.arg( r.device ).arg( r.speed ).arg( r.extended ? "Using" : "Not using" ) );
+	saveFingerprint( r.device, r.speed, cr.cn );
+	if ( extendedmode )
+		refreshSystemInfo();
+	return true;
 }
 
 bool SiProto::StartGetBackup( int startaddr, int size )
@@ -1339,7 +1834,7 @@ void SiProto::resolveCard6Backup(QList<SiCard> *clist)
 	if ( clist ) {
 		clist->append( card6forread );
 	}
-	emit backupCard(&card6forread);
+	emit backupCard(card6forread);
 	card6blocksread = 0;
 }
 
@@ -1348,7 +1843,7 @@ void SiProto::resolveCard89Backup(QList<SiCard> *clist)
 	if ( clist ) {
 		clist->append( card89ptforread );
 	}
-	emit backupCard(&card89ptforread);
+	emit backupCard(card89ptforread);
 	card89blocksread = 0;
 }
 
@@ -1366,7 +1861,7 @@ void SiProto::handleCardBackupData(unsigned int /*addr*/, const QByteArray &data
 		if (card89blocksread)
 			resolveCard89Backup(clist);
 		SiCard5 card( data );
-		emit backupCard(&card);
+		emit backupCard(card);
 		if ( clist )
 			clist->append( card );
 		return;
@@ -1391,8 +1886,11 @@ void SiProto::handleCardBackupData(unsigned int /*addr*/, const QByteArray &data
 		return;
 	}
 	if (card89blocksread) {
-		card89ptforread.addBlock(1,data);
-		resolveCard89Backup(clist);
+		card89ptforread.addBlock(card89ptforread.nextBlock(),data);
+		card89blocksread++;
+		// Of an unknown series only the first two blocks are taken
+		if ( card89ptforread.isComplete() || card89ptforread.nextBlock() < 0 )
+			resolveCard89Backup(clist);
 		return;
 	}
 	if ( card6blocksread ) {
@@ -1512,6 +2010,55 @@ void SiProto::updateSystemInfo(unsigned char addr, const QByteArray &data)
 		const unsigned char *d2 = d+BackupMemoryAddres-addr;
 		lastreadinfo.backupmemaddr = (d2[0]<<24)|(d2[1]<<16)|(d2[5]<<8)|d2[6];
 	}
+	// In slave mode this is the memory of the remote station
+	if ( msmode != DirectCommunication || addr >= 0x80 )
+		return;
+	if ( lastreadinfo.memory.length() != 0x80 )
+		lastreadinfo.memory = QByteArray( 0x80, 0x00 );
+	int len = qMin( data.length(), 0x80-addr );
+	memcpy( lastreadinfo.memory.data()+addr, data.constData(), len );
+	if ( addr == FullData && len == 0x80 )
+		lastreadinfo.valid = true;
+}
+
+// Forget the cached system memory of the station. Card 6 reads ask the
+// station for its card blocks setting until the cache is read again.
+void SiProto::invalidateSystemInfo()
+{
+	lastreadinfo.valid = false;
+	systeminforefresh = -1;
+}
+
+// Reads the whole system memory into the cache. The reply is not emitted
+// as gotSystemValue().
+bool SiProto::refreshSystemInfo()
+{
+	// Its reply could be taken for the one a blocking call waits for
+	if ( !extendedmode || waitingcommands )
+		return false;
+	if ( !GetSystemValue( FullData, 0x80 ) )
+		return false;
+	systeminforefresh = siMonotonicNsecs();
+	return true;
+}
+
+// Requests all card 6 blocks the station is configured to send. Blocks
+// come in order, so the highest block in the mask finishes the card.
+void SiProto::readCard6( unsigned char cardblocks )
+{
+	unsigned char b = cardblocks;
+	lastcard6block = 7;
+	if ( b != 0xFF ) {
+		lastcard6block = 0;
+		b = b>>1;
+		while( b ) {
+			lastcard6block++;
+			b = b>>1;
+		}
+	}
+	QByteArray ba;
+	ba.append((unsigned char)0x08);
+	sendCommand( CommandGetSICard6, ba );
 }
 
 void SiProto::stopTasks()
@@ -1521,16 +2068,9 @@ void SiProto::stopTasks()
 	readingcardbackup = false;
 }
 
-SiCard SiProto::cardFromData( const QByteArray ba )
+SiCard SiProto::cardFromData( const QByteArray &ba )
 {
-	unsigned char *b = (unsigned char *)ba.data();
-	if ( b[30] == 0x00 && b[31] == 0x07 )
-		return SiCard5( ba );
-	else if ( b[4] == 0xED && b[5] == 0xED && b[6] == 0xED && b[7] == 0xED  )
-		return SiCard6( ba );
-	else if ( b[4] == 0xEA && b[5] == 0xEA && b[6] == 0xEA && b[7] == 0xEA  )
-		qWarning( "Creating Card8 / Card9 / pCard from bytearray not impmlemented" );
-	return SiCard();
+	return SiCard::fromRawData( ba );
 }
 
 bool SiProto::ResetBackup( int *cn  )
@@ -1552,17 +2092,35 @@ bool SiProto::ResetBackup()
 	return sendCommand( CommandEraseBackupData );
 }
 
-SiCard *SiCard::fromRawData(const QByteArray &data)
+// Only tells card 5, card 6 and card 8/9/p/t apart. The exact 8/9/p/t type
+// is known after decoding the first block.
+SiCard::CardType SiCard::detectType(const QByteArray &data)
 {
-	qDebug("Data length: %i", data.length());
+	if ( data.length() < 32 )
+		return UnknownCard;
 	const unsigned char *b = (const unsigned char *)data.data();
-	if ( data.at(30) == 0x00 && data.at(31) == 0x07 )
-		return new SiCard5( data );
-	else if ( b[4] == 0xED && b[5] == 0xED && b[6] == 0xED && b[7] == 0xED  ) {
-		return new SiCard6(data);
-	} else if ( b[4] == 0xEA && b[5] == 0xEA && b[6] == 0xEA && b[7] == 0xEA  ) {
-		return new SiCard89pt(data);
+	if ( b[30] == 0x00 && b[31] == 0x07 )
+		return Card5;
+	else if ( b[4] == 0xED && b[5] == 0xED && b[6] == 0xED && b[7] == 0xED  )
+		return Card6;
+	else if ( b[4] == 0xEA && b[5] == 0xEA && b[6] == 0xEA && b[7] == 0xEA  )
+		return Card9;
+	return UnknownCard;
+}
+
+SiCard SiCard::fromRawData(const QByteArray &data)
+{
+	switch ( detectType( data ) ) {
+		case Card5:
+			return SiCard5( data );
+		case Card6:
+			return SiCard6( data );
+		case Card8: case Card9: case pCard: case tCard:
+		case Card10: case Card11: case SIAC:
+			return SiCard89pt( data );
+		default:
+			break;
 	}
-
-	return NULL;
+	qWarning( "Unknown card data, length: %i", data.length() );
+	return SiCard();
 }
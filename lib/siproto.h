@@ -5,11 +5,22 @@
 #include <QMap>
 #include <QDateTime>
 #include <QVariant>
+#include <QSharedDataPointer>
 
 #include "qserial.h"
+#include "silatency.h"
+#include "siprobe.h"
+#include "sipunch.h"
+#include "sitimesync.h"
+
+class SiDeviceMonitor;
+class QTimer;
 
 class PunchBackupData {
 	public:
+		PunchBackupData() :
+			cardnum( 0 ), dayofweek( 0 ), cn( 0 )
+			{}
 		PunchBackupData( unsigned char *d, int size, double swm, int scn );
 
 		QTime t;
@@ -56,55 +67,81 @@ class PunchingRecord {
 		};
 };
 
+class SiCardData;
+
+// Decoded card. The data is implicitly shared and never changed once a card
+// has been handed out, so copying a card (e.g. into several queued signal
+// connections) only increments a reference count.
 class SiCard {
 	public:
-		SiCard() : 
-			countrycode(0),
-			clubcode(0),
-			startnum(0),
-			valid( false )
-		{};
-		
-		static SiCard *fromRawData(const QByteArray &ba);
+		enum CardType {
+			UnknownCard,
+			Card5,
+			Card6,
+			Card8,
+			Card9,
+			pCard,
+			tCard,
+			Card10,
+			Card11,
+			SIAC
+		};
+
+		SiCard();
+		SiCard( const SiCard &other );
+		~SiCard();
+		SiCard &operator=( const SiCard &other );
+#ifdef Q_COMPILER_RVALUE_REFS
+		inline SiCard &operator=( SiCard &&other ) {
+			qSwap( d, other.d );
+			return *this;
+		}
+#endif
+		inline void swap( SiCard &other ) {
+			qSwap( d, other.d );
+		}
+
+		static CardType detectType(const QByteArray &ba);
+		static SiCard fromRawData(const QByteArray &ba);
 
 		void setEventStartTime( const QDateTime &dt );
 
+		CardType getCardType() const;
+		bool isValid() const;
 		int getCardNumber() const;
 		QDateTime getFullStartTime() const;
 		QDateTime getFullFinishTime() const;
 		QDateTime getFullCheckTime() const;
 		const QList<PunchingRecord> & getPunches() const;
 
+		QString getFirstName() const;
+		QString getLastName() const;
+		QString getClub() const;
+		QString getCountry() const;
+		QString getClass() const;
+
 		QByteArray getRawData() const;
 
 		void print() const;
-		virtual QString dumpstr( void ) const;
+		QString dumpstr( void ) const;
 
 	protected:
-		int countrycode;
-		int clubcode;
-		int cardnum;
-		int intcardnum;
-		int startnum;
-		PunchingRecord starttime;
-		PunchingRecord checktime;
-		PunchingRecord finishtime;
-		QDateTime fullstarttime, fullchecktime, fullfinishtime;
-		QList<PunchingRecord> punches;
-		int punchingcounter;
-		QString name;
-
-		QDateTime inittime;
-		bool valid;
+		QSharedDataPointer<SiCardData> d;
 
 		QTime siTime( unsigned char s2, unsigned char s1 );
-		int word2int( const unsigned char *d );
 		void calcFullTimes( void );
 		QDateTime closestVariant( const QDateTime &from, const QTime &t );
 
-		QByteArray rawData;
+		QString dumpCard5( void ) const;
+		QString dumpCard6( void ) const;
+		QString dumpCard89pt( void ) const;
 };
+Q_DECLARE_METATYPE(SiCard)
+Q_DECLARE_METATYPE(PunchBackupData)
 
+// The card classes below only decode raw card memory into SiCard. They do
+// not add any members so a SiCard5/6/89pt can be copied into a SiCard
+// (or passed through a queued signal) without losing anything.
 class SiCard89pt : public SiCard
 {
 	public:
@@ -112,33 +149,12 @@ class SiCard89pt : public SiCard
 		SiCard89pt() : SiCard() {};
 		void reset();
 		void addBlock( int bn, const QByteArray &data128 );
-		virtual QString dumpstr( void ) const;
+		bool isComplete() const;
+		int nextBlock() const;
 	private:
-		enum {
-			UID0 = 0x00,
-			UID1 = 0x01,
-			UID2 = 0x02,
-			UID3 = 0x03,
-			clearcheckpage = 2,
-			startpage = 3,
-			finishpage = 4,
-			cnh = 20,
-			cnl = 21,
-			point = 22,
-			system2 = 23,
-			SI3 = 24,
-			SI2 = 25,
-			SI1 = 26,
-			SI0 = 27,
-			vumonth = 28,
-			vuyear = 29,
-			system1 = 30,
-			system0 = 31,
-			card9startpage = 14,
-			card8startpage = 34,
-			pcardstartpage = 44,
-			tcardstartpage = 14
-		};
+		void decodeHeader( const unsigned char *b );
+		void decodePunches( const unsigned char *b );
+		void decodeUserData( const unsigned char *b );
 };
 
 class SiCard6 : public SiCard
@@ -149,78 +165,17 @@ class SiCard6 : public SiCard
 		void resolveBackupBlocks( const QList<QByteArray> &blocks );
 		void reset();
 		void addBlock( int bn, const QByteArray &data128 );
-		QString dumpstr( void ) const;
 
 	private:
-		void addPunchBlock( int firstindex, const QByteArray &data );
-		void addInfoBlock1( const unsigned char *d );
-		void addInfoBlock2( const unsigned char *d );
-
-		enum {
-			CN3 = 0x0A,
-			CN2 = 0X0B,
-			CN1 = 0X0C,
-			CN0 = 0X0D,
-			punchingPointer = 0x10, // last punched control station ( 2 bytes ), punch count( 1 byte ), pc+1( 1byte )
-			finishstart = 0x14,
-			startstart = 0x18,
-			checkstart = 0x1C,
-			clearstart = 0x20,
-			startnumstart = 0x28,
-			contclassstart = 0x2c,
-			lastnamestart = 0x30,
-			firstnamestart = 0x44,
-			bla = 0x54,
-			countrystart = 0x58,
-			clubstart = 0x5C,
-			useridstart = 0x00,
-			phonestart = 0x10,
-			emailstart = 0x20,
-			streetstart = 0x44,
-			citystart = 0x58,
-			zipstart = 0x68,
-			sexstart = 0x70,
-			dayofbirthstart = 0x74,
-			dopstart = 0x7C
-		};
-		QString firstname, lastname, contclass;
-		QString country, club;
-		QString userid, phone, email, street, city, zip, dayofbirth;
-		unsigned char sex;
-		int startnum;
+		void addPunchBlock( int firstindex, const unsigned char *b );
+		void addInfoBlock1( const unsigned char *b );
+		void addInfoBlock2( const unsigned char *b );
 };
 
 class SiCard5 : public SiCard
 {
 	public:
 		SiCard5( const QByteArray &data128 );
-		QString dumpstr( void ) const;
-		
-	private:
-		enum Fields {
-			CI6 = 0x01,
-			CI5 = 0x02,
-			CI4 = 0x03,
-			CN1 = 0x04,
-			CN0 = 0x05,
-			CNS = 0x06,
-			SN1 = 0x11,
-			SN0 = 0x12,
-			ST2 = 0x13,
-			ST1 = 0x14,
-			FT2 = 0x15,
-			FT1 = 0x16,
-			PC = 0x17,
-			CT2 = 0x19,
-			CT1 = 0x1A,
-			SW = 0x1B,
-			SNS = 0x1C,
-			CS = 0x1D,
-		};
-
-		QByteArray rawdata;
-		int softwareversion;
-		int checksum;
 };
 
 class SiProto : public QObject {
@@ -265,9 +220,17 @@ class SiProto : public QObject {
 		bool StartGetPunchBackupData();
 		bool StartGetCardBackupData();
 		QList<PunchBackupData> GetPunchBackupData();
+		// Serial devices a station may be connected to
+		static QStringList fullDeviceList( void );
 		bool searchAndOpen( void );
+		// Time searchAndOpen() waits for stations to answer
+		void setSearchDeadline( int msecs ) { searchdeadline = msecs; }
 		void setFeedbackEnabled( bool enabled );
 		bool tryDevice( const QString &d );
+		bool openProbed( const SiProbeResult &r );
+		// Watches for stations being plugged in and out and reopens the
+		// station when it comes back, see sidevicemonitor.h
+		void setHotPlugEnabled( bool enabled );
 		bool trySettingsDevice( void );
 
 		bool SetMSMode( MSMode mode, bool block = true, int*cn=NULL );
@@ -280,22 +243,41 @@ class SiProto : public QObject {
 		bool GetTime( QDateTime *dt, int *cn = NULL );
 		bool SetTime( const QDateTime &sdt );
 		bool SetTime( const QDateTime &sdt, QDateTime *dt, int *cn = NULL );
+		// Sets the station to PC time by the estimate from the GetTime
+		// answers so far, see sitimesync.h
+		bool SyncTime();
+		SiTimeSync &timeSync() { return timesync; }
 		bool ResetBackup();
 		bool ResetBackup( int *cn );
 
+		void invalidateSystemInfo();
+
 		void stopTasks();
 
 		void setDoHandshake( bool v ) {
 			doHandshake = v;
 		}
-		static SiCard cardFromData( const QByteArray ba );
+		static SiCard cardFromData( const QByteArray &ba );
 
 		void setEventStartTime( const QDateTime &dt );
 
+		// Replaces the serial port, e.g. with a QSerialReplay. Takes
+		// ownership of dev.
+		void setDevice( QSerial *dev );
+		QSerial *device() const { return serial; }
+
+		// Punches sent by stations in autosend mode, see sipunch.h
+		SiPunchQueue &punchQueue() { return punchqueue; }
+
+		// Per stage card readout latency, see silatency.h
+		const SiLatency &readoutLatency() const { return latency; }
+		void resetReadoutLatency() { latency.reset(); }
+		// Dumps the readout latency with qDebug every msecs, 0 disables
+		void setLatencyDumpInterval( int msecs );
+
 	private:
 		void dumpBuffer( const QByteArray &buf, const QString &s );
 
-		QStringList fullDeviceList( void );
 		QStringList searchdevicelist;
 
 		QByteArray &addDLE( QByteArray &data );
@@ -310,9 +292,15 @@ class SiProto : public QObject {
 
 		bool getCommand( unsigned char &cmnd, QByteArray &data, int *cn = NULL );
 		bool readCommand( unsigned char &cmnd, QByteArray &data );
+		bool frameComplete();
 		bool GetDataFromBackup( unsigned int startaddr, unsigned int readsize );
 		bool GetDataFromBackup( unsigned int startaddr, unsigned int readsize, unsigned int *readaddr, QByteArray *ba, int *cn = NULL );
 		void updateSystemInfo(unsigned char addr, const QByteArray &data);
+		bool refreshSystemInfo();
+		bool tryFingerprint( const QString &d );
+		void updateDeviceInUse( const QString &opening = QString() );
+		void saveFingerprint( const QString &d, int speed, int stationcode );
+		void readCard6( unsigned char cardblocks );
 		void handlePunchBackupData( unsigned int addr, const QByteArray &data, int cn );
 		void handleCardBackupData( unsigned int addr, const QByteArray &data, QList<SiCard> *clist=NULL );
 
@@ -325,7 +313,19 @@ class SiProto : public QObject {
 
 			int backuprecordsize;
 			int backupreadsize;
+
+			// Cached system memory (0x00-0x7F) of the directly connected
+			// station. Read at open and by every full GetSystemValue, valid
+			// until invalidateSystemInfo(), e.g. by a SetSystemValue.
+			bool valid;
+			QByteArray memory;
 		} lastreadinfo;
+		// siMonotonicNsecs() when refreshSystemInfo() sent its request,
+		// -1 when no refresh is waiting for its reply
+		qint64 systeminforefresh;
+		// CommandReceivers waiting for their reply
+		int waitingcommands;
+		MSMode msmode;
 		int backupreadpointer;
 		int backupreadendaddr;
 	enum ProtocolCharacer {
@@ -340,6 +340,7 @@ class SiProto : public QObject {
 		BaseCommandSICard5Detected = 0x46,
 		BaseCommandSICard6Detected = 0x66,
 		BaseCommandGetSICard6 = 0x61,
+		BaseCommandTransmitRecord = 0x53,
 		BaseCommandSetMSMode = 0x70,
 		BaseCommandGetBackupData = 0x74,
 		BaseCommandEraseBackupData = 0x75,
@@ -355,6 +356,7 @@ class SiProto : public QObject {
 		CommandSICardRemoved = 0xE7,
 		CommandSICard89ptDetected = 0xE8,
 		CommandGetSICard89pt = 0xEF,
+		CommandTransmitRecord = 0xD3,
 		CommandSetMSMode = 0xF0,
 		CommandEraseBackupData = 0xF5,
 		CommandSetTime = 0xF6,
@@ -366,10 +368,15 @@ class SiProto : public QObject {
 		SICard5Inserted = 0x49,
 		SiCard5Removed = 0x4F
 	};
-	static QMap<int, int> baseCommands;
+	enum {
+		// Wait for the station known from last time, one round trip
+		FingerprintTimeout = 300
+	};
+	static int baseCommand( int cmnd );
 	static int timeoutforcommands;
+	int searchdeadline;
 
-	QSerial serial;
+	QSerial *serial;
 
 	bool extendedmode;
 	bool doHandshake;
@@ -379,6 +386,7 @@ class SiProto : public QObject {
 	bool readingpunchbackup;
 	bool readingcardbackup;
 	QByteArray sibuf;
+	int nakcount;
 
 	enum formatting_settings {
 		none,
@@ -396,6 +404,9 @@ class SiProto : public QObject {
 	bool STXtwice;
 	SiCard6 card6forread;
 	SiCard89pt card89ptforread;
+	// Set once card89ptforread was passed on, so a repeated last block is
+	// not read again
+	bool card89ptemitted;
 	int card6blocksread;
 	int card89blocksread;
 	QList<QByteArray> card6backupblocks;
@@ -405,8 +416,23 @@ class SiProto : public QObject {
 
 	QDateTime eventStartTime;
 
+	SiDeviceMonitor *devicemonitor;
+	SiPunchQueue punchqueue;
+
+	SiLatency latency;
+	qint64 framestart;
+	qint64 framedone;
+	qint64 lastrx;
+	qint64 timerequested;
+	SiTimeSync timesync;
+	QTimer *latencydumptimer;
+
 	private slots:
 		void serialReadyRead();
+		void dumpLatency();
+		void serialDisconnected();
+		void stationRemoved( const QString &device );
+		void stationFound( const SiProbeResult &r );
 
 	signals:
 		void sentCommand( unsigned char cmnd, const QByteArray &data );
@@ -414,9 +440,14 @@ class SiProto : public QObject {
 		void gotNAK();
 		void cardInserted( const QString &ver, const QVariant num );
 		void statusMessage( const QString &msg );
+		void stationConnected( const QString &device );
+		void stationDisconnected( const QString &device );
 		void cardRead( const SiCard & );
-		void backupCard( const SiCard * );
+		void backupCard( const SiCard & );
 		void backupPunch( const PunchBackupData & );
+		// count punches were added to punchQueue(), emitted once for all
+		// transmit records in a read
+		void punchesAvailable( int count );
 		void backupBlockNumFrom( int num, int from );
 
 		void gotTime( const QDateTime &dt, const QDateTime &ct, int cn );
@@ -2,14 +2,55 @@
 #define SIPROTO_P_H
 
 #include <QObject>
+#include <QSharedData>
+
+#include "siproto.h"
 
 class SiProto;
 
+class SiCardData : public QSharedData {
+	public:
+		SiCardData();
+
+		SiCard::CardType cardtype;
+		int countrycode;
+		int clubcode;
+		int cardnum;
+		int intcardnum;
+		int startnum;
+		PunchingRecord starttime;
+		PunchingRecord checktime;
+		PunchingRecord finishtime;
+		QDateTime fullstarttime, fullchecktime, fullfinishtime;
+		QList<PunchingRecord> punches;
+		int punchingcounter;
+		int blocksread; // Bit mask of the 8/9/p/t blocks read
+		QString name;
+
+		QDateTime inittime;
+		bool valid;
+
+		// Card 5
+		int softwareversion;
+		int checksum;
+
+		// Card 6 personal data, first and last name also for 8/9/p/t
+		QString firstname, lastname, contclass;
+		QString country, club;
+		QString userid, phone, email, street, city, zip, dayofbirth;
+		unsigned char sex;
+
+		QByteArray rawData;
+};
+
 class CommandReceiver : public QObject {
 	Q_OBJECT
 	public:
 		CommandReceiver( SiProto *si, unsigned char cmnd, QObject *parent = 0 );
 
+		// Takes only a GetSystemValue reply for addr with len bytes, not
+		// one to an earlier request
+		void expectSystemValue( unsigned char addr, unsigned char len );
 		bool waitForCommand( int timeoutms );
 
 		QByteArray data;
@@ -18,11 +59,15 @@ class CommandReceiver : public QObject {
 		bool extendedCommand;
 		bool haveit;
 		bool havenak;
+		int address;
+		int length;
 
 	public slots:
 		void gotCommand( unsigned char cmnd, const QByteArray &d, int cn );
 		void gotNAK();
 
+	private:
+		SiProto *proto;
 };
 
 #endif // SIPROTO_P_H
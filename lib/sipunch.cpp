@@ -0,0 +1,124 @@
+#include "sipunch.h"
+#include "silatency.h"
+
+extern int siCardNum( unsigned char SI0, unsigned char SI1, unsigned char SI2, unsigned char SI3 );
+
+bool SiPunch::fromTransmitRecord( const QByteArray &data, int cn, bool extended, SiPunch *p )
+{
+	const unsigned char *d = (const unsigned char *)data.constData();
+	unsigned char td, th, tl, tss = 0;
+	if ( extended ) {
+		// SI3 SI2 SI1 SI0 TD TH TL TSS MEM2 MEM1 MEM0
+		if ( data.length() < 11 )
+			return false;
+		p->cardnum = siCardNum( d[3], d[2], d[1], d[0] );
+		td = d[4]; th = d[5]; tl = d[6]; tss = d[7];
+		p->memaddr = (d[8]<<16)|(d[9]<<8)|d[10];
+	} else {
+		// SI2 SI1 SI0 TD TH TL
+		if ( data.length() < 6 )
+			return false;
+		p->cardnum = siCardNum( d[2], d[1], d[0], 0x00 );
+		td = d[3]; th = d[4]; tl = d[5];
+		p->memaddr = -1;
+	}
+	p->cn = cn;
+	p->dayofweek = (td>>1)&0x07;
+	p->weekcounter = (td>>4)&0x03;
+	// 0xEEEE is a punch without time
+	if ( th == 0xEE && tl == 0xEE ) {
+		p->msecs = -1;
+	} else {
+		p->msecs = ((th<<8)|tl)*1000+tss*1000/256;
+		if ( td & 0x01 )
+			p->msecs += 43200000;
+	}
+	p->received = siMonotonicNsecs();
+	return true;
+}
+
+SiPunchQueue::SiPunchQueue( int capacity ) :
+	ring( qMax( 1, capacity ) ),
+	head( 0 ),
+	size( 0 ),
+	npushed( 0 ),
+	ndropped( 0 ),
+	highwater( 0 )
+{
+}
+
+void SiPunchQueue::setCapacity( int capacity )
+{
+	QMutexLocker l( &lock );
+	capacity = qMax( 1, capacity );
+	QVector<SiPunch> n( capacity );
+	int keep = qMin( size, capacity );
+	for( int i=0;i<keep;i++ )
+		n[i] = ring.at( (head+i)%ring.size() );
+	ndropped += size-keep;
+	ring = n;
+	head = 0;
+	size = keep;
+}
+
+bool SiPunchQueue::push( const SiPunch &p )
+{
+	QMutexLocker l( &lock );
+	if ( size == ring.size() ) {
+		ndropped++;
+		return false;
+	}
+	ring[(head+size)%ring.size()] = p;
+	size++;
+	npushed++;
+	if ( size > highwater )
+		highwater = size;
+	return true;
+}
+
+QList<SiPunch> SiPunchQueue::take( int max )
+{
+	QMutexLocker l( &lock );
+	int n = ( max < 0 || max > size ) ? size : max;
+	QList<SiPunch> r;
+	r.reserve( n );
+	for( int i=0;i<n;i++ )
+		r.append( ring.at( (head+i)%ring.size() ) );
+	if ( n ) {
+		head = (head+n)%ring.size();
+		size -= n;
+	}
+	return r;
+}
+
+int SiPunchQueue::count() const
+{
+	QMutexLocker l( &lock );
+	return size;
+}
+
+quint64 SiPunchQueue::pushed() const
+{
+	QMutexLocker l( &lock );
+	return npushed;
+}
+
+quint64 SiPunchQueue::dropped() const
+{
+	QMutexLocker l( &lock );
+	return ndropped;
+}
+
+int SiPunchQueue::highWater() const
+{
+	QMutexLocker l( &lock );
+	return highwater;
+}
+
+void SiPunchQueue::resetCounters()
+{
+	QMutexLocker l( &lock );
+	npushed = 0;
+	ndropped = 0;
+	highwater = size;
+}
@@ -0,0 +1,71 @@
+#ifndef SIPUNCH_H
+#define SIPUNCH_H
+
+#include <QByteArray>
+#include <QList>
+#include <QMetaType>
+#include <QMutex>
+#include <QTime>
+#include <QVector>
+
+// Punch sent online by a station in autosend mode (transmit record 0xD3,
+// 0x53 in the base protocol), e.g. a radio control or a SRR receiver.
+class SiPunch {
+	public:
+		SiPunch() :
+			cardnum( 0 ), cn( 0 ), msecs( -1 ), dayofweek( 0 ),
+			weekcounter( 0 ), memaddr( -1 ), received( -1 ), station( 0 )
+			{}
+
+		// data is the frame without command and station code
+		static bool fromTransmitRecord( const QByteArray &data, int cn, bool extended, SiPunch *p );
+
+		bool hasTime() const { return msecs >= 0; }
+		QTime time() const { return hasTime() ? QTime( 0, 0 ).addMSecs( msecs ) : QTime(); }
+
+		int cardnum;
+		int cn;
+		int msecs;		// since midnight, 1/256 s resolution, -1 without time
+		unsigned char dayofweek;	// 0-Sun
+		unsigned char weekcounter;
+		int memaddr;	// backup memory address of the record, -1 in base mode
+		qint64 received;	// siMonotonicNsecs() when the frame was complete
+		int station;	// StationPool id of the session that read it, 0 outside a pool
+};
+Q_DECLARE_METATYPE(SiPunch)
+
+// Bounded FIFO between the serial reader and whoever stores the punches.
+// When it is full new punches are dropped and counted rather than growing
+// without limit; memaddr tells where to get them from the station backup.
+class SiPunchQueue {
+	public:
+		SiPunchQueue( int capacity = 4096 );
+
+		void setCapacity( int capacity );
+		int capacity() const { return ring.size(); }
+
+		// false when the queue was full and p was dropped
+		bool push( const SiPunch &p );
+		// Up to max punches, oldest first, max < 0 takes all
+		QList<SiPunch> take( int max = -1 );
+
+		int count() const;
+		bool isEmpty() const { return count() == 0; }
+
+		quint64 pushed() const;
+		quint64 dropped() const;
+		// Highest fill level since the last resetCounters()
+		int highWater() const;
+		void resetCounters();
+
+	private:
+		mutable QMutex lock;
+		QVector<SiPunch> ring;
+		int head;
+		int size;
+		quint64 npushed;
+		quint64 ndropped;
+		int highwater;
+};
+
+#endif
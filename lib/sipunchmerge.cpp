@@ -0,0 +1,150 @@
+#include "sipunchmerge.h"
+#include "siarchive.h"
+#include "stationpool.h"
+
+uint qHash( const SiPunchMerge::Key &k )
+{
+	return qHash( k.time ) ^ ( k.cardnum*31 ) ^ ( k.cn << 22 );
+}
+
+SiPunchMerge::SiPunchMerge( QObject *parent ) :
+	QObject( parent ),
+	npunches( 0 ),
+	nduplicates( 0 )
+{
+}
+
+void SiPunchMerge::add( int station, const PunchBackupData &p )
+{
+	Entry e;
+	e.station = station;
+	e.time = SiArchive::timeOf( p.d, p.t );
+	e.punch = p;
+	QMap<int, int>::const_iterator it = lastrun.constFind( station );
+	// A backup wrapping around goes back in time, that starts another run
+	if ( it == lastrun.constEnd() || runs.at( *it ).last().time > e.time ) {
+		runs.append( Run() );
+		lastrun.insert( station, runs.count()-1 );
+	}
+	runs[lastrun.value( station )].append( e );
+}
+
+void SiPunchMerge::clear()
+{
+	runs.clear();
+	lastrun.clear();
+	seen.clear();
+	percard.clear();
+	npunches = 0;
+	nduplicates = 0;
+}
+
+bool SiPunchMerge::before( int a, int b ) const
+{
+	qint64 ta = runs.at(a).at( runpos.at(a) ).time;
+	qint64 tb = runs.at(b).at( runpos.at(b) ).time;
+	return ta < tb || ( ta == tb && a < b );
+}
+
+void SiPunchMerge::heapDown( QVector<int> &heap, int i ) const
+{
+	int n = heap.count();
+	while( true ) {
+		int m = i;
+		int l = 2*i+1;
+		if ( l < n && before( heap.at(l), heap.at(m) ) )
+			m = l;
+		if ( l+1 < n && before( heap.at(l+1), heap.at(m) ) )
+			m = l+1;
+		if ( m == i )
+			return;
+		qSwap( heap[i], heap[m] );
+		i = m;
+	}
+}
+
+void SiPunchMerge::appendToCard( const Entry &e )
+{
+	QList<Entry> &l = percard[e.punch.cardnum];
+	// Merged punches come in time order, earlier merges may be later
+	int i = l.count();
+	while( i > 0 && l.at( i-1 ).time > e.time )
+		i--;
+	l.insert( i, e );
+}
+
+int SiPunchMerge::merge()
+{
+	int k = runs.count();
+	if ( !k )
+		return 0;
+	runpos.fill( 0, k );
+	QVector<int> heap;
+	heap.reserve( k );
+	for( int i=0;i<k;i++ )
+		heap.append( i );
+	for( int i=k/2-1;i>=0;i-- )
+		heapDown( heap, i );
+
+	int added = 0;
+	while( !heap.isEmpty() ) {
+		int r = heap.at(0);
+		const Entry &e = runs.at(r).at( runpos[r]++ );
+		Key key;
+		key.cn = e.punch.cn;
+		key.cardnum = e.punch.cardnum;
+		key.time = e.time;
+		if ( seen.contains( key ) ) {
+			nduplicates++;
+		} else {
+			seen.insert( key );
+			appendToCard( e );
+			added++;
+		}
+		if ( runpos.at(r) == runs.at(r).count() ) {
+			heap[0] = heap.last();
+			heap.resize( heap.count()-1 );
+		}
+		if ( !heap.isEmpty() )
+			heapDown( heap, 0 );
+	}
+	runs.clear();
+	lastrun.clear();
+	npunches += added;
+	if ( added )
+		emit merged( added );
+	return added;
+}
+
+QList<int> SiPunchMerge::cards()
+{
+	merge();
+	return percard.keys();
+}
+
+QList<SiPunchMerge::Entry> SiPunchMerge::card( int cardnum )
+{
+	merge();
+	return percard.value( cardnum );
+}
+
+void SiPunchMerge::attach( SiProto *si, int station )
+{
+	stations.insert( si, station );
+	connect( si, SIGNAL( backupPunch(const PunchBackupData &) ), this, SLOT( backupPunch(const PunchBackupData &) ) );
+}
+
+void SiPunchMerge::attach( StationPool *pool )
+{
+	connect( pool, SIGNAL( backupPunch(int, const PunchBackupData &) ), this, SLOT( poolBackupPunch(int, const PunchBackupData &) ) );
+}
+
+void SiPunchMerge::backupPunch( const PunchBackupData &p )
+{
+	add( stations.value( sender() ), p );
+}
+
+void SiPunchMerge::poolBackupPunch( int station, const PunchBackupData &p )
+{
+	add( station, p );
+}
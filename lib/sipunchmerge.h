@@ -0,0 +1,84 @@
+#ifndef SIPUNCHMERGE_H
+#define SIPUNCHMERGE_H
+
+#include <QObject>
+#include <QMap>
+#include <QSet>
+#include <QVector>
+
+#include "siproto.h"
+
+class StationPool;
+
+// Merges the backup punches of many stations into one time ordered list
+// per card.
+//
+// Every station delivers its backup in memory order, which is also time
+// order, so each station is a sorted run. merge() combines the runs added
+// since the last call with a heap, O(n log k) for k runs, and moves the
+// result into the per card lists. A punch already seen with the same
+// control code, card and time, e.g. from reading the same backup again,
+// is dropped. More backups can be added and merged at any time.
+
+class SiPunchMerge : public QObject
+{
+	Q_OBJECT
+
+	public:
+		struct Entry {
+			int station;
+			qint64 time;	// SiArchive::timeOf() the punch
+			PunchBackupData punch;
+		};
+
+		SiPunchMerge( QObject *parent = 0 );
+
+		void add( int station, const PunchBackupData &p );
+		// Merges what was added since, returns the number of new punches
+		int merge();
+		void clear();
+
+		// Cards with punches, ascending
+		QList<int> cards();
+		// Punches of cardnum in time order
+		QList<Entry> card( int cardnum );
+		int count() const { return npunches; }
+		int duplicates() const { return nduplicates; }
+
+		void attach( SiProto *si, int station );
+		void attach( StationPool *pool );
+
+	public slots:
+		void backupPunch( const PunchBackupData &p );
+		void poolBackupPunch( int station, const PunchBackupData &p );
+
+	signals:
+		void merged( int count );
+
+	private:
+		struct Key {
+			int cn;
+			int cardnum;
+			qint64 time;
+			bool operator==( const Key &o ) const {
+				return cn == o.cn && cardnum == o.cardnum && time == o.time;
+			}
+		};
+		friend uint qHash( const SiPunchMerge::Key &k );
+		typedef QVector<Entry> Run;
+
+		bool before( int a, int b ) const;
+		void heapDown( QVector<int> &heap, int i ) const;
+		void appendToCard( const Entry &e );
+
+		QList<Run> runs;
+		QVector<int> runpos;
+		QMap<int, int> lastrun;	// station -> run still being added to
+		QSet<Key> seen;
+		QMap<int, QList<Entry> > percard;
+		QMap<QObject *, int> stations;
+		int npunches;
+		int nduplicates;
+};
+
+#endif
@@ -0,0 +1,286 @@
+#include "siresults.h"
+
+#include <QStringList>
+
+SiRankTree::SiRankTree() :
+	root( -1 ),
+	seed( 2463534242U )
+{
+}
+
+void SiRankTree::clear()
+{
+	nodes.clear();
+	freenodes.clear();
+	root = -1;
+}
+
+void SiRankTree::update( int n )
+{
+	Node &x = nodes[n];
+	x.size = 1+size( x.left )+size( x.right );
+}
+
+void SiRankTree::split( int t, qint64 time, int card, int *l, int *r )
+{
+	if ( t < 0 ) {
+		*l = *r = -1;
+		return;
+	}
+	if ( less( time, card, nodes.at(t) ) ) {
+		int rl;
+		split( nodes.at(t).left, time, card, l, &rl );
+		nodes[t].left = rl;
+		*r = t;
+	} else {
+		int lr;
+		split( nodes.at(t).right, time, card, &lr, r );
+		nodes[t].right = lr;
+		*l = t;
+	}
+	update( t );
+}
+
+int SiRankTree::merge( int l, int r )
+{
+	if ( l < 0 )
+		return r;
+	if ( r < 0 )
+		return l;
+	if ( nodes.at(l).prio > nodes.at(r).prio ) {
+		nodes[l].right = merge( nodes.at(l).right, r );
+		update( l );
+		return l;
+	}
+	nodes[r].left = merge( l, nodes.at(r).left );
+	update( r );
+	return r;
+}
+
+void SiRankTree::insert( qint64 time, int cardnum )
+{
+	// xorshift, the treap only needs the priorities to be unrelated to keys
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+	Node n;
+	n.time = time;
+	n.card = cardnum;
+	n.prio = seed;
+	n.left = n.right = -1;
+	n.size = 1;
+	int idx;
+	if ( freenodes.isEmpty() ) {
+		idx = nodes.count();
+		nodes.append( n );
+	} else {
+		idx = freenodes.last();
+		freenodes.resize( freenodes.count()-1 );
+		nodes[idx] = n;
+	}
+	int l, r;
+	split( root, time, cardnum, &l, &r );
+	root = merge( merge( l, idx ), r );
+}
+
+void SiRankTree::erase( qint64 time, int cardnum )
+{
+	// Path to the node, parents are updated on the way back
+	QVector<int> path;
+	int t = root;
+	while( t >= 0 && ( nodes.at(t).time != time || nodes.at(t).card != cardnum ) ) {
+		path.append( t );
+		t = less( time, cardnum, nodes.at(t) ) ? nodes.at(t).left : nodes.at(t).right;
+	}
+	if ( t < 0 )
+		return;
+	int m = merge( nodes.at(t).left, nodes.at(t).right );
+	freenodes.append( t );
+	if ( path.isEmpty() ) {
+		root = m;
+		return;
+	}
+	int p = path.last();
+	if ( nodes.at(p).left == t )
+		nodes[p].left = m;
+	else
+		nodes[p].right = m;
+	for( int i=path.count()-1;i>=0;i-- )
+		update( path.at(i) );
+}
+
+int SiRankTree::rank( qint64 time, int cardnum ) const
+{
+	int pos = 0;
+	int t = root;
+	while( t >= 0 ) {
+		const Node &n = nodes.at(t);
+		if ( n.time == time && n.card == cardnum )
+			return pos+size( n.left )+1;
+		if ( less( time, cardnum, n ) ) {
+			t = n.left;
+		} else {
+			pos += size( n.left )+1;
+			t = n.right;
+		}
+	}
+	return 0;
+}
+
+int SiRankTree::select( int pos ) const
+{
+	int t = root;
+	while( t >= 0 ) {
+		const Node &n = nodes.at(t);
+		int ls = size( n.left );
+		if ( pos <= ls ) {
+			t = n.left;
+		} else if ( pos == ls+1 ) {
+			return n.card;
+		} else {
+			pos -= ls+1;
+			t = n.right;
+		}
+	}
+	return 0;
+}
+
+SiResults::SiResults( QObject *parent ) :
+	QObject( parent )
+{
+	qRegisterMetaType<SiResultDelta>( "SiResultDelta" );
+}
+
+void SiResults::setCourse( const QString &cls, const SiCourse &course )
+{
+	classmap[cls].course = course;
+}
+
+QStringList SiResults::classes() const
+{
+	return classmap.keys();
+}
+
+void SiResults::unrank( Class &c, int cardnum )
+{
+	QHash<int, Runner>::iterator it = c.runners.find( cardnum );
+	if ( it == c.runners.end() )
+		return;
+	if ( it->ok ) {
+		c.total.erase( it->time, cardnum );
+		for( int i=0;i<it->legs.count();i++ ) {
+			if ( it->ranked.at(i) )
+				c.legs[it->legs.at(i)].erase( it->legtimes.at(i), cardnum );
+		}
+	}
+	c.runners.erase( it );
+}
+
+SiResultDelta SiResults::addCard( const SiCard &card, const QString &clsname )
+{
+	SiResultDelta d;
+	d.cls = clsname.isEmpty() ? card.getClass() : clsname;
+	d.cardnum = card.getCardNumber();
+	Class &c = classmap[d.cls];
+	unrank( c, d.cardnum );
+
+	SiCourse::Result r = c.course.match( card );
+	Runner run;
+	run.ok = r.ok && r.runningtime >= 0;
+	run.time = r.runningtime;
+	int from = Start;
+	for( int i=0;i<r.splits.count();i++ ) {
+		run.legs.append( SiLeg( from, r.splits.at(i).cn ) );
+		run.legtimes.append( r.splits.at(i).leg );
+		from = r.splits.at(i).cn;
+	}
+	// The last leg is to the finish
+	run.legs.append( SiLeg( from, Finish ) );
+	if ( r.runningtime >= 0 && ( r.splits.isEmpty() || r.splits.last().time >= 0 ) )
+		run.legtimes.append( r.runningtime-( r.splits.isEmpty() ? 0 : r.splits.last().time ) );
+	else
+		run.legtimes.append( -1 );
+	run.ranked.fill( false, run.legs.count() );
+
+	d.ok = run.ok;
+	d.time = run.time;
+	d.legs = run.legs;
+	d.legtimes = run.legtimes;
+	d.legpositions.fill( 0, run.legs.count() );
+	if ( run.ok ) {
+		c.total.insert( run.time, d.cardnum );
+		d.position = c.total.rank( run.time, d.cardnum );
+		for( int i=0;i<run.legs.count();i++ ) {
+			if ( run.legtimes.at(i) < 0 || run.legs.indexOf( run.legs.at(i) ) < i )
+				continue;
+			SiRankTree &t = c.legs[run.legs.at(i)];
+			t.insert( run.legtimes.at(i), d.cardnum );
+			run.ranked[i] = true;
+			d.legpositions[i] = t.rank( run.legtimes.at(i), d.cardnum );
+		}
+	}
+	c.runners.insert( d.cardnum, run );
+	d.runners = c.total.count();
+	emit resultChanged( d );
+	return d;
+}
+
+void SiResults::removeCard( const QString &cls, int cardnum )
+{
+	QMap<QString, Class>::iterator it = classmap.find( cls );
+	if ( it == classmap.end() || !it->runners.contains( cardnum ) )
+		return;
+	unrank( *it, cardnum );
+	SiResultDelta d;
+	d.cls = cls;
+	d.cardnum = cardnum;
+	d.runners = it->total.count();
+	emit resultChanged( d );
+}
+
+int SiResults::runners( const QString &cls ) const
+{
+	QMap<QString, Class>::const_iterator it = classmap.constFind( cls );
+	return it == classmap.constEnd() ? 0 : it->total.count();
+}
+
+int SiResults::position( const QString &cls, int cardnum ) const
+{
+	QMap<QString, Class>::const_iterator it = classmap.constFind( cls );
+	if ( it == classmap.constEnd() )
+		return 0;
+	QHash<int, Runner>::const_iterator r = it->runners.constFind( cardnum );
+	if ( r == it->runners.constEnd() || !r->ok )
+		return 0;
+	return it->total.rank( r->time, cardnum );
+}
+
+int SiResults::cardAt( const QString &cls, int pos ) const
+{
+	QMap<QString, Class>::const_iterator it = classmap.constFind( cls );
+	return it == classmap.constEnd() ? 0 : it->total.select( pos );
+}
+
+int SiResults::legPosition( const QString &cls, const SiLeg &leg, int cardnum ) const
+{
+	QMap<QString, Class>::const_iterator it = classmap.constFind( cls );
+	if ( it == classmap.constEnd() )
+		return 0;
+	QHash<int, Runner>::const_iterator r = it->runners.constFind( cardnum );
+	if ( r == it->runners.constEnd() || !r->ok )
+		return 0;
+	int i = r->legs.indexOf( leg );
+	QMap<SiLeg, SiRankTree>::const_iterator l = it->legs.constFind( leg );
+	if ( i < 0 || !r->ranked.at(i) || l == it->legs.constEnd() )
+		return 0;
+	return l->rank( r->legtimes.at(i), cardnum );
+}
+
+int SiResults::cardAtLeg( const QString &cls, const SiLeg &leg, int pos ) const
+{
+	QMap<QString, Class>::const_iterator it = classmap.constFind( cls );
+	if ( it == classmap.constEnd() )
+		return 0;
+	QMap<SiLeg, SiRankTree>::const_iterator l = it->legs.constFind( leg );
+	return l == it->legs.constEnd() ? 0 : l->select( pos );
+}
@@ -0,0 +1,135 @@
+#ifndef SIRESULTS_H
+#define SIRESULTS_H
+
+#include <QObject>
+#include <QHash>
+#include <QMap>
+#include <QPair>
+#include <QVector>
+
+#include "sicourse.h"
+
+// Order statistic tree (a treap with subtree sizes) of (time, card)
+// pairs, ordered by time and then card number. Insert, erase, rank and
+// select are O(log n). Nodes live in one array and are reused.
+class SiRankTree
+{
+	public:
+		SiRankTree();
+
+		void insert( qint64 time, int cardnum );
+		void erase( qint64 time, int cardnum );
+		// 1 based position of the pair, 0 when it is not in the tree
+		int rank( qint64 time, int cardnum ) const;
+		// Card at 1 based position pos, 0 when there is none
+		int select( int pos ) const;
+		int count() const { return root < 0 ? 0 : nodes.at( root ).size; }
+		void clear();
+
+	private:
+		struct Node {
+			qint64 time;
+			int card;
+			quint32 prio;
+			int left, right;
+			int size;
+		};
+
+		bool less( qint64 time, int card, const Node &n ) const {
+			return time < n.time || ( time == n.time && card < n.card );
+		}
+		int size( int n ) const { return n < 0 ? 0 : nodes.at(n).size; }
+		void update( int n );
+		// Splits t into the pairs up to (time, card) and those after it
+		void split( int t, qint64 time, int card, int *l, int *r );
+		int merge( int l, int r );
+
+		QVector<Node> nodes;
+		QVector<int> freenodes;
+		int root;
+		quint32 seed;
+};
+
+// A leg by the controls it runs between, SiResults::Start and
+// SiResults::Finish for the ends
+typedef QPair<int, int> SiLeg;
+
+// What changed in the results when a card was added
+struct SiResultDelta {
+	SiResultDelta() :
+		cardnum( 0 ), ok( false ), time( -1 ), position( 0 ), runners( 0 )
+		{}
+	QString cls;
+	int cardnum;
+	bool ok;
+	qint64 time;		// running time in msecs
+	int position;		// 0 when not ranked
+	int runners;		// ranked in the class
+	QVector<SiLeg> legs;
+	QVector<qint64> legtimes;
+	QVector<int> legpositions;
+};
+Q_DECLARE_METATYPE(SiResultDelta)
+
+// Results per class kept up to date card by card. Every card is matched
+// against the course of its class and its running time and leg times go
+// into rank trees, so adding or replacing a card costs O(log n) per leg
+// instead of sorting the class again, and the new positions are published
+// as a delta. Only cards without missing controls are ranked.
+//
+// Legs are ranked by the pair of controls they run between, not by their
+// place on the course, so free order, score and butterfly parts compare
+// runners who took the same leg whenever they took it.
+class SiResults : public QObject
+{
+	Q_OBJECT
+
+	public:
+		enum {
+			Start = 0,
+			Finish = -1
+		};
+
+		SiResults( QObject *parent = 0 );
+
+		void setCourse( const QString &cls, const SiCourse &course );
+		QStringList classes() const;
+
+		// cls defaults to the class stored on the card. A card read again
+		// replaces its earlier result.
+		SiResultDelta addCard( const SiCard &card, const QString &cls = QString() );
+		void removeCard( const QString &cls, int cardnum );
+
+		int runners( const QString &cls ) const;
+		int position( const QString &cls, int cardnum ) const;
+		// Card at position, 1 based
+		int cardAt( const QString &cls, int position ) const;
+		int legPosition( const QString &cls, const SiLeg &leg, int cardnum ) const;
+		int cardAtLeg( const QString &cls, const SiLeg &leg, int position ) const;
+
+	signals:
+		void resultChanged( const SiResultDelta &delta );
+
+	private:
+		struct Runner {
+			bool ok;
+			qint64 time;
+			QVector<SiLeg> legs;
+			QVector<qint64> legtimes;
+			// Whether the leg went into its tree, a leg run twice is
+			// ranked the first time only
+			QVector<bool> ranked;
+		};
+		struct Class {
+			SiCourse course;
+			SiRankTree total;
+			QMap<SiLeg, SiRankTree> legs;
+			QHash<int, Runner> runners;
+		};
+
+		void unrank( Class &c, int cardnum );
+
+		QMap<QString, Class> classmap;
+};
+
+#endif
@@ -0,0 +1,97 @@
+#include "sitimesync.h"
+
+#include <QtAlgorithms>
+
+namespace {
+
+struct ByRtt {
+	template <typename T> bool operator()( const T &a, const T &b ) const {
+		return a.rtt < b.rtt;
+	}
+};
+
+struct ByOffset {
+	template <typename T> bool operator()( const T &a, const T &b ) const {
+		return a.offset < b.offset;
+	}
+};
+
+}
+
+SiTimeSync::SiTimeSync() :
+	lastrtt( 0 ),
+	corr( 0 )
+{
+}
+
+void SiTimeSync::reset()
+{
+	if ( !samples.isEmpty() )
+		lastrtt = roundTrip();
+	samples.clear();
+}
+
+void SiTimeSync::addSample( const QDateTime &station, const QDateTime &pc, qint64 rtt )
+{
+	if ( !station.isValid() || !pc.isValid() || rtt < 0 )
+		return;
+	// Stations do not always know the date, the time of day is compared
+	qint64 off = pc.time().msecsTo( station.time() );
+	if ( off > 43200000 )
+		off -= 86400000;
+	else if ( off < -43200000 )
+		off += 86400000;
+	Sample s;
+	s.offset = off;
+	s.rtt = rtt;
+	if ( samples.count() >= MaxSamples )
+		samples.remove( 0 );
+	samples.append( s );
+}
+
+// Like the NTP clock filter the quickest round trips are trusted most:
+// the faster half is kept and of that whatever took more than twice the
+// fastest plus a millisecond is dropped too.
+QVector<SiTimeSync::Sample> SiTimeSync::good() const
+{
+	QVector<Sample> s = samples;
+	qSort( s.begin(), s.end(), ByRtt() );
+	int n = ( s.count()+1 )/2;
+	while( n > 1 && s.at( n-1 ).rtt > 2*s.at(0).rtt+1000000 )
+		n--;
+	s.resize( n );
+	return s;
+}
+
+qint64 SiTimeSync::offset() const
+{
+	if ( samples.isEmpty() )
+		return 0;
+	QVector<Sample> s = good();
+	qSort( s.begin(), s.end(), ByOffset() );
+	int n = s.count();
+	return n & 1 ? s.at( n/2 ).offset : ( s.at( n/2-1 ).offset+s.at( n/2 ).offset )/2;
+}
+
+qint64 SiTimeSync::roundTrip() const
+{
+	if ( samples.isEmpty() )
+		return lastrtt;
+	QVector<Sample> s = good();
+	qint64 sum = 0;
+	for( int i=0;i<s.count();i++ )
+		sum += s.at(i).rtt;
+	return sum/s.count();
+}
+
+QDateTime SiTimeSync::setTimeArgument( const QDateTime &now, qint64 transmit ) const
+{
+	return now.addMSecs( ( transmit+roundTrip()/2 )/1000000-corr );
+}
+
+void SiTimeSync::learnCorrection()
+{
+	if ( samples.isEmpty() )
+		return;
+	corr += offset();
+}
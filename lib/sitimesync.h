@@ -0,0 +1,62 @@
+#ifndef SITIMESYNC_H
+#define SITIMESYNC_H
+
+#include <QDateTime>
+#include <QVector>
+
+// Offset of a station clock from the PC, estimated the way NTP does.
+//
+// Every GetTime gives a sample: the station time and the PC time halfway
+// between the request leaving the port and the answer arriving, both taken
+// as monotonic timestamps next to the write() and read() calls. Samples
+// with long round trips were delayed somewhere and are dropped, the offset
+// is the median of the rest.
+//
+// setTimeArgument() is what to pass to SetTime so the station ends up on
+// PC time: now, plus the time the frame takes on the wire, plus half a
+// round trip, less the offset the station still showed after the last
+// SetTime (see learnCorrection()).
+
+class SiTimeSync
+{
+	public:
+		enum {
+			MaxSamples = 32
+		};
+
+		SiTimeSync();
+
+		// Forgets the samples, e.g. after the station clock was set.
+		// The round trip and the correction are kept.
+		void reset();
+		// pc is the PC time when the station read its clock, rtt in nsecs
+		void addSample( const QDateTime &station, const QDateTime &pc, qint64 rtt );
+		int count() const { return samples.count(); }
+		bool isValid() const { return !samples.isEmpty(); }
+
+		// station-PC msecs
+		qint64 offset() const;
+		// nsecs, of the samples used for offset()
+		qint64 roundTrip() const;
+
+		// transmit is the nsecs the SetTime frame takes on the wire
+		QDateTime setTimeArgument( const QDateTime &now, qint64 transmit ) const;
+		// Adds the current offset to the next setTimeArgument(), to be
+		// called with samples taken after a SetTime
+		void learnCorrection();
+		qint64 correction() const { return corr; }
+
+	private:
+		struct Sample {
+			qint64 offset;
+			qint64 rtt;
+		};
+		// The samples kept after dropping slow round trips
+		QVector<Sample> good() const;
+
+		QVector<Sample> samples;
+		qint64 lastrtt;
+		qint64 corr;
+};
+
+#endif
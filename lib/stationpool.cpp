@@ -0,0 +1,256 @@
+#include "stationpool.h"
+#include "stationpool_p.h"
+#include "sidevicemonitor.h"
+
+#include <QThread>
+
+StationSession::StationSession( int i, const QString &d, const SiProbeResult &p, SiPunchQueue *q ) :
+	id( i ),
+	device( d ),
+	probed( p ),
+	si( NULL ),
+	punches( q )
+{
+}
+
+void StationSession::open()
+{
+	si = new SiProto( this );
+	connect( si, SIGNAL( cardRead(const SiCard &) ), this, SLOT( gotCard(const SiCard &) ) );
+	connect( si, SIGNAL( backupCard(const SiCard &) ), this, SLOT( gotBackupCard(const SiCard &) ) );
+	connect( si, SIGNAL( backupPunch(const PunchBackupData &) ),
+			this, SLOT( gotBackupPunch(const PunchBackupData &) ) );
+	connect( si, SIGNAL( statusMessage(const QString &) ), this, SLOT( gotStatus(const QString &) ) );
+	connect( si, SIGNAL( punchesAvailable(int) ), this, SLOT( gotPunches() ) );
+	connect( si, SIGNAL( stationDisconnected(const QString &) ), this, SLOT( disconnected() ) );
+	bool ok;
+	if ( probed.speed )
+		ok = si->openProbed( probed );
+	else
+		ok = si->tryDevice( device );
+	if ( !ok ) {
+		close();
+		return;
+	}
+	emit opened( id, device );
+}
+
+void StationSession::close()
+{
+	if ( !si )
+		return;
+	if ( si->device()->isOpen() )
+		si->device()->close();
+	// May be called from a signal of si
+	si->deleteLater();
+	si = NULL;
+	emit closed( id, device );
+}
+
+void StationSession::gotCard( const SiCard &card )
+{
+	emit cardRead( id, card );
+}
+
+void StationSession::gotBackupCard( const SiCard &card )
+{
+	emit backupCard( id, card );
+}
+
+void StationSession::gotBackupPunch( const PunchBackupData &punch )
+{
+	emit backupPunch( id, punch );
+}
+
+// Moves the punches on to the pool queue, which drops what does not fit
+void StationSession::gotPunches()
+{
+	QList<SiPunch> l = si->punchQueue().take();
+	int n = 0;
+	for( int i=0;i<l.count();i++ ) {
+		l[i].station = id;
+		if ( punches->push( l.at(i) ) )
+			n++;
+	}
+	if ( n )
+		emit punchesAvailable( id, n );
+}
+
+void StationSession::gotStatus( const QString &msg )
+{
+	emit statusMessage( id, msg );
+}
+
+void StationSession::disconnected()
+{
+	close();
+}
+
+StationPool::StationPool( int threads, QObject *parent ) :
+	QObject( parent ),
+	nextid( 1 ),
+	devicemonitor( NULL )
+{
+	for( int i=0;i<threads;i++ ) {
+		QThread *t = new QThread( this );
+		t->start();
+		workers.append( t );
+	}
+}
+
+StationPool::~StationPool()
+{
+	delete devicemonitor;
+	QList<StationSession *> l = sessions.values();
+	sessions.clear();
+	for( int i=0;i<l.count();i++ )
+		closeSession( l.at(i) );
+	for( int i=0;i<workers.count();i++ ) {
+		workers.at(i)->quit();
+		workers.at(i)->wait();
+	}
+	for( int i=0;i<l.count();i++ )
+		delete l.at(i);
+}
+
+int StationPool::addStation( const QString &device )
+{
+	return addSession( new StationSession( nextid++, device, SiProbeResult(), &punches ) );
+}
+
+int StationPool::addStation( const SiProbeResult &probed )
+{
+	return addSession( new StationSession( nextid++, probed.device, probed, &punches ) );
+}
+
+int StationPool::addSession( StationSession *s )
+{
+	sessions.insert( s->id, s );
+	updateDevicesInUse();
+	connect( s, SIGNAL( opened(int, const QString &) ),
+			this, SIGNAL( stationOpened(int, const QString &) ) );
+	connect( s, SIGNAL( closed(int, const QString &) ),
+			this, SLOT( sessionClosed(int, const QString &) ) );
+	connect( s, SIGNAL( cardRead(int, const SiCard &) ),
+			this, SIGNAL( cardRead(int, const SiCard &) ) );
+	connect( s, SIGNAL( backupCard(int, const SiCard &) ),
+			this, SIGNAL( backupCard(int, const SiCard &) ) );
+	connect( s, SIGNAL( backupPunch(int, const PunchBackupData &) ),
+			this, SIGNAL( backupPunch(int, const PunchBackupData &) ) );
+	connect( s, SIGNAL( punchesAvailable(int, int) ),
+			this, SIGNAL( punchesAvailable(int, int) ) );
+	connect( s, SIGNAL( statusMessage(int, const QString &) ),
+			this, SIGNAL( statusMessage(int, const QString &) ) );
+	if ( !workers.isEmpty() )
+		s->moveToThread( workers.at( s->id%workers.count() ) );
+	// Opening blocks until the station answered, keep that out of here
+	QMetaObject::invokeMethod( s, "open", Qt::QueuedConnection );
+	return s->id;
+}
+
+void StationPool::removeStation( int station )
+{
+	StationSession *s = sessions.value( station );
+	if ( s )
+		QMetaObject::invokeMethod( s, "close", Qt::QueuedConnection );
+}
+
+void StationPool::closeSession( StationSession *s )
+{
+	if ( s->thread() == QThread::currentThread() )
+		s->close();
+	else
+		QMetaObject::invokeMethod( s, "close", Qt::BlockingQueuedConnection );
+}
+
+void StationPool::sessionClosed( int station, const QString &device )
+{
+	StationSession *s = sessions.take( station );
+	if ( !s )
+		return;
+	s->deleteLater();
+	updateDevicesInUse();
+	emit stationClosed( station, device );
+}
+
+int StationPool::addAll( int deadline )
+{
+	QStringList dl = SiProto::fullDeviceList();
+	for( int i=dl.count()-1;i>=0;i-- ) {
+		QMap<int, StationSession *>::const_iterator it;
+		for( it=sessions.constBegin();it!=sessions.constEnd();++it ) {
+			if ( it.value()->device == dl.at(i) ) {
+				dl.removeAt( i );
+				break;
+			}
+		}
+	}
+	QList<SiProbeResult> found = SiProbe::probe( dl, deadline, SiProbe::AllFound );
+	for( int i=0;i<found.count();i++ )
+		addStation( found.at(i) );
+	return found.count();
+}
+
+QString StationPool::device( int station ) const
+{
+	StationSession *s = sessions.value( station );
+	return s ? s->device : QString();
+}
+
+SiProto *StationPool::session( int station ) const
+{
+	StationSession *s = sessions.value( station );
+	return s ? s->si : NULL;
+}
+
+void StationPool::setHotPlugEnabled( bool enabled )
+{
+	if ( !enabled ) {
+		delete devicemonitor;
+		devicemonitor = NULL;
+		return;
+	}
+	if ( devicemonitor )
+		return;
+	devicemonitor = new SiDeviceMonitor( this );
+	connect( devicemonitor, SIGNAL( deviceRemoved(const QString &) ),
+			this, SLOT( deviceRemoved(const QString &) ) );
+	connect( devicemonitor, SIGNAL( stationFound(const SiProbeResult &) ),
+			this, SLOT( stationFound(const SiProbeResult &) ) );
+	if ( !devicemonitor->start() ) {
+		delete devicemonitor;
+		devicemonitor = NULL;
+	}
+	updateDevicesInUse();
+}
+
+// The monitor must not probe a port a session has open
+void StationPool::updateDevicesInUse()
+{
+	if ( !devicemonitor )
+		return;
+	QStringList l;
+	QMap<int, StationSession *>::const_iterator it;
+	for( it=sessions.constBegin();it!=sessions.constEnd();++it )
+		l.append( it.value()->device );
+	devicemonitor->setDevicesInUse( l );
+}
+
+void StationPool::deviceRemoved( const QString &device )
+{
+	QMap<int, StationSession *>::const_iterator it;
+	for( it=sessions.constBegin();it!=sessions.constEnd();++it ) {
+		if ( it.value()->device == device )
+			removeStation( it.key() );
+	}
+}
+
+void StationPool::stationFound( const SiProbeResult &r )
+{
+	QMap<int, StationSession *>::const_iterator it;
+	for( it=sessions.constBegin();it!=sessions.constEnd();++it ) {
+		if ( it.value()->device == r.device )
+			return;
+	}
+	addStation( r );
+}
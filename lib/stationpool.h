@@ -0,0 +1,76 @@
+#ifndef STATIONPOOL_H
+#define STATIONPOOL_H
+
+#include <QObject>
+#include <QMap>
+#include <QList>
+
+#include "siproto.h"
+
+class QThread;
+class SiDeviceMonitor;
+class StationSession;
+
+// Runs one SiProto session per station, e.g. several readout masters at the
+// finish, and merges what they read into one stream tagged with a station
+// id. Sessions are spread over a few worker threads, each serving its
+// stations from its own event loop, or all run in the calling thread's
+// event loop when no threads are asked for.
+class StationPool : public QObject
+{
+	Q_OBJECT
+
+	public:
+		StationPool( int threads = 0, QObject *parent = 0 );
+		~StationPool();
+
+		// Opens a station on device in the background, see stationOpened()
+		// and stationClosed(). Returns the station id.
+		int addStation( const QString &device );
+		int addStation( const SiProbeResult &probed );
+		void removeStation( int station );
+
+		// Probes all serial devices and adds every station found
+		int addAll( int deadline = 3000 );
+
+		// Adds stations plugged in later and drops the ones unplugged
+		void setHotPlugEnabled( bool enabled );
+
+		QList<int> stations() const { return sessions.keys(); }
+		QString device( int station ) const;
+		// The session lives in a worker thread, only use it through
+		// queued calls
+		SiProto *session( int station ) const;
+
+		// Online punches of all stations, see sipunch.h. Safe to take
+		// from any thread.
+		SiPunchQueue &punchQueue() { return punches; }
+
+	signals:
+		void stationOpened( int station, const QString &device );
+		void stationClosed( int station, const QString &device );
+		void cardRead( int station, const SiCard &card );
+		void backupCard( int station, const SiCard &card );
+		void backupPunch( int station, const PunchBackupData &punch );
+		// count punches read by station were added to punchQueue()
+		void punchesAvailable( int station, int count );
+		void statusMessage( int station, const QString &msg );
+
+	private slots:
+		void sessionClosed( int station, const QString &device );
+		void deviceRemoved( const QString &device );
+		void stationFound( const SiProbeResult &r );
+
+	private:
+		int addSession( StationSession *s );
+		void closeSession( StationSession *s );
+		void updateDevicesInUse();
+
+		QList<QThread *> workers;
+		QMap<int, StationSession *> sessions;
+		int nextid;
+		SiPunchQueue punches;
+		SiDeviceMonitor *devicemonitor;
+};
+
+#endif
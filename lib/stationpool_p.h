@@ -0,0 +1,43 @@
+#ifndef STATIONPOOL_P_H
+#define STATIONPOOL_P_H
+
+#include <QObject>
+
+#include "siproto.h"
+
+// One station of a StationPool. Lives in the thread that serves it and owns
+// the SiProto, which is created there so its serial notifier is too.
+class StationSession : public QObject {
+	Q_OBJECT
+	public:
+		StationSession( int id, const QString &device, const SiProbeResult &probed, SiPunchQueue *punches );
+
+		int id;
+		QString device;
+		SiProbeResult probed;
+		SiProto *si;
+		SiPunchQueue *punches;
+
+	public slots:
+		void open();
+		void close();
+
+	private slots:
+		void gotCard( const SiCard &card );
+		void gotBackupCard( const SiCard &card );
+		void gotBackupPunch( const PunchBackupData &punch );
+		void gotPunches();
+		void gotStatus( const QString &msg );
+		void disconnected();
+
+	signals:
+		void opened( int id, const QString &device );
+		void closed( int id, const QString &device );
+		void cardRead( int id, const SiCard &card );
+		void backupCard( int id, const SiCard &card );
+		void backupPunch( int id, const PunchBackupData &punch );
+		void punchesAvailable( int id, int count );
+		void statusMessage( int id, const QString &msg );
+};
+
+#endif // STATIONPOOL_P_H
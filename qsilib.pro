@@ -1,3 +1,6 @@
 TEMPLATE = subdirs
 SUBDIRS = lib \
-	app
+	app \
+	tools/qserialdump \
+	tools/sireplay \
+	tools/sisim
@@ -0,0 +1,63 @@
+#include <QCoreApplication>
+#include <QDateTime>
+#include <QStringList>
+#include <QTextStream>
+
+#include <qserialtrace.h>
+
+// Prints serial trace files written by QSerialTrace as text, one line per
+// chunk: wall clock time, time since the previous chunk, direction and the
+// bytes in hex.
+
+static bool dumpFile( const QString &name, QTextStream &out )
+{
+	QSerialTraceReader reader;
+	if ( !reader.open( name ) ) {
+		out << name << ": " << reader.lasterror << endl;
+		return false;
+	}
+	out << "# " << name << endl;
+	QSerialTraceReader::Record r;
+	qint64 last = -1;
+	while( reader.readRecord( r ) ) {
+		QDateTime t = QDateTime::fromMSecsSinceEpoch( reader.wallMsecs( r.nsecs ) );
+		QString line = t.toString( "yyyy-MM-dd hh:mm:ss.zzz" );
+		line += QString( " %1us " ).arg( last < 0 ? 0 : (r.nsecs-last)/1000, 9 );
+		last = r.nsecs;
+		switch( r.type ) {
+			case QSerialTrace::Open:
+				line += "open "+QString::fromUtf8( r.data );
+				break;
+			case QSerialTrace::Read:
+			case QSerialTrace::Write:
+				line += ( r.type == QSerialTrace::Read ? "<-(" : "->(" );
+				line += QString::number( r.data.length() )+")";
+				for( int i=0;i<r.data.length();i++ )
+					line += QString( " %1" ).arg( (unsigned char)r.data.at(i), 2, 16, QChar('0') );
+				break;
+			default:
+				line += QString( "unknown record %1" ).arg( r.type );
+				break;
+		}
+		out << line << endl;
+	}
+	if ( !reader.lasterror.isEmpty() )
+		out << name << ": " << reader.lasterror << endl;
+	return true;
+}
+
+int main( int argc, char *argv[] )
+{
+	QCoreApplication app( argc, argv );
+	QStringList files = app.arguments().mid(1);
+	QTextStream out( stdout );
+	if ( files.isEmpty() ) {
+		out << "usage: qserialdump tracefile..." << endl;
+		return 1;
+	}
+	int ret = 0;
+	for( int i=0;i<files.count();i++ )
+		if ( !dumpFile( files.at(i), out ) )
+			ret = 1;
+	return ret;
+}
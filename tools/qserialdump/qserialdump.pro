@@ -0,0 +1,12 @@
+TEMPLATE = app
+TARGET = qserialdump
+PRE_TARGETDEPS += ../../lib/libqsilib.a
+DEPENDPATH += .
+INCLUDEPATH += . ../../lib
+QMAKE_LIBDIR += ../../lib
+CONFIG += console
+QT -= gui
+
+LIBS += -lqsilib
+
+SOURCES += main.cpp
@@ -0,0 +1,29 @@
+#include <QCoreApplication>
+#include <QStringList>
+
+#include <stdio.h>
+
+#include "replayrunner.h"
+
+// sireplay [-s speed] capture
+//
+// Plays a serial capture (QSERIAL_TRACE) through the station protocol.
+// speed 1 keeps the recorded timing, 0 plays as fast as possible.
+int main( int argc, char *argv[] )
+{
+	QCoreApplication app( argc, argv );
+	QStringList args = app.arguments().mid(1);
+	double speed = 0;
+	if ( args.count() >= 2 && args.at(0) == "-s" ) {
+		speed = args.at(1).toDouble();
+		args = args.mid(2);
+	}
+	if ( args.count() != 1 ) {
+		fprintf( stderr, "usage: sireplay [-s speed] capture\n" );
+		return 1;
+	}
+	ReplayRunner r( args.at(0), speed );
+	if ( !r.start() )
+		return 1;
+	return app.exec();
+}
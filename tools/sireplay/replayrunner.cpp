@@ -0,0 +1,49 @@
+#include "replayrunner.h"
+
+#include <QCoreApplication>
+#include <QTimer>
+
+#include <qserialreplay.h>
+
+#include <stdio.h>
+
+ReplayRunner::ReplayRunner( const QString &f, double speed, QObject *parent ) :
+	QObject( parent ),
+	file( f ),
+	cards( 0 )
+{
+	replay = new QSerialReplay;
+	replay->setSpeed( speed );
+	si.setDevice( replay );
+	connect( &si, SIGNAL( cardRead( const SiCard & ) ), this, SLOT( gotCard( const SiCard & ) ) );
+}
+
+bool ReplayRunner::start()
+{
+	elapsed.start();
+	if ( !si.tryDevice( file ) ) {
+		fprintf( stderr, "Failed to replay %s: %s\n", qPrintable( file ), qPrintable( replay->lasterror ) );
+		return false;
+	}
+	QTimer *t = new QTimer( this );
+	connect( t, SIGNAL( timeout() ), this, SLOT( checkDone() ) );
+	t->start( 10 );
+	return true;
+}
+
+void ReplayRunner::gotCard( const SiCard &card )
+{
+	cards++;
+	printf( "%d\n", card.getCardNumber() );
+}
+
+void ReplayRunner::checkDone()
+{
+	if ( !replay->atEnd() )
+		return;
+	double secs = elapsed.nsecsElapsed()/1e9;
+	printf( "%d chunks, %d cards in %.3f s (%.1f cards/s)\n", replay->chunksPlayed(), cards, secs,
+			secs > 0 ? cards/secs : 0.0 );
+	printf( "%s\n", qPrintable( si.readoutLatency().dump() ) );
+	QCoreApplication::quit();
+}
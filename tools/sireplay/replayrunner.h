@@ -0,0 +1,34 @@
+#ifndef REPLAYRUNNER_H
+#define REPLAYRUNNER_H
+
+#include <QObject>
+#include <QElapsedTimer>
+
+#include <siproto.h>
+
+class QSerialReplay;
+
+// Feeds a serial capture through SiProto and reports card throughput and
+// readout latency when the capture is done.
+class ReplayRunner : public QObject
+{
+	Q_OBJECT
+
+	public:
+		ReplayRunner( const QString &file, double speed, QObject *parent = 0 );
+
+		bool start();
+
+	private slots:
+		void gotCard( const SiCard &card );
+		void checkDone();
+
+	private:
+		QString file;
+		SiProto si;
+		QSerialReplay *replay;
+		QElapsedTimer elapsed;
+		int cards;
+};
+
+#endif
@@ -0,0 +1,15 @@
+TEMPLATE = app
+TARGET = sireplay
+PRE_TARGETDEPS += ../../lib/libqsilib.a
+DEPENDPATH += .
+INCLUDEPATH += . ../../lib
+QMAKE_LIBDIR += ../../lib
+CONFIG += console
+
+LIBS += -lqsilib
+
+SOURCES += main.cpp \
+    replayrunner.cpp
+
+HEADERS += \
+    replayrunner.h
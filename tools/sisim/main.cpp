@@ -0,0 +1,123 @@
+#include <QCoreApplication>
+#include <QStringList>
+#include <QTimer>
+
+#include <stdio.h>
+
+#include "simstation.h"
+
+// sisim - SportIdent station simulator on a pseudo terminal
+//
+// Prints the device to open, e.g. SiProto::tryDevice( "/dev/pts/5" ).
+static void usage()
+{
+	fprintf( stderr,
+		"usage: sisim [options]\n"
+		"  -r n     card insertions per minute (60)\n"
+		"  -t list  card types, comma separated from 5,6,8,9,p,t,10,11,siac (5,6,8,9,p)\n"
+		"  -m mode  readout or control (readout)\n"
+		"  -p n     punches per minute in control mode (60)\n"
+		"  -a       auto send out punches in control mode\n"
+		"  -k n     fill the backup memory with n punches at start\n"
+		"  -l ms    reply latency (5)\n"
+		"  -b baud  emulated line speed, 0 for none (38400)\n"
+		"  -n rate  fraction of requests answered with NAK (0)\n"
+		"  -c rate  fraction of frames sent corrupted (0)\n"
+		"  -B       base protocol only\n"
+		"  -s n     random seed\n" );
+}
+
+static bool parseTypes( const QString &s, QList<SiCard::CardType> &types )
+{
+	types.clear();
+	QStringList l = s.toLower().split( "," );
+	for( int i=0;i<l.count();i++ ) {
+		QString t = l.at(i).trimmed();
+		if ( t == "5" ) types << SiCard::Card5;
+		else if ( t == "6" ) types << SiCard::Card6;
+		else if ( t == "8" ) types << SiCard::Card8;
+		else if ( t == "9" ) types << SiCard::Card9;
+		else if ( t == "p" ) types << SiCard::pCard;
+		else if ( t == "t" ) types << SiCard::tCard;
+		else if ( t == "10" ) types << SiCard::Card10;
+		else if ( t == "11" ) types << SiCard::Card11;
+		else if ( t == "siac" ) types << SiCard::SIAC;
+		else
+			return false;
+	}
+	return !types.isEmpty();
+}
+
+int main( int argc, char *argv[] )
+{
+	QCoreApplication app( argc, argv );
+	QStringList args = app.arguments().mid(1);
+
+	SimStation station;
+	int cardrate = 60, punchrate = 60, fill = 0;
+	bool control = false, autosend = false;
+	for( int i=0;i<args.count();i++ ) {
+		QString a = args.at(i);
+		bool hasvalue = i+1 < args.count();
+		QString v = hasvalue ? args.at(i+1) : QString();
+		if ( a == "-a" ) {
+			autosend = true;
+		} else if ( a == "-B" ) {
+			station.setExtended( false );
+		} else if ( !hasvalue ) {
+			usage();
+			return 1;
+		} else {
+			i++;
+			if ( a == "-r" )
+				cardrate = v.toInt();
+			else if ( a == "-t" ) {
+				QList<SiCard::CardType> types;
+				if ( !parseTypes( v, types ) ) {
+					usage();
+					return 1;
+				}
+				station.setCardTypes( types );
+			} else if ( a == "-m" )
+				control = v == "control";
+			else if ( a == "-p" )
+				punchrate = v.toInt();
+			else if ( a == "-k" )
+				fill = v.toInt();
+			else if ( a == "-l" )
+				station.setLatency( v.toInt() );
+			else if ( a == "-b" )
+				station.setBaud( v.toInt() );
+			else if ( a == "-n" )
+				station.setNakRate( v.toDouble() );
+			else if ( a == "-c" )
+				station.setCorruptRate( v.toDouble() );
+			else if ( a == "-s" )
+				qsrand( v.toUInt() );
+			else {
+				usage();
+				return 1;
+			}
+		}
+	}
+
+	if ( control ) {
+		station.setStationMode( SiProto::StationControl );
+		station.setStationCode( 31 );
+		station.setAutoSend( autosend );
+		station.fillBackup( fill );
+		station.setPunchRate( punchrate );
+	} else {
+		station.fillBackup( fill );
+		station.setCardRate( cardrate );
+	}
+	if ( !station.open() ) {
+		fprintf( stderr, "%s\n", qPrintable( station.lasterror ) );
+		return 1;
+	}
+	printf( "Station at %s\n", qPrintable( station.deviceName() ) );
+	fflush( stdout );
+
+	station.setStatsInterval( 10000 );
+	return app.exec();
+}
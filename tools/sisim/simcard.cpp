@@ -0,0 +1,228 @@
+#include "simcard.h"
+
+#include <silayout.h>
+
+#include <stdlib.h>
+
+static int randomInt( int from, int to )
+{
+	return from+qrand()%(to-from+1);
+}
+
+static void putText( QByteArray &m, int offset, int width, const QByteArray &s )
+{
+	for( int i=0;i<width;i++ )
+		m[offset+i] = i < s.length() ? s.at(i) : 0;
+}
+
+SimCard::SimCard() :
+	cardtype( SiCard::UnknownCard ), cardnum( 0 )
+{
+}
+
+SimCard SimCard::generate( SiCard::CardType type, int number )
+{
+	SimCard c;
+	c.cardtype = type;
+	int from = 1, to = 499999, maxpunches = 30;
+	switch( type ) {
+		case SiCard::Card5:
+			from = 1; to = 499999; maxpunches = 30; break;
+		case SiCard::Card6:
+			from = 500000; to = 999999; maxpunches = 64; break;
+		case SiCard::Card9:
+			from = 1000000; to = 1999999; maxpunches = 50; break;
+		case SiCard::Card8:
+			from = 2000000; to = 2999999; maxpunches = 30; break;
+		case SiCard::pCard:
+			from = 4000000; to = 4999999; maxpunches = 20; break;
+		case SiCard::tCard:
+			from = 6000000; to = 6999999; maxpunches = 50; break;
+		case SiCard::Card10:
+			from = 7000000; to = 7999999; maxpunches = 128; break;
+		case SiCard::SIAC:
+			from = 8000000; to = 8999999; maxpunches = 128; break;
+		case SiCard::Card11:
+			from = 9000000; to = 9999999; maxpunches = 128; break;
+		default:
+			c.cardtype = SiCard::UnknownCard;
+			return c;
+	}
+	c.cardnum = number ? number : randomInt( from, to );
+	// Card 5 is series 1-4 with up to 65535 cards each, series 1 has no
+	// series prefix in the number
+	if ( type == SiCard::Card5 && !number ) {
+		int series = randomInt( 1, 4 );
+		c.cardnum = randomInt( 1, 65000 );
+		if ( series > 1 )
+			c.cardnum += series*100000;
+	}
+
+	QList<int> controls;
+	QList<QTime> times;
+	QTime t = QTime::currentTime().addSecs( -randomInt( 1800, 7200 ) );
+	int count = randomInt( 3, qMin( maxpunches, 25 ) );
+	times.append( t ); // start
+	for( int i=0;i<count;i++ ) {
+		t = t.addSecs( randomInt( 30, 600 ) );
+		controls.append( randomInt( 31, 255 ) );
+		times.append( t );
+	}
+	times.append( t.addSecs( randomInt( 10, 60 ) ) ); // finish
+
+	if ( type == SiCard::Card5 )
+		c.fillCard5( controls, times );
+	else if ( type == SiCard::Card6 )
+		c.fillCard6( controls, times );
+	else
+		c.fillCard89pt( controls, times );
+	return c;
+}
+
+// 4 byte punching record: PTD, CN, PTH, PTL, time in 12 hour halves
+void SimCard::punchRecord( int offset, int cn, const QTime &t )
+{
+	int secs = QTime( 0, 0 ).secsTo( t );
+	int dow = QDate::currentDate().dayOfWeek()%7;
+	memory[offset] = (dow<<1)|( secs >= 43200 ? 1 : 0 );
+	memory[offset+1] = cn;
+	secs %= 43200;
+	memory[offset+2] = secs>>8;
+	memory[offset+3] = secs&0xFF;
+}
+
+static void put16( QByteArray &m, int offset, int v )
+{
+	m[offset] = (v>>8)&0xFF;
+	m[offset+1] = v&0xFF;
+}
+
+void SimCard::fillCard5( const QList<int> &controls, const QList<QTime> &times )
+{
+	typedef SiCard5Layout L;
+	memory = QByteArray( L::Size, 0xEE );
+	int series = cardnum < 100000 ? 1 : cardnum/100000;
+	memory[L::CountryCode::offset] = 0;
+	put16( memory, L::ClubCode::offset, 0 );
+	put16( memory, L::CardNumber::offset, cardnum%100000 );
+	memory[L::CardSeries::offset] = series;
+	put16( memory, L::StartNumber::offset, 0 );
+	memory[L::StartNumberSeries::offset] = 0;
+	put16( memory, L::StartTime::offset, QTime( 0, 0 ).secsTo( times.first() )%43200 );
+	put16( memory, L::FinishTime::offset, QTime( 0, 0 ).secsTo( times.last() )%43200 );
+	memory[L::PunchCounter::offset] = controls.count()+1;
+	memory[L::SoftwareVersion::offset] = 0;
+	memory[L::Checksum::offset] = 0;
+	put16( memory, L::Signature::offset, 0x0007 );
+	for( int i=0;i<controls.count() && i<L::MaxTimedPunches;i++ ) {
+		int o = L::punchOffset( i );
+		memory[o] = controls.at(i);
+		put16( memory, o+1, QTime( 0, 0 ).secsTo( times.at(i+1) )%43200 );
+	}
+}
+
+void SimCard::fillCard6( const QList<int> &controls, const QList<QTime> &times )
+{
+	typedef SiCard6Layout L;
+	memory = QByteArray( 8*L::BlockSize, 0xEE );
+	memory[L::Signature::offset] = 0xED;
+	memory[L::Signature::offset+1] = 0xED;
+	memory[L::Signature::offset+2] = 0xED;
+	memory[L::Signature::offset+3] = 0xED;
+	memory[L::CN3::offset] = 0;
+	memory[L::CN2::offset] = (cardnum>>16)&0xFF;
+	memory[L::CN1::offset] = (cardnum>>8)&0xFF;
+	memory[L::CN0::offset] = cardnum&0xFF;
+	memory[L::PunchCounter::offset] = controls.count();
+	punchRecord( L::StartRecord, 0, times.first() );
+	punchRecord( L::FinishRecord, 0, times.last() );
+	putText( memory, L::LastName::offset, L::LastName::width, "Runner" );
+	putText( memory, L::FirstName::offset, L::FirstName::width, QByteArray::number( cardnum ) );
+	putText( memory, L::Club::offset, L::Club::width, "Sim OK" );
+	for( int i=0;i<controls.count();i++ ) {
+		int block = i < 64 ? 6+i/L::PunchesPerBlock : 2+(i-64)/L::PunchesPerBlock;
+		int offset = block*L::BlockSize+(i%L::PunchesPerBlock)*L::PunchRecordSize;
+		punchRecord( offset, controls.at(i), times.at(i+1) );
+	}
+}
+
+void SimCard::fillCard89pt( const QList<int> &controls, const QList<QTime> &times )
+{
+	typedef SiCard89ptLayout L;
+	int si3 = 0xF;
+	if ( cardtype == SiCard::Card9 )
+		si3 = 0x1;
+	else if ( cardtype == SiCard::Card8 )
+		si3 = 0x2;
+	else if ( cardtype == SiCard::pCard )
+		si3 = 0x4;
+	else if ( cardtype == SiCard::tCard )
+		si3 = 0x6;
+	const L::Geometry *g = L::geometry( si3 );
+	int blocks = 0;
+	for( int m=g->blockmask;m;m>>=1 )
+		blocks++;
+	memory = QByteArray( blocks*L::BlockSize, 0xEE );
+	for( int i=0;i<4;i++ )
+		memory[L::Signature::offset+i] = 0xEA;
+	memory[L::SI3::offset] = si3;
+	memory[L::SI2::offset] = (cardnum>>16)&0xFF;
+	memory[L::SI1::offset] = (cardnum>>8)&0xFF;
+	memory[L::SI0::offset] = cardnum&0xFF;
+	memory[L::PunchCounter::offset] = controls.count();
+	punchRecord( L::StartPage*L::PageSize, 0, times.first() );
+	punchRecord( L::FinishPage*L::PageSize, 0, times.last() );
+	if ( g->userdatalength > 0 )
+		putText( memory, L::UserDataPage*L::PageSize, g->userdatalength,
+				QByteArray::number( cardnum )+";Runner;Sim OK;" );
+	for( int i=0;i<controls.count() && i<g->maxpunches;i++ )
+		punchRecord( (g->firstpunchpage+i)*L::PageSize, controls.at(i), times.at(i+1) );
+}
+
+QList<int> SimCard::readAllBlocks( unsigned char card6blocks ) const
+{
+	QList<int> l;
+	if ( cardtype == SiCard::Card5 ) {
+		l.append( 0 );
+	} else if ( cardtype == SiCard::Card6 ) {
+		for( int i=0;i<8;i++ )
+			if ( card6blocks & (1<<i) )
+				l.append( i );
+	} else {
+		const SiCard89ptLayout::Geometry *g = SiCard89ptLayout::geometry( (unsigned char)memory.at(SiCard89ptLayout::SI3::offset) );
+		for( int i=0;i<8;i++ )
+			if ( g->blockmask & (1<<i) )
+				l.append( i );
+	}
+	return l;
+}
+
+// Card 6 is kept as block 0, 6 and 7, card 8/9/... as the read-all blocks
+QList<int> SimCard::backupBlocks() const
+{
+	QList<int> l;
+	if ( cardtype == SiCard::Card6 )
+		l << 0 << 6 << 7;
+	else
+		l = readAllBlocks( 0xFF );
+	return l;
+}
+
+QByteArray SimCard::detectData() const
+{
+	QByteArray ba;
+	int si3 = 0;
+	if ( cardtype != SiCard::Card5 && cardtype != SiCard::Card6 )
+		si3 = (unsigned char)memory.at(SiCard89ptLayout::SI3::offset);
+	ba.append( si3 );
+	if ( cardtype == SiCard::Card5 ) {
+		ba.append( cardnum < 100000 ? 1 : cardnum/100000 );
+		ba.append( ((cardnum%100000)>>8)&0xFF );
+		ba.append( (cardnum%100000)&0xFF );
+	} else {
+		ba.append( (cardnum>>16)&0xFF );
+		ba.append( (cardnum>>8)&0xFF );
+		ba.append( cardnum&0xFF );
+	}
+	return ba;
+}
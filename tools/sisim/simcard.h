@@ -0,0 +1,45 @@
+#ifndef SIMCARD_H
+#define SIMCARD_H
+
+#include <QByteArray>
+#include <QList>
+#include <QTime>
+
+#include <siproto.h>
+
+// Memory image of a card as a station reads it, laid out with silayout.h so
+// SiProto decodes exactly what was generated.
+class SimCard
+{
+	public:
+		SimCard();
+
+		// Random punches on a card of the given type. number 0 picks a
+		// number from the type's range.
+		static SimCard generate( SiCard::CardType type, int number = 0 );
+
+		SiCard::CardType type() const { return cardtype; }
+		int number() const { return cardnum; }
+		bool isNull() const { return cardtype == SiCard::UnknownCard; }
+
+		int blockCount() const { return memory.length()/128; }
+		QByteArray block( int bn ) const { return memory.mid( bn*128, 128 ); }
+		// Blocks sent for a read-all request, in sending order
+		QList<int> readAllBlocks( unsigned char card6blocks ) const;
+		// Blocks stored in the backup memory of a readout station
+		QList<int> backupBlocks() const;
+		// SI3 SI2 SI1 SI0 as sent in the card detected frames
+		QByteArray detectData() const;
+
+	private:
+		void punchRecord( int offset, int cn, const QTime &t );
+		void fillCard5( const QList<int> &controls, const QList<QTime> &times );
+		void fillCard6( const QList<int> &controls, const QList<QTime> &times );
+		void fillCard89pt( const QList<int> &controls, const QList<QTime> &times );
+
+		SiCard::CardType cardtype;
+		int cardnum;
+		QByteArray memory;
+};
+
+#endif
@@ -0,0 +1,603 @@
+#include "simstation.h"
+
+#include <QDateTime>
+#include <QSocketNotifier>
+#include <QTimer>
+
+#include <silatency.h>
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <termios.h>
+#include <unistd.h>
+
+extern "C" unsigned int crc( unsigned int uiCount, unsigned char *pucDat );
+
+enum {
+	STX = 0x02,
+	ETX = 0x03,
+	ACK = 0x06,
+	NAK = 0x15,
+	DLE = 0x10
+};
+
+// Station side of the commands in SiProto
+enum {
+	BaseGetSICard5 = 0x31,
+	BaseSICard5Detected = 0x46,
+	BaseTransmitRecord = 0x53,
+	BaseGetSICard6 = 0x61,
+	BaseSICard6Detected = 0x66,
+	BaseSetMSMode = 0x70,
+	BaseGetBackupData = 0x74,
+	BaseEraseBackupData = 0x75,
+	BaseSetTime = 0x76,
+	BaseGetTime = 0x77,
+	GetBackupData = 0x81,
+	SetSystemValue = 0x82,
+	GetSystemValue = 0x83,
+	GetSICard5 = 0xB1,
+	TransmitRecord = 0xD3,
+	GetSICard6 = 0xE1,
+	SICard5Detected = 0xE5,
+	SICard6Detected = 0xE6,
+	SICardRemoved = 0xE7,
+	SICard89ptDetected = 0xE8,
+	GetSICard89pt = 0xEF,
+	SetMSMode = 0xF0,
+	EraseBackupData = 0xF5,
+	SetTime = 0xF6,
+	GetTime = 0xF7
+};
+
+enum {
+	BackupStart = 0x100,
+	BackupSize = 0x20000,
+	StationSerial = 100001
+};
+
+static int byteAt( const QByteArray &d, int i )
+{
+	return i < d.length() ? (unsigned char)d.at(i) : 0;
+}
+
+static bool chance( double rate )
+{
+	return rate > 0 && qrand() < rate*RAND_MAX;
+}
+
+SimStation::SimStation( QObject *parent ) :
+	QObject( parent ),
+	masterfd( -1 ), slavefd( -1 ), notifier( NULL ), lastdue( 0 ),
+	clockoffset( 0 ), latency( 5 ), baud( 38400 ), nakrate( 0 ), corruptrate( 0 ),
+	framesin( 0 ), framesout( 0 ), naks( 0 ), corrupted( 0 ), badframes( 0 ),
+	cardsinserted( 0 ), cardsread( 0 ), punches( 0 )
+{
+	sendtimer = new QTimer( this );
+	sendtimer->setSingleShot( true );
+	connect( sendtimer, SIGNAL( timeout() ), this, SLOT( sendDue() ) );
+	cardtimer = new QTimer( this );
+	connect( cardtimer, SIGNAL( timeout() ), this, SLOT( insertCard() ) );
+	punchtimer = new QTimer( this );
+	connect( punchtimer, SIGNAL( timeout() ), this, SLOT( punch() ) );
+	statstimer = new QTimer( this );
+	connect( statstimer, SIGNAL( timeout() ), this, SLOT( printStats() ) );
+
+	cardtypes << SiCard::Card5 << SiCard::Card6 << SiCard::Card8 << SiCard::Card9 << SiCard::pCard;
+
+	// System memory of a BSM7 readout station with software 6.56
+	memory = QByteArray( 0x80, 0x00 );
+	memory[0x00] = (StationSerial>>24)&0xFF;
+	memory[0x01] = (StationSerial>>16)&0xFF;
+	memory[0x02] = (StationSerial>>8)&0xFF;
+	memory[0x03] = StationSerial&0xFF;
+	memory[SiProto::SWVersion] = '6';
+	memory[SiProto::SWVersion+1] = '5';
+	memory[SiProto::SWVersion+2] = '6';
+	memory[SiProto::CardBlocks] = 0xFF;
+	memory[SiProto::StationMode] = SiProto::StationReadSICards;
+	memory[SiProto::StationCode] = 10;
+	memory[SiProto::ProtocolConf] = SiProto::FlagExtendedProtocol|SiProto::FlagHandshake;
+	setBackupPointer( BackupStart );
+	backup = QByteArray( BackupStart, 0x00 );
+}
+
+SimStation::~SimStation()
+{
+	if ( slavefd != -1 )
+		::close( slavefd );
+	if ( masterfd != -1 )
+		::close( masterfd );
+}
+
+bool SimStation::open()
+{
+	masterfd = posix_openpt( O_RDWR|O_NOCTTY );
+	if ( masterfd == -1 || grantpt( masterfd ) || unlockpt( masterfd ) ) {
+		lasterror = "Failed to create pseudo terminal";
+		return false;
+	}
+	slavename = ptsname( masterfd );
+	// Keeping the slave open avoids hangups while no reader is attached
+	slavefd = ::open( slavename.toLocal8Bit(), O_RDWR|O_NOCTTY );
+	if ( slavefd != -1 ) {
+		struct termios tio;
+		tcgetattr( slavefd, &tio );
+		cfmakeraw( &tio );
+		tcsetattr( slavefd, TCSANOW, &tio );
+	}
+	fcntl( masterfd, F_SETFL, fcntl( masterfd, F_GETFL )|O_NONBLOCK );
+	notifier = new QSocketNotifier( masterfd, QSocketNotifier::Read, this );
+	connect( notifier, SIGNAL( activated(int) ), this, SLOT( readInput() ) );
+	return true;
+}
+
+void SimStation::setCardRate( int perminute )
+{
+	if ( perminute <= 0 ) {
+		cardtimer->stop();
+		return;
+	}
+	cardtimer->start( qMax( 1, 60000/perminute ) );
+}
+
+void SimStation::setPunchRate( int perminute )
+{
+	if ( perminute <= 0 ) {
+		punchtimer->stop();
+		return;
+	}
+	punchtimer->start( qMax( 1, 60000/perminute ) );
+}
+
+void SimStation::setExtended( bool ext )
+{
+	if ( ext )
+		memory[SiProto::ProtocolConf] = memory.at(SiProto::ProtocolConf)|SiProto::FlagExtendedProtocol;
+	else
+		memory[SiProto::ProtocolConf] = memory.at(SiProto::ProtocolConf)&~SiProto::FlagExtendedProtocol;
+}
+
+void SimStation::setAutoSend( bool on )
+{
+	if ( on )
+		memory[SiProto::ProtocolConf] = memory.at(SiProto::ProtocolConf)|SiProto::FlagAutoSendOut;
+	else
+		memory[SiProto::ProtocolConf] = memory.at(SiProto::ProtocolConf)&~SiProto::FlagAutoSendOut;
+}
+
+void SimStation::setStationMode( int mode )
+{
+	memory[SiProto::StationMode] = mode;
+}
+
+void SimStation::setStationCode( int code )
+{
+	memory[SiProto::StationCode] = code;
+}
+
+bool SimStation::extended() const
+{
+	return memory.at(SiProto::ProtocolConf) & SiProto::FlagExtendedProtocol;
+}
+
+// Backup end address is kept in bytes 0x1C, 0x1D, 0x21 and 0x22
+void SimStation::setBackupPointer( int addr )
+{
+	int b = SiProto::BackupMemoryAddres;
+	memory[b] = (addr>>24)&0xFF;
+	memory[b+1] = (addr>>16)&0xFF;
+	memory[b+5] = (addr>>8)&0xFF;
+	memory[b+6] = addr&0xFF;
+}
+
+int SimStation::backupPointer() const
+{
+	const unsigned char *d = (const unsigned char *)memory.constData()+SiProto::BackupMemoryAddres;
+	return (d[0]<<24)|(d[1]<<16)|(d[5]<<8)|d[6];
+}
+
+void SimStation::storeBackup( const QByteArray &ba )
+{
+	int p = backupPointer();
+	if ( p+ba.length() > BackupSize )
+		return;
+	backup.resize( p );
+	backup.append( ba );
+	setBackupPointer( p+ba.length() );
+}
+
+void SimStation::storeCard( const SimCard &c )
+{
+	QList<int> blocks = c.backupBlocks();
+	for( int i=0;i<blocks.count();i++ )
+		storeBackup( c.block( blocks.at(i) ) );
+}
+
+void SimStation::fillBackup( int count )
+{
+	bool readout = memory.at(SiProto::StationMode) == SiProto::StationReadSICards;
+	for( int i=0;i<count;i++ ) {
+		if ( readout && !cardtypes.isEmpty() )
+			storeCard( SimCard::generate( cardtypes.at( qrand()%cardtypes.count() ) ) );
+		else if ( !readout )
+			punch();
+	}
+}
+
+// YY MM DD TD TH TL (TSS), TD holds day of week and the pm flag
+QByteArray SimStation::stationTime( bool extendedframe ) const
+{
+	QDateTime dt = QDateTime::currentDateTime().addMSecs( clockoffset );
+	QByteArray ba;
+	int secs = QTime( 0, 0 ).secsTo( dt.time() );
+	ba.append( dt.date().year()-2000 );
+	ba.append( dt.date().month() );
+	ba.append( dt.date().day() );
+	ba.append( ((dt.date().dayOfWeek()%7)<<1)|( secs >= 43200 ? 1 : 0 ) );
+	secs %= 43200;
+	ba.append( secs>>8 );
+	ba.append( secs&0xFF );
+	if ( extendedframe )
+		ba.append( dt.time().msec()*256/1000 );
+	return ba;
+}
+
+void SimStation::setStationTime( const QByteArray &d )
+{
+	if ( d.length() < 6 )
+		return;
+	const unsigned char *b = (const unsigned char *)d.constData();
+	QDateTime dt( QDate( 2000+b[0], b[1], b[2] ), QTime( 0, 0 ) );
+	dt = dt.addSecs( ((b[4]<<8)|b[5])+( b[3]&0x01 ? 43200 : 0 ) );
+	if ( d.length() > 6 )
+		dt = dt.addMSecs( b[6]*1000/256 );
+	clockoffset = QDateTime::currentDateTime().msecsTo( dt );
+}
+
+void SimStation::readInput()
+{
+	char buf[512];
+	ssize_t len;
+	while( ( len = ::read( masterfd, buf, sizeof( buf ) ) ) > 0 )
+		inbuf.append( buf, len );
+	while( !inbuf.isEmpty() ) {
+		unsigned char c = inbuf.at(0);
+		if ( c == ACK || c == NAK ) {
+			inbuf.remove( 0, 1 );
+			// The reader took the card
+			if ( c == ACK && !card.isNull() )
+				removeCard();
+			continue;
+		}
+		if ( c != STX ) {
+			inbuf.remove( 0, 1 );
+			continue;
+		}
+		if ( inbuf.length() > 1 && (unsigned char)inbuf.at(1) == STX ) {
+			inbuf.remove( 0, 1 );
+			continue;
+		}
+		if ( inbuf.length() < 2 )
+			return;
+		unsigned char cmnd = inbuf.at(1);
+		QByteArray data;
+		if ( cmnd >= 0x80 && cmnd != 0xC4 ) {
+			if ( inbuf.length() < 3 )
+				return;
+			int length = (unsigned char)inbuf.at(2);
+			if ( inbuf.length() < 6+length )
+				return;
+			unsigned int creal = (((unsigned char)inbuf.at(length+3))<<8)|((unsigned char)inbuf.at(length+4));
+			unsigned int ctest = crc( length+2, (unsigned char *)inbuf.data()+1 );
+			if ( creal != ctest || inbuf.at(length+5) != ETX ) {
+				badframes++;
+				inbuf.remove( 0, 1 );
+				continue;
+			}
+			data = inbuf.mid( 3, length );
+			inbuf.remove( 0, length+6 );
+		} else {
+			int pos = 2;
+			bool complete = false;
+			while( pos < inbuf.length() ) {
+				char b = inbuf.at(pos);
+				if ( b == ETX ) {
+					complete = true;
+					break;
+				}
+				if ( b == DLE ) {
+					if ( pos+1 < inbuf.length() )
+						data.append( inbuf.at(pos+1) );
+					pos += 2;
+				} else {
+					data.append( b );
+					pos++;
+				}
+			}
+			if ( !complete )
+				return;
+			inbuf.remove( 0, pos+1 );
+		}
+		framesin++;
+		handleFrame( cmnd, data );
+	}
+}
+
+void SimStation::handleFrame( unsigned char cmnd, const QByteArray &data )
+{
+	bool ext = cmnd >= 0x80;
+	// A station without the extended protocol ignores extended commands
+	if ( ext && !extended() )
+		return;
+	if ( chance( nakrate ) ) {
+		naks++;
+		queue( QByteArray( 1, NAK ) );
+		return;
+	}
+	switch( cmnd ) {
+		case SetMSMode: case BaseSetMSMode:
+			send( cmnd, data.left( 1 ), ext );
+			break;
+		case GetSystemValue:
+			{
+				int addr = byteAt( data, 0 );
+				int len = byteAt( data, 1 );
+				QByteArray ba;
+				ba.append( addr );
+				ba.append( memory.mid( addr, len ) );
+				send( cmnd, ba, ext );
+			}
+			break;
+		case SetSystemValue:
+			{
+				int addr = byteAt( data, 0 );
+				QByteArray values = data.mid(1);
+				for( int i=0;i<values.length() && addr+i<memory.length();i++ )
+					memory[addr+i] = values.at(i);
+				send( cmnd, data.left( 1 ), ext );
+			}
+			break;
+		case GetTime: case BaseGetTime:
+			send( cmnd, stationTime( ext ), ext );
+			break;
+		case SetTime: case BaseSetTime:
+			setStationTime( data );
+			send( cmnd, stationTime( ext ), ext );
+			break;
+		case GetBackupData: case BaseGetBackupData:
+			{
+				int addr = ((byteAt( data, 0 ))<<16)|((byteAt( data, 1 ))<<8)|(byteAt( data, 2 ));
+				int len = byteAt( data, 3 );
+				QByteArray ba = data.left( 3 );
+				QByteArray mem = backup.mid( addr, len );
+				if ( mem.length() < len )
+					mem.append( QByteArray( len-mem.length(), 0xEE ) );
+				ba.append( mem );
+				send( cmnd, ba, ext );
+			}
+			break;
+		case EraseBackupData: case BaseEraseBackupData:
+			setBackupPointer( BackupStart );
+			backup.resize( BackupStart );
+			send( cmnd, QByteArray(), ext );
+			break;
+		case GetSICard5: case BaseGetSICard5:
+			if ( card.type() != SiCard::Card5 )
+				break;
+			send( cmnd, card.block( 0 ), ext );
+			cardsread++;
+			break;
+		case GetSICard6: case BaseGetSICard6:
+			if ( card.type() != SiCard::Card6 )
+				break;
+			if ( byteAt( data, 0 ) == 0x08 )
+				sendCardBlocks( cmnd, card.readAllBlocks( memory.at(SiProto::CardBlocks) ) );
+			else
+				sendCardBlocks( cmnd, QList<int>() << byteAt( data, 0 ) );
+			break;
+		case GetSICard89pt:
+			if ( card.isNull() || card.type() == SiCard::Card5 || card.type() == SiCard::Card6 )
+				break;
+			if ( byteAt( data, 0 ) == 0x08 )
+				sendCardBlocks( cmnd, card.readAllBlocks( 0xFF ) );
+			else
+				sendCardBlocks( cmnd, QList<int>() << byteAt( data, 0 ) );
+			break;
+		default:
+			qWarning( "Unhandled command 0x%02X", cmnd );
+			break;
+	}
+}
+
+void SimStation::sendCardBlocks( unsigned char cmnd, const QList<int> &blocks )
+{
+	for( int i=0;i<blocks.count();i++ ) {
+		int bn = blocks.at(i);
+		if ( bn >= card.blockCount() )
+			continue;
+		QByteArray ba;
+		ba.append( bn );
+		ba.append( card.block( bn ) );
+		send( cmnd, ba, cmnd >= 0x80 );
+		if ( bn == card.readAllBlocks( memory.at(SiProto::CardBlocks) ).last() )
+			cardsread++;
+	}
+}
+
+// Extended: STX CMD LEN CN1 CN0 DATA CRC1 CRC0 ETX
+// Base: STX CMD CN DATA ETX with DLE before every byte below 0x20
+void SimStation::send( unsigned char cmnd, const QByteArray &data, bool extendedframe, bool withcn )
+{
+	int code = (unsigned char)memory.at(SiProto::StationCode);
+	QByteArray payload;
+	if ( withcn ) {
+		if ( extendedframe )
+			payload.append( (code>>8)&0xFF );
+		payload.append( code&0xFF );
+	}
+	payload.append( data );
+	QByteArray f;
+	f.append( STX );
+	f.append( cmnd );
+	if ( extendedframe ) {
+		f.append( payload.length() );
+		f.append( payload );
+		unsigned int c = crc( f.length()-1, (unsigned char *)f.data()+1 );
+		f.append( (c>>8)&0xFF );
+		f.append( c&0xFF );
+	} else {
+		for( int i=0;i<payload.length();i++ ) {
+			if ( (unsigned char)payload.at(i) <= 0x1F )
+				f.append( DLE );
+			f.append( payload.at(i) );
+		}
+	}
+	f.append( ETX );
+	if ( chance( corruptrate ) ) {
+		corrupted++;
+		int pos = 1+qrand()%( f.length()-1 );
+		f[pos] = f.at(pos)^( 1<<( qrand()%8 ) );
+	}
+	framesout++;
+	queue( f );
+}
+
+// Frames leave in order after the reply latency, each taking the time it
+// needs on the line at the emulated speed.
+void SimStation::queue( const QByteArray &frame )
+{
+	qint64 now = siMonotonicNsecs();
+	qint64 due = qMax( now+(qint64)latency*1000000, lastdue );
+	if ( baud > 0 )
+		due += (qint64)frame.length()*10*1000000000LL/baud;
+	lastdue = due;
+	Pending p;
+	p.due = due;
+	p.data = frame;
+	pending.append( p );
+	if ( !sendtimer->isActive() )
+		sendtimer->start( (int)qMax( (qint64)0, ( due-now )/1000000 ) );
+}
+
+void SimStation::sendDue()
+{
+	qint64 now = siMonotonicNsecs();
+	QByteArray out;
+	while( !pending.isEmpty() && pending.first().due <= now )
+		out.append( pending.takeFirst().data );
+	if ( !out.isEmpty() && ::write( masterfd, out.constData(), out.length() ) != out.length() )
+		qWarning( "Short write to pseudo terminal" );
+	if ( !pending.isEmpty() )
+		sendtimer->start( (int)qMax( (qint64)0, ( pending.first().due-now )/1000000 ) );
+}
+
+void SimStation::removeCard()
+{
+	bool ext = extended();
+	if ( ext )
+		send( SICardRemoved, card.detectData(), true );
+	else if ( card.type() == SiCard::Card5 )
+		send( BaseSICard5Detected, QByteArray( 1, 'O' ), false, false );
+	card = SimCard();
+}
+
+void SimStation::insertCard()
+{
+	if ( memory.at(SiProto::StationMode) != SiProto::StationReadSICards || cardtypes.isEmpty() )
+		return;
+	if ( !card.isNull() )
+		removeCard();
+	bool ext = extended();
+	SiCard::CardType t = cardtypes.at( qrand()%cardtypes.count() );
+	// Only card 5 and 6 exist for the base protocol
+	if ( !ext && t != SiCard::Card5 )
+		t = SiCard::Card6;
+	card = SimCard::generate( t );
+	cardsinserted++;
+	storeCard( card );
+	if ( t == SiCard::Card5 ) {
+		if ( ext )
+			send( SICard5Detected, card.detectData(), true );
+		else
+			send( BaseSICard5Detected, QByteArray( 1, 'I' ), false, false );
+	} else if ( t == SiCard::Card6 ) {
+		send( ext ? SICard6Detected : BaseSICard6Detected, card.detectData(), ext );
+	} else {
+		send( SICard89ptDetected, card.detectData(), true );
+	}
+}
+
+// A card punching a control station: the record goes to the backup memory
+// and with auto send out also to the serial port.
+void SimStation::punch()
+{
+	int mode = memory.at(SiProto::StationMode);
+	if ( mode == SiProto::StationReadSICards )
+		return;
+	SimCard c = SimCard::generate( cardtypes.isEmpty() ? SiCard::Card8 : cardtypes.at( qrand()%cardtypes.count() ) );
+	if ( c.isNull() )
+		return;
+	punches++;
+	QDateTime dt = QDateTime::currentDateTime().addMSecs( clockoffset );
+	int secs = QTime( 0, 0 ).secsTo( dt.time() );
+	bool pm = secs >= 43200;
+	secs %= 43200;
+	QByteArray si = c.detectData();
+	int addr = backupPointer();
+
+	// SI2 SI1 SI0 DATE1 DATE0 TH TL MS
+	QByteArray rec;
+	rec.append( si.mid( 1 ) );
+	rec.append( ((dt.date().year()-2000)<<2)|(dt.date().month()>>2) );
+	rec.append( ((dt.date().month()&0x3)<<6)|(dt.date().day()<<1)|( pm ? 1 : 0 ) );
+	rec.append( secs>>8 );
+	rec.append( secs&0xFF );
+	rec.append( dt.time().msec()*256/1000 );
+	storeBackup( rec );
+
+	if ( !( memory.at(SiProto::ProtocolConf) & SiProto::FlagAutoSendOut ) )
+		return;
+	QByteArray ba;
+	if ( extended() ) {
+		// SI3 SI2 SI1 SI0 TD TH TL TSS MEM2 MEM1 MEM0
+		ba.append( si );
+		ba.append( ((dt.date().dayOfWeek()%7)<<1)|( pm ? 1 : 0 ) );
+		ba.append( secs>>8 );
+		ba.append( secs&0xFF );
+		ba.append( dt.time().msec()*256/1000 );
+		ba.append( (addr>>16)&0xFF );
+		ba.append( (addr>>8)&0xFF );
+		ba.append( addr&0xFF );
+		send( TransmitRecord, ba, true );
+	} else {
+		// SI2 SI1 SI0 TD TH TL
+		ba.append( si.mid( 1 ) );
+		ba.append( ((dt.date().dayOfWeek()%7)<<1)|( pm ? 1 : 0 ) );
+		ba.append( secs>>8 );
+		ba.append( secs&0xFF );
+		send( BaseTransmitRecord, ba, false );
+	}
+}
+
+void SimStation::setStatsInterval( int msecs )
+{
+	if ( msecs > 0 )
+		statstimer->start( msecs );
+	else
+		statstimer->stop();
+}
+
+void SimStation::printStats()
+{
+	printf( "%s\n", qPrintable( stats() ) );
+	fflush( stdout );
+}
+
+QString SimStation::stats() const
+{
+	return QString( "frames in %1 out %2, bad in %3, naks %4, corrupted %5, cards %6 inserted %7 read, %8 punches, backup %9 bytes" )
+		.arg( framesin ).arg( framesout ).arg( badframes ).arg( naks ).arg( corrupted )
+		.arg( cardsinserted ).arg( cardsread ).arg( punches ).arg( backupPointer()-BackupStart );
+}
@@ -0,0 +1,112 @@
+#ifndef SIMSTATION_H
+#define SIMSTATION_H
+
+#include <QObject>
+#include <QByteArray>
+#include <QList>
+
+#include "simcard.h"
+
+class QSocketNotifier;
+class QTimer;
+
+// SportIdent BSM/BSF station on the master side of a pseudo terminal.
+// SiProto opens the slave side like a station on a serial port.
+class SimStation : public QObject
+{
+	Q_OBJECT
+
+	public:
+		SimStation( QObject *parent = 0 );
+		~SimStation();
+
+		bool open();
+		QString deviceName() const { return slavename; }
+		QString lasterror;
+
+		// Card insertions per minute in readout mode, 0 disables
+		void setCardRate( int perminute );
+		void setCardTypes( const QList<SiCard::CardType> &types ) { cardtypes = types; }
+		// Punches per minute in control mode, 0 disables
+		void setPunchRate( int perminute );
+		// Reply delay in ms
+		void setLatency( int ms ) { latency = ms; }
+		// Emulated line speed, 0 sends at once
+		void setBaud( int b ) { baud = b; }
+		// Fraction of requests answered with NAK
+		void setNakRate( double r ) { nakrate = r; }
+		// Fraction of frames sent with one corrupted byte
+		void setCorruptRate( double r ) { corruptrate = r; }
+		void setExtended( bool ext );
+		void setStationMode( int mode );
+		void setStationCode( int code );
+		void setAutoSend( bool on );
+		// Adds count punches or, in readout mode, cards to the backup memory
+		void fillBackup( int count );
+
+		QString stats() const;
+		// Prints stats() every msecs
+		void setStatsInterval( int msecs );
+
+	private slots:
+		void readInput();
+		void sendDue();
+		void insertCard();
+		void punch();
+		void printStats();
+
+	private:
+		struct Pending {
+			qint64 due;
+			QByteArray data;
+		};
+
+		bool extended() const;
+		void handleFrame( unsigned char cmnd, const QByteArray &data );
+		void send( unsigned char cmnd, const QByteArray &data, bool extendedframe, bool withcn = true );
+		void queue( const QByteArray &frame );
+		void sendCardBlocks( unsigned char cmnd, const QList<int> &blocks );
+		void removeCard();
+		void storeCard( const SimCard &c );
+		void storeBackup( const QByteArray &ba );
+		void setBackupPointer( int addr );
+		int backupPointer() const;
+		QByteArray stationTime( bool extendedframe ) const;
+		void setStationTime( const QByteArray &data );
+
+		int masterfd;
+		int slavefd;
+		QString slavename;
+		QSocketNotifier *notifier;
+		QByteArray inbuf;
+
+		QList<Pending> pending;
+		qint64 lastdue;
+		QTimer *sendtimer;
+
+		QTimer *cardtimer;
+		QTimer *punchtimer;
+		QTimer *statstimer;
+		QList<SiCard::CardType> cardtypes;
+		SimCard card;
+
+		QByteArray memory;
+		QByteArray backup;
+		qint64 clockoffset; // msecs
+
+		int latency;
+		int baud;
+		double nakrate;
+		double corruptrate;
+
+		int framesin;
+		int framesout;
+		int naks;
+		int corrupted;
+		int badframes;
+		int cardsinserted;
+		int cardsread;
+		int punches;
+};
+
+#endif
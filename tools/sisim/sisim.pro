@@ -0,0 +1,17 @@
+TEMPLATE = app
+TARGET = sisim
+PRE_TARGETDEPS += ../../lib/libqsilib.a
+DEPENDPATH += .
+INCLUDEPATH += . ../../lib
+QMAKE_LIBDIR += ../../lib
+CONFIG += console
+
+LIBS += -lqsilib
+
+SOURCES += main.cpp \
+    simcard.cpp \
+    simstation.cpp
+
+HEADERS += \
+    simcard.h \
+    simstation.h